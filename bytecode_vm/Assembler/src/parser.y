@@ -11,51 +11,184 @@ extern FILE *yyin;
 // Output file 
 FILE *out_file; 
 
-// Bytecode buffer 
-long bytecode[4096]; 
-int pc = 0; // Program counter is now an index into the long array
+// Bytecode buffer, grown as needed
+long *bytecode = NULL; 
+long bytecode_size = 0; 
+long pc = 0; // Program counter is now an index into the long array
 
-// Symbol table for labels 
-#define MAX_LABELS 100 
+// Initialized data, built by the directives after .data
+long *data_image = NULL; 
+long data_image_size = 0; 
+long dc = 0; // Data counter: the data memory index of the next word
+int in_data = 0; // Whether lines go to data (after .data) or code
+int ref_line = 0; // Line of the data label being resolved
+int errors = 0; // Errors reported by yyerror() in the second pass
+
+// Symbol table for labels, with a hash index for lookups
+#define LABEL_CODE 0 // A code address
+#define LABEL_DATA 1 // A data memory index
 struct label { 
     char *name; 
     long address; 
+    int kind; 
 };
-struct label symbol_table[MAX_LABELS]; 
+struct label *symbol_table = NULL; 
 int label_count = 0; 
+long label_capacity = 0; 
+int *label_index = NULL; // Open addressing; -1 marks a free slot
+int index_size = 0; 
+
+// Source line of each instruction, for the .bvm line table
+struct line_entry { 
+    long address; 
+    long line; 
+};
+struct line_entry *line_table = NULL; 
+long line_count = 0; 
+long line_capacity = 0; 
 
 int pass = 1; // Current pass 
 
-// Function to add a label to the symbol table 
-void add_label(char *name, long address) { 
-    if (pass == 1) { 
-        if (label_count < MAX_LABELS) { 
-            symbol_table[label_count].name = strdup(name); 
-            symbol_table[label_count].address = address; 
-            label_count++; 
-        } else { 
-            yyerror("Too many labels"); 
-        } 
+static void *grow(void *array, long *capacity, long needed, size_t item) { 
+    if (needed <= *capacity) { 
+        return array; 
+    }
+    long n = *capacity ? *capacity : 256; 
+    while (n < needed) { 
+        n *= 2; 
+    }
+    array = realloc(array, n * item); 
+    if (!array) { 
+        fprintf(stderr, "Out of memory\n"); 
+        exit(1); 
+    }
+    *capacity = n; 
+    return array; 
+}
+
+static unsigned long hash_name(const char *name) { 
+    unsigned long h = 5381; 
+    while (*name) { 
+        h = h * 33 + (unsigned char)*name++; 
+    }
+    return h; 
+}
+
+// Slot of `name` in label_index, or of the free slot where it would go
+static int find_slot(const char *name) { 
+    int slot = hash_name(name) & (index_size - 1); 
+    while (label_index[slot] != -1 && 
+           strcmp(symbol_table[label_index[slot]].name, name) != 0) { 
+        slot = (slot + 1) & (index_size - 1); 
     }
+    return slot; 
 }
 
-// Function to lookup a label 
-long lookup_label(char *name) { 
+static void rebuild_index(int size) { 
+    free(label_index); 
+    index_size = size; 
+    label_index = malloc(size * sizeof(int)); 
+    if (!label_index) { 
+        fprintf(stderr, "Out of memory\n"); 
+        exit(1); 
+    }
+    memset(label_index, -1, size * sizeof(int)); 
     for (int i = 0; i < label_count; i++) { 
-        if (strcmp(symbol_table[i].name, name) == 0) { 
-            return symbol_table[i].address; 
+        label_index[find_slot(symbol_table[i].name)] = i; 
+    }
+}
+
+// Function to add a label to the symbol table 
+void add_label(char *name, long address, int kind) { 
+    if (pass == 1) { 
+        // Keep the index at most half full
+        if (2 * (label_count + 1) > index_size) { 
+            rebuild_index(index_size ? 2 * index_size : 256); 
         }
+        int slot = find_slot(name); 
+        if (label_index[slot] != -1) { 
+            return; // The first definition wins
+        }
+        symbol_table = grow(symbol_table, &label_capacity, label_count + 1, sizeof(struct label)); 
+        symbol_table[label_count].name = strdup(name); 
+        symbol_table[label_count].address = address; 
+        symbol_table[label_count].kind = kind; 
+        label_index[slot] = label_count++; 
     }
-    return -1;
+}
+
+// Function to lookup a label of the given kind 
+long lookup_label(char *name, int kind) { 
+    if (index_size == 0) { 
+        return -1; 
+    }
+    int slot = find_slot(name); 
+    if (label_index[slot] == -1 || symbol_table[label_index[slot]].kind != kind) { 
+        return -1; 
+    }
+    return symbol_table[label_index[slot]].address; 
 }
 
 // Function to emit a long
 void emit_long(long value) {
     if (pass == 2) {
+        bytecode = grow(bytecode, &bytecode_size, pc + 1, sizeof(long)); 
         bytecode[pc] = value;
     }
     pc++;
 }
+
+// Function to emit an opcode, recording the line it came from
+void emit_op(long opcode) { 
+    if (pass == 2) { 
+        if (in_data) { 
+            yyerror("Instruction in .data section"); 
+        }
+        line_table = grow(line_table, &line_capacity, line_count + 1, sizeof(struct line_entry)); 
+        line_table[line_count].address = pc; 
+        line_table[line_count].line = yylineno; 
+        line_count++; 
+    }
+    emit_long(opcode); 
+}
+
+// Function to emit `count` words of initialized data
+void emit_data(long value, long count) { 
+    if (pass == 2) { 
+        if (!in_data) { 
+            yyerror("Data directive outside .data section"); 
+        }
+        if (count < 0) { 
+            yyerror("Negative count"); 
+            return; 
+        }
+        data_image = grow(data_image, &data_image_size, dc + count, sizeof(long)); 
+        for (long i = 0; i < count; i++) { 
+            data_image[dc + i] = value; 
+        }
+    }
+    if (count > 0) { 
+        dc += count; 
+    }
+}
+
+// Function to resolve a data label, plus an offset, to a data memory index
+long data_address(char *name, long offset) { 
+    if (pass == 1) { 
+        return 0; // Placeholder for the index
+    }
+    long index = lookup_label(name, LABEL_DATA); 
+    if (index == -1) { 
+        // yylineno may be past the newline that ended the reference
+        int line = yylineno; 
+        yylineno = ref_line; 
+        yyerror("Data label not found"); 
+        yylineno = line; 
+        return 0; 
+    }
+    return index + offset; 
+}
+
 %} 
 
 %union { 
@@ -72,19 +205,59 @@ void emit_long(long value) {
 %token T_JMP T_JZ T_JNZ 
 %token T_STORE T_LOAD 
 %token T_CALL T_RET T_CONS
+%token T_DATA T_CODE T_WORD T_FILL T_ZERO
 %token <sval> T_LABEL
-%type <sval> label_def 
+%type <sval> label_def data_name 
+%type <ival> data_ref 
 
 %%
 
 program:
-    | program line 
+    lines 
+    | lines statement // The last line need not end in a newline
+    ;
+
+lines:
+    | lines line 
     ;
 
 line:
     '\n' 
-    | instruction '\n' 
-    | label_def '\n' { add_label($1, pc); } 
+    | statement '\n' 
+    ;
+
+statement:
+    instruction 
+    | directive 
+    | label_def { 
+        if (in_data) { 
+            add_label($1, dc, LABEL_DATA); 
+        } else { 
+            add_label($1, pc, LABEL_CODE); 
+        }
+    } 
+    ;
+
+directive:
+    T_DATA { in_data = 1; } 
+    | T_CODE { in_data = 0; } 
+    | T_WORD words 
+    | T_FILL T_INTEGER ',' T_INTEGER { emit_data($4, $2); } 
+    | T_ZERO T_INTEGER { emit_data(0, $2); } 
+    ;
+
+words:
+    T_INTEGER { emit_data($1, 1); } 
+    | words ',' T_INTEGER { emit_data($3, 1); } 
+    ;
+
+data_ref:
+    data_name { $$ = data_address($1, 0); } 
+    | data_name '+' T_INTEGER { $$ = data_address($1, $3); } 
+    ;
+
+data_name:
+    T_ID { $$ = $1; ref_line = yylineno; } 
     ;
 
 label_def:
@@ -92,26 +265,26 @@ label_def:
     ;
 
 instruction:
-    T_PUSH T_INTEGER { emit_long(0x01); emit_long($2); } 
-    | T_POP { emit_long(0x02); } 
-    | T_DUP { emit_long(0x03); } 
-    | T_PEEKPRINT { emit_long(0x04); } 
-    | T_HALT { emit_long(0xFF); } 
-    | T_ADD { emit_long(0x10); } 
-    | T_SUB { emit_long(0x11); } 
-    | T_MUL { emit_long(0x12); } 
-    | T_DIV { emit_long(0x13); } 
-    | T_CMP { emit_long(0x14); } 
-    | T_AND { emit_long(0x15); } 
-    | T_OR { emit_long(0x16); } 
-    | T_XOR { emit_long(0x17); } 
-    | T_NOT { emit_long(0x18); } 
-    | T_SHL { emit_long(0x19); } 
-    | T_SHR { emit_long(0x1A); } 
+    T_PUSH T_INTEGER { emit_op(0x01); emit_long($2); } 
+    | T_POP { emit_op(0x02); } 
+    | T_DUP { emit_op(0x03); } 
+    | T_PEEKPRINT { emit_op(0x04); } 
+    | T_HALT { emit_op(0xFF); } 
+    | T_ADD { emit_op(0x10); } 
+    | T_SUB { emit_op(0x11); } 
+    | T_MUL { emit_op(0x12); } 
+    | T_DIV { emit_op(0x13); } 
+    | T_CMP { emit_op(0x14); } 
+    | T_AND { emit_op(0x15); } 
+    | T_OR { emit_op(0x16); } 
+    | T_XOR { emit_op(0x17); } 
+    | T_NOT { emit_op(0x18); } 
+    | T_SHL { emit_op(0x19); } 
+    | T_SHR { emit_op(0x1A); } 
     | T_JMP T_ID { 
-        emit_long(0x20); 
+        emit_op(0x20); 
         if (pass == 2) { 
-            long addr = lookup_label($2); 
+            long addr = lookup_label($2, LABEL_CODE); 
             if (addr == -1) { 
                 yyerror("Label not found"); 
             }
@@ -121,9 +294,9 @@ instruction:
         }
     } 
     | T_JZ T_ID { 
-        emit_long(0x21); 
+        emit_op(0x21); 
         if (pass == 2) { 
-            long addr = lookup_label($2); 
+            long addr = lookup_label($2, LABEL_CODE); 
             if (addr == -1) { 
                 yyerror("Label not found"); 
             }
@@ -133,9 +306,9 @@ instruction:
         }
     } 
     | T_JNZ T_ID { 
-        emit_long(0x22); 
+        emit_op(0x22); 
         if (pass == 2) { 
-            long addr = lookup_label($2); 
+            long addr = lookup_label($2, LABEL_CODE); 
             if (addr == -1) { 
                 yyerror("Label not found"); 
             }
@@ -144,12 +317,14 @@ instruction:
             emit_long(0); // Placeholder for address
         }
     } 
-    | T_STORE T_INTEGER { emit_long(0x30); emit_long($2); } 
-    | T_LOAD T_INTEGER { emit_long(0x31); emit_long($2); } 
+    | T_STORE T_INTEGER { emit_op(0x30); emit_long($2); } 
+    | T_STORE data_ref { emit_op(0x30); emit_long($2); } 
+    | T_LOAD T_INTEGER { emit_op(0x31); emit_long($2); } 
+    | T_LOAD data_ref { emit_op(0x31); emit_long($2); } 
     | T_CALL T_ID { 
-        emit_long(0x40); 
+        emit_op(0x40); 
         if (pass == 2) { 
-            long addr = lookup_label($2); 
+            long addr = lookup_label($2, LABEL_CODE); 
             if (addr == -1) { 
                 yyerror("Label not found"); 
             }
@@ -158,14 +333,17 @@ instruction:
             emit_long(0); // Placeholder for address
         }
     } 
-    | T_RET { emit_long(0x41); } 
-    | T_CONS { emit_long(0x50); } 
+    | T_RET { emit_op(0x41); } 
+    | T_CONS { emit_op(0x50); } 
     ;
 
 %%
 
 void yyerror(const char *s) { 
     fprintf(stderr, "Error at line %d: %s\n", yylineno, s); 
+    if (pass == 2) { 
+        errors++; 
+    }
 }
 
 // Overriding yywrap to link multiple files 
@@ -173,10 +351,186 @@ int yywrap() {
     return 1;
 }
 
+// --- .bvm output (the layout is described in the VM's src/container.hpp) ---
+
+struct buffer { 
+    unsigned char *data; 
+    long size; 
+    long capacity; 
+};
+
+static void put_byte(struct buffer *b, unsigned char c) { 
+    b->data = grow(b->data, &b->capacity, b->size + 1, 1); 
+    b->data[b->size++] = c; 
+}
+
+static void put_le(struct buffer *b, unsigned long value, int bytes) { 
+    for (int i = 0; i < bytes; i++) { 
+        put_byte(b, (value >> (8 * i)) & 0xFF); 
+    }
+}
+
+static void put_varint(struct buffer *b, unsigned long value) { 
+    while (value >= 0x80) { 
+        put_byte(b, (value & 0x7F) | 0x80); 
+        value >>= 7; 
+    }
+    put_byte(b, value); 
+}
+
+static void put_zigzag(struct buffer *b, long value) { 
+    put_varint(b, ((unsigned long)value << 1) ^ (unsigned long)(value >> 63)); 
+}
+
+// CRC-32C (Castagnoli)
+static unsigned int crc32c(const unsigned char *bytes, long size) { 
+    unsigned int crc = 0xFFFFFFFFu; 
+    for (long i = 0; i < size; i++) { 
+        crc ^= bytes[i]; 
+        for (int k = 0; k < 8; k++) { 
+            crc = crc & 1 ? 0x82F63B78u ^ (crc >> 1) : crc >> 1; 
+        }
+    }
+    return crc ^ 0xFFFFFFFFu; 
+}
+
+static int has_operand(long opcode) { 
+    switch (opcode) { 
+    case 0x01: case 0x20: case 0x21: case 0x22: case 0x30: case 0x31: case 0x40: 
+        return 1; 
+    default: 
+        return 0; 
+    }
+}
+
+// Whether the data directives initialized any word to a nonzero value
+static int has_data(void) { 
+    for (long i = 0; i < dc; i++) { 
+        if (data_image[i] != 0) { 
+            return 1; 
+        }
+    }
+    return 0; 
+}
+
+#define SECTION_CODE 1 
+#define SECTION_DATA 2 
+#define SECTION_SYMBOLS 3 
+#define SECTION_LINES 4 
+#define MAX_SECTIONS 4 
+#define DATA_GAP 4 // Zero words that end a data run
+
+// Writes the program as a .bvm container; returns the bytes written
+long write_bvm(FILE *out) { 
+    struct buffer code = {0}, data = {0}, symbols = {0}, lines = {0}; 
+    unsigned long runs = 0; 
+
+    // Code: 1-byte opcodes, operands as zigzag varints
+    for (long i = 0; i < pc; i++) { 
+        put_byte(&code, bytecode[i]); 
+        if (has_operand(bytecode[i]) && i + 1 < pc) { 
+            put_zigzag(&code, bytecode[++i]); 
+        }
+    }
+    // Data: runs of words, leaving out zeros the VM starts with anyway
+    for (long i = 0; i < dc; ) { 
+        if (data_image[i] == 0) { 
+            i++; 
+            continue; 
+        }
+        long start = i, end = i; 
+        for (; i < dc && i - end < DATA_GAP; i++) { 
+            if (data_image[i] != 0) { 
+                end = i + 1; 
+            }
+        }
+        put_varint(&data, start); 
+        put_varint(&data, end - start); 
+        for (long k = start; k < end; k++) { 
+            put_zigzag(&data, data_image[k]); 
+        }
+        runs++; 
+        i = end; 
+    }
+    // Symbols: code and data labels
+    for (int i = 0; i < label_count; i++) { 
+        long length = strlen(symbol_table[i].name); 
+        put_byte(&symbols, symbol_table[i].kind); 
+        put_varint(&symbols, symbol_table[i].address); 
+        put_varint(&symbols, length); 
+        for (long k = 0; k < length; k++) { 
+            put_byte(&symbols, symbol_table[i].name[k]); 
+        }
+    }
+    // Lines: address and line deltas
+    for (long i = 0; i < line_count; i++) { 
+        put_varint(&lines, line_table[i].address - (i ? line_table[i - 1].address : 0)); 
+        put_zigzag(&lines, line_table[i].line - (i ? line_table[i - 1].line : 0)); 
+    }
+
+    // Programs without initialized data leave out the data section
+    struct buffer sections[MAX_SECTIONS] = {code}; 
+    unsigned int kinds[MAX_SECTIONS] = {SECTION_CODE}; 
+    unsigned long counts[MAX_SECTIONS] = {pc}; 
+    int count = 1; 
+    if (runs) { 
+        sections[count] = data; 
+        kinds[count] = SECTION_DATA; 
+        counts[count++] = runs; 
+    }
+    sections[count] = symbols; 
+    kinds[count] = SECTION_SYMBOLS; 
+    counts[count++] = label_count; 
+    sections[count] = lines; 
+    kinds[count] = SECTION_LINES; 
+    counts[count++] = line_count; 
+
+    // The section table, then the sections
+    struct buffer table = {0}; 
+    unsigned long offset = 16 + 24 * count; 
+    for (int i = 0; i < count; i++) { 
+        put_le(&table, kinds[i], 4); 
+        put_le(&table, counts[i], 4); 
+        put_le(&table, offset, 8); 
+        put_le(&table, sections[i].size, 4); 
+        put_le(&table, crc32c(sections[i].data, sections[i].size), 4); 
+        offset += sections[i].size; 
+    }
+
+    struct buffer header = {0}; 
+    put_byte(&header, 'B'); 
+    put_byte(&header, 'V'); 
+    put_byte(&header, 'M'); 
+    put_byte(&header, 0); 
+    put_le(&header, 1, 2); // Version
+    put_le(&header, 0, 2); // Flags
+    put_le(&header, count, 4); 
+    put_le(&header, crc32c(table.data, table.size), 4); 
+
+    fwrite(header.data, 1, header.size, out); 
+    fwrite(table.data, 1, table.size, out); 
+    long written = header.size + table.size; 
+    for (int i = 0; i < count; i++) { 
+        fwrite(sections[i].data, 1, sections[i].size, out); 
+        written += sections[i].size; 
+        free(sections[i].data); 
+    }
+    free(header.data); 
+    free(table.data); 
+    return written; 
+}
+
 // Redefine main to be in the parser file 
 int main(int argc, char **argv) { 
+    // --bvm writes a compact .bvm container instead of a raw image
+    const char *program_name = argv[0]; 
+    int bvm = argc > 1 && strcmp(argv[1], "--bvm") == 0; 
+    if (bvm) { 
+        argv++; 
+        argc--; 
+    }
     if (argc < 3) { 
-        fprintf(stderr, "Usage: %s <input_file> <output_file>\n", argv[0]); 
+        fprintf(stderr, "Usage: %s [--bvm] <input_file> <output_file>\n", program_name); 
         return 1;
     }
 
@@ -201,17 +555,38 @@ int main(int argc, char **argv) {
     // Second pass 
     pass = 2; 
     pc = 0; 
+    dc = 0; 
+    in_data = 0; 
     rewind(yyin); 
     yylineno = 1; 
     yyparse(); 
+    if (errors) { 
+        fclose(yyin); 
+        fclose(out_file); 
+        remove(argv[2]); 
+        return 1; 
+    }
 
     // Write the bytecode 
-    fwrite(bytecode, sizeof(long), pc, out_file); 
+    long written; 
+    if (bvm) { 
+        written = write_bvm(out_file); 
+    } else if (has_data()) { 
+        // A raw image is only code
+        fprintf(stderr, "Error: Initialized data needs --bvm\n"); 
+        fclose(yyin); 
+        fclose(out_file); 
+        remove(argv[2]); 
+        return 1; 
+    } else { 
+        fwrite(bytecode, sizeof(long), pc, out_file); 
+        written = pc * sizeof(long); 
+    }
 
     fclose(yyin); 
     fclose(out_file); 
 
-    printf("Assembly successful. Wrote %ld bytes.\n", pc * sizeof(long)); 
+    printf("Assembly successful. Wrote %ld bytes.\n", written); 
 
     return 0;
 }
@@ -12,11 +12,40 @@ NC='\033[0m' # No Color
 passed=0
 failed=0
 
+# Checks the --bvm container of $test_file against $test_name.bvm.expected
+check_bvm() {
+    bvm_expected="$TEST_DIR/$test_name.bvm.expected"
+    bvm_output="$TEST_DIR/$test_name.bvm"
+    echo "Running test: $test_name (--bvm)"
+    $ASSEMBLER --bvm $test_file $bvm_output
+    if [ $? -ne 0 ]; then
+        echo -e "${RED}FAIL:${NC} Assembler returned a non-zero exit code for $test_name (--bvm)."
+        failed=$((failed + 1))
+    elif diff -q $bvm_output $bvm_expected > /dev/null; then
+        echo -e "${GREEN}PASS:${NC} $test_name (--bvm)"
+        passed=$((passed + 1))
+    else
+        echo -e "${RED}FAIL:${NC} $test_name (--bvm)"
+        echo "Generated output:"
+        xxd $bvm_output
+        echo "Expected output:"
+        xxd $bvm_expected
+        failed=$((failed + 1))
+    fi
+    rm -f $bvm_output
+}
+
 for test_file in $(find $TEST_DIR -name "*.asm"); do
     test_name=$(basename $test_file .asm)
     expected_file="$TEST_DIR/$test_name.bin.expected"
     output_file="$TEST_DIR/$test_name.bin"
 
+    # Programs with initialized data only assemble to a .bvm
+    if [ ! -f $expected_file ] && [ -f "$TEST_DIR/$test_name.bvm.expected" ]; then
+        check_bvm
+        continue
+    fi
+
     echo "Running test: $test_name"
 
     # Run the assembler
@@ -49,6 +78,11 @@ for test_file in $(find $TEST_DIR -name "*.asm"); do
 
     # Clean up the generated binary
     rm $output_file
+
+    # Tests with a .bvm.expected also check the --bvm container
+    if [ -f "$TEST_DIR/$test_name.bvm.expected" ]; then
+        check_bvm
+    fi
 done
 
 echo
@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Exit immediately if a command exits with a non-zero status.
+set -e
+
+# Compares the raw .bin image with the .bvm container on generated
+# programs of 1,000 to 100,000 functions (about 10 instructions each).
+# Every program starts with HALT, so timing it measures loading alone.
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf $WORK_DIR' EXIT
+
+# Function i adds 3 to data[i % 1000], scales it and calls function i - 1
+# unless it came out zero.
+generate() {
+    awk -v n=$1 'BEGIN {
+        print "HALT"
+        for (i = 0; i < n; i++) {
+            printf "f%d:\n", i
+            printf "    LOAD %d\n    PUSH 3\n    ADD\n    DUP\n", i % 1000
+            printf "    JZ f%d_done\n    PUSH %d\n    MUL\n    STORE %d\n", i, i, i % 1000
+            if (i > 0)
+                printf "    CALL f%d\n", i - 1
+            printf "f%d_done:\n    RET\n", i
+        }
+    }'
+}
+
+files=()
+for n in 1000 10000 100000; do
+    generate $n > $WORK_DIR/gen_$n.asm
+    ../build/assembler $WORK_DIR/gen_$n.asm $WORK_DIR/gen_$n.bin > /dev/null
+    ../build/assembler --bvm $WORK_DIR/gen_$n.asm $WORK_DIR/gen_$n.bvm > /dev/null
+    files+=($WORK_DIR/gen_$n.bin $WORK_DIR/gen_$n.bvm)
+done
+
+../build/load_benchmark "${files[@]}" | sed "s|$WORK_DIR/||"
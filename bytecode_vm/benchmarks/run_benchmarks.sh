@@ -7,10 +7,11 @@ set -e
 TIMING_FILE=$(mktemp)
 trap 'rm -f $TIMING_FILE' EXIT
 
-# Assemble all benchmark files
+# Assemble all benchmark files, and translate them to native executables
 echo "Assembling benchmarks..."
 for bench_file in *.asm; do
     ../build/assembler "$bench_file" "${bench_file%.asm}.bin"
+    ../build/bvm-aot "${bench_file%.asm}.bin" -o "${bench_file%.asm}.native" > /dev/null
 done
 
 # Run benchmarks
@@ -20,34 +21,50 @@ echo "-------------------"
 
 run_benchmark() {
     local bin_file=$1
-    echo -n "Benchmarking $bin_file..."
-    
+    local engine=$2
+    echo -n "Benchmarking $bin_file ($engine)..."
+    echo "${bin_file%.bin} $engine" >> $TIMING_FILE
+
+    # "threaded" is the interpreter alone; "jit" also compiles hot code
+    local flags="--engine=$engine"
+    case $engine in
+        threaded) flags="--engine=threaded --no-jit" ;;
+        jit) flags="--engine=threaded" ;;
+    esac
+
     # Run the time command and capture stderr (where time outputs)
-    { time ../build/bvm "$bin_file" > /dev/null; } 2>> $TIMING_FILE
-    
+    if [ "$engine" = "aot" ]; then
+        { time "./${bin_file%.bin}.native" > /dev/null; } 2>> $TIMING_FILE
+    else
+        { time ../build/bvm "$bin_file" $flags > /dev/null; } 2>> $TIMING_FILE
+    fi
+
     echo " Done."
 }
 
-run_benchmark "simple_loop.bin"
-run_benchmark "iterative_factorial.bin"
-run_benchmark "recursive_fibonacci.bin"
+# Each benchmark runs under the stack interpreter, both fast engines and the
+# JIT, and as translated by bvm-aot.
+for bench in simple_loop iterative_factorial recursive_fibonacci; do
+    for engine in switch threaded register jit aot; do
+        run_benchmark "$bench.bin" "$engine"
+    done
+done
 
 echo ""
 echo "--------------------"
 echo "Benchmark Results:"
 echo "--------------------"
-printf "% -25s | % -10s\n" "Benchmark" "Time (real)"
-printf "% -25s | % -10s\n" "-------------------------" "----------"
+printf "% -25s | % -10s | % -10s\n" "Benchmark" "Engine" "Time (real)"
+printf "% -25s | % -10s | % -10s\n" "-------------------------" "----------" "----------"
 
 # Parse and print results
 awk '
-BEGIN { benchmark_index=0; benchmarks[0]="simple_loop"; benchmarks[1]="iterative_factorial"; benchmarks[2]="recursive_fibonacci"; }
-/real/ { 
-    time_val=$2; 
-    gsub(/0m/, "", time_val); 
-    gsub(/s/, "", time_val); 
-    printf "% -25s | % -10s\n", benchmarks[benchmark_index], time_val"s"; 
-    benchmark_index++; 
+NF == 2 && $1 != "real" && $1 != "user" && $1 != "sys" { name=$1; engine=$2; }
+/real/ {
+    time_val=$2;
+    gsub(/0m/, "", time_val);
+    gsub(/s/, "", time_val);
+    printf "% -25s | % -10s | % -10s\n", name, engine, time_val"s";
 }
 ' $TIMING_FILE
 
@@ -55,4 +72,4 @@ echo "--------------------"
 
 
 # Clean up
-rm -f *.bin
\ No newline at end of file
+rm -f *.bin *.native
\ No newline at end of file
@@ -17,8 +17,51 @@ run_test() {
     # Assemble the .asm file
     ../build/assembler "$test_file" "${test_file%.asm}.bin"
 
-    # Run the VM and capture the output
-    output=$(../build/bvm "${test_file%.asm}.bin" --verbose)
+    run_engines "$test_file" "${test_file%.asm}.bin" "${expected_stack[@]}"
+
+    # The same program as a .bvm container must run the same way.
+    ../build/assembler --bvm "$test_file" "${test_file%.asm}.bvm"
+    output=$(../build/bvm "${test_file%.asm}.bvm" --print-stack)
+    check_stack "$test_file" "bvm" "$output" "${expected_stack[@]}"
+
+    echo "Test passed: $test_file"
+}
+
+# Runs the assembled `image` of `test_file` on every engine
+run_engines() {
+    local test_file=$1
+    local image=$2
+    shift 2
+    local expected_stack=("$@")
+
+    # The stack interpreter (used for --verbose) is the reference; every
+    # other engine must leave the same stack behind. "jit" is the threaded
+    # engine compiling every loop and function the first time it is reached,
+    # "aot" the program translated to a native executable by bvm-aot.
+    for engine in switch threaded register jit aot; do
+        if [ "$engine" = "switch" ]; then
+            output=$(../build/bvm "$image" --verbose)
+        elif [ "$engine" = "jit" ]; then
+            output=$(../build/bvm "$image" --jit-threshold=1 --print-stack)
+        elif [ "$engine" = "aot" ]; then
+            ../build/bvm-aot "$image" -o "${image%.*}.native" > /dev/null
+            output=$("./${image%.*}.native" --print-stack)
+            rm -f "${image%.*}.native"
+        else
+            output=$(../build/bvm "$image" --engine=$engine --print-stack)
+        fi
+        check_stack "$test_file" "$engine" "$output" "${expected_stack[@]}"
+    done
+}
+
+# Checks that the stack printed in a VM run's output starts with the
+# expected stack
+check_stack() {
+    local test_file=$1
+    local engine=$2
+    local output=$3
+    shift 3
+    local expected_stack=("$@")
 
     # Extract the stack from the output
     actual_stack_str=$(echo "$output" | awk '/Stack \(top to bottom\):/{flag=1; next} flag{print}' | xargs)
@@ -27,7 +70,7 @@ run_test() {
 
     # Check if the actual stack starts with the expected stack
     if [ "${#actual_stack[@]}" -lt "${#expected_stack[@]}" ]; then
-        echo "Test failed: $test_file"
+        echo "Test failed: $test_file ($engine engine)"
         echo "Expected stack to have at least ${#expected_stack[@]} elements, but it has ${#actual_stack[@]}."
         echo "Expected stack: ${expected_stack[*]}"
         echo "Actual stack:   ${actual_stack[*]}"
@@ -36,13 +79,23 @@ run_test() {
 
     for i in "${!expected_stack[@]}"; do
         if [[ "${actual_stack[i]}" != "${expected_stack[i]}" ]]; then
-            echo "Test failed: $test_file"
+            echo "Test failed: $test_file ($engine engine)"
             echo "Expected stack: ${expected_stack[*]}"
             echo "Actual stack:   ${actual_stack[*]}"
             exit 1
         fi
     done
+}
+
+# Programs with initialized data only assemble to a .bvm
+run_bvm_test() {
+    local test_file=$1
+    shift
+    local expected_stack=("$@")
 
+    echo "Running test: $test_file (.bvm)"
+    ../build/assembler --bvm "$test_file" "${test_file%.asm}.bvm"
+    run_engines "$test_file" "${test_file%.asm}.bvm" "${expected_stack[@]}"
     echo "Test passed: $test_file"
 }
 
@@ -57,10 +110,11 @@ run_test "test_halt.asm" "(empty)"
 run_test "test_memory.asm" "123"
 run_test "test_loops.asm" "0" "1" "2" "3" "4" "5"
 run_test "test_factorial.asm" "120"
+run_bvm_test "test_tables.asm" "0" "11002" "-1"
 
 
-# Clean up the generated .bin files
+# Clean up the generated .bin and .bvm files
 echo "Cleaning up..."
-rm -f *.bin
+rm -f *.bin *.bvm
 
 echo "All pipeline tests passed!"
@@ -0,0 +1,22 @@
+; Initialized data: tables and constants, addressed by data labels
+.data
+primes:
+.word 2, 3, 5, 7, 11
+scale:
+.word 1000
+masks:
+.fill 3, -1
+buffer:
+.zero 4
+
+.code
+LOAD primes+4
+LOAD scale
+MUL
+LOAD primes
+ADD
+STORE buffer+3
+LOAD masks+2
+LOAD buffer+3
+LOAD buffer
+HALT
@@ -0,0 +1,102 @@
+#include "aot.hpp"
+#include "op_codes.hpp"
+#include <climits>
+#include <set>
+#include <vector>
+
+static void emit_word(long value, std::ostream &out) {
+  if (value == LONG_MIN)
+    out << "LONG_MIN";
+  else
+    out << value << "L";
+}
+
+void emit_aot_source(const Program &program, const long *data,
+                     unsigned long data_words, std::ostream &out) {
+  // Basic blocks start at branch and call targets and at return addresses.
+  std::vector<bool> labelled(program.size(), false);
+  std::set<unsigned long> returns;
+  for (unsigned long i = 0; i + 1 < program.size(); ++i) {
+    const Instruction &ins = program.at(i);
+    if (is_branch(ins.op))
+      labelled[ins.operand] = true;
+    if (ins.op == CALL) {
+      labelled[i + 1] = true;
+      returns.insert(program.at(i + 1).pc);
+    }
+  }
+
+  // Data memory starts zeroed, so only words up to the last nonzero one.
+  unsigned long initialized = data_words;
+  while (initialized && data[initialized - 1] == 0)
+    --initialized;
+
+  out << "// Generated by bvm-aot. Do not edit.\n"
+      << "#include \"aot_runtime.hpp\"\n\n";
+  if (initialized) {
+    out << "static const long aot_data[" << initialized << "] = {";
+    for (unsigned long i = 0; i < initialized; ++i) {
+      out << (i % 8 ? " " : "\n   ");
+      emit_word(data[i], out);
+      out << ",";
+    }
+    out << "\n};\n\n";
+  }
+  out << "void aot_program(VM &vm) {\n"
+      << "  AOT_BEGIN(vm);\n";
+  if (initialized)
+    out << "  AOT_DATA(aot_data);\n";
+
+  for (unsigned long i = 0; i < program.size(); ++i) {
+    const Instruction &ins = program.at(i);
+    unsigned long pc = ins.pc;
+    if (labelled[i])
+      out << "L" << pc << ":\n";
+
+    out << "  ";
+    switch (ins.op) {
+    case PUSH:
+      out << "AOT_PUSH(" << pc << ", ";
+      emit_word(ins.operand, out);
+      out << ");\n";
+      break;
+    case STORE:
+    case LOAD:
+      out << "AOT_" << opcodeToString((Opcode)ins.op) << "(" << pc << ", "
+          << ins.operand << ");\n";
+      break;
+    case JMP:
+    case JZ:
+    case JNZ:
+      out << "AOT_" << opcodeToString((Opcode)ins.op) << "(" << pc << ", L"
+          << program.at(ins.operand).pc << ");\n";
+      break;
+    case CALL:
+      out << "AOT_CALL(" << pc << ", " << program.at(i + 1).pc << ", L"
+          << program.at(ins.operand).pc << ");\n";
+      break;
+    case RET:
+      // Only CALL pushes return addresses, so one of these always matches.
+      out << "AOT_RET(" << pc << ");\n"
+          << "  switch (a) {\n";
+      for (unsigned long ret : returns)
+        out << "  case " << ret << ":\n"
+            << "    goto L" << ret << ";\n";
+      out << "  }\n"
+          << "  AOT_OFF_END(" << pc << ");\n";
+      break;
+    case HALT:
+      out << "AOT_HALT(" << pc << ", " << program.at(i + 1).pc << ");\n";
+      break;
+    case OP_END:
+      out << "AOT_OFF_END(" << pc << ");\n";
+      break;
+    default:
+      out << "AOT_" << opcodeToString((Opcode)ins.op) << "(" << pc << ");\n";
+      break;
+    }
+  }
+
+  out << "  AOT_END();\n"
+      << "}\n";
+}
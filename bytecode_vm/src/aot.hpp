@@ -0,0 +1,23 @@
+#ifndef AOT_HPP
+#define AOT_HPP
+
+#include "program.hpp"
+#include <ostream>
+
+// Ahead-of-time translation.
+//
+// bvm-aot turns an assembled .bin or .bvm into C++ that is compiled and
+// linked against the VM core (its stacks, data memory and GC) and the main()
+// in aot_runtime.cpp, giving a standalone executable. The control-flow graph
+// is recovered from the decoded program: every JMP/JZ/JNZ/CALL target and
+// every return address starts a basic block, branches become gotos and RET
+// switches on the popped return address over the program's return sites.
+// A .bvm's initialized data is compiled in as an array that aot_program()
+// copies into data memory before the first instruction.
+
+// Writes the translation of a decoded (unfused) program to `out`, starting
+// with data memory as in `data` (of `data_words` words).
+void emit_aot_source(const Program &program, const long *data,
+                     unsigned long data_words, std::ostream &out);
+
+#endif // AOT_HPP
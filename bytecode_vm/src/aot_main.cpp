@@ -0,0 +1,112 @@
+#include "aot.hpp"
+#include "vm.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Where the runtime was built; set by the Makefile.
+#ifndef AOT_CXX
+#define AOT_CXX "g++ -std=c++17 -O2"
+#endif
+#ifndef AOT_INCLUDE_DIR
+#define AOT_INCLUDE_DIR "src"
+#endif
+#ifndef AOT_RUNTIME
+#define AOT_RUNTIME "build/libbvm_aot.a"
+#endif
+
+// Runs `args` with the program in args[0] looked up on PATH, without a
+// shell, so paths need no quoting. Returns true if it exits with status 0.
+static bool run(const std::vector<std::string> &args) {
+  std::vector<char *> argv;
+  for (const std::string &arg : args)
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  argv.push_back(nullptr);
+  pid_t pid = fork();
+  if (pid < 0)
+    throw std::runtime_error("Cannot start " + args[0]);
+  if (pid == 0) {
+    execvp(argv[0], argv.data());
+    perror(argv[0]);
+    _exit(127);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      throw std::runtime_error("Cannot wait for " + args[0]);
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  std::string filename;
+  std::string output;
+  bool emit_cpp = false;
+
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <bytecode_file> -o <output>"
+              << " [--emit-cpp]" << std::endl;
+    return 1;
+  }
+
+  filename = argv[1];
+
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-o" && i + 1 < argc) {
+      output = argv[++i];
+    } else if (arg == "--emit-cpp") {
+      emit_cpp = true;
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 1;
+    }
+  }
+  if (output.empty()) {
+    std::cerr << "No output file given (-o <output>)" << std::endl;
+    return 1;
+  }
+
+  try {
+    // Load through the VM so the image is validated exactly as bvm would.
+    VM vm;
+    vm.fusion = false;
+    vm.load(filename);
+
+    // With --emit-cpp the translation is the output; otherwise it is
+    // compiled next to it and removed once compiled.
+    std::string source = emit_cpp ? output : output + ".cpp";
+    std::ofstream file(source);
+    if (!file)
+      throw std::runtime_error("Cannot write " + source);
+    emit_aot_source(vm.program, vm.data_memory.base(), vm.data_memory.size(),
+                    file);
+    file.close();
+    if (!file)
+      throw std::runtime_error("Cannot write " + source);
+    if (emit_cpp)
+      return 0;
+
+    // AOT_CXX is the compiler followed by its flags.
+    std::vector<std::string> command;
+    std::istringstream words(AOT_CXX);
+    for (std::string word; words >> word;)
+      command.push_back(word);
+    command.insert(command.end(), {std::string("-I") + AOT_INCLUDE_DIR, source,
+                                   AOT_RUNTIME, "-o", output});
+    // The translation is kept for the compiler's messages to refer to.
+    if (!run(command))
+      throw std::runtime_error("Compiling " + source + " failed");
+    std::remove(source.c_str());
+  } catch (const std::runtime_error &e) {
+    std::cerr << "AOT Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
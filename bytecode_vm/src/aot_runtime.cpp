@@ -0,0 +1,32 @@
+#include "aot_runtime.hpp"
+#include <string>
+
+// main() of every program built by bvm-aot. The translated code itself is
+// aot_program(), generated by emit_aot_source().
+
+int main(int argc, char *argv[]) {
+  bool print_stack = false;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--print-stack") {
+      print_stack = true;
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--print-stack]" << std::endl;
+      return 1;
+    }
+  }
+
+  VM vm;
+  try {
+    std::cout << "VM running..." << std::endl;
+    vm.guard_overflow(aot_program);
+    if (print_stack) {
+      vm.printStack();
+    }
+  } catch (const std::runtime_error &e) {
+    std::cerr << "VM Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,168 @@
+#ifndef AOT_RUNTIME_HPP
+#define AOT_RUNTIME_HPP
+
+#include "vm.hpp"
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+// Support code for programs translated by bvm-aot (see aot.hpp).
+//
+// A translated program is a single function, aot_program(), with a label per
+// basic block and one of the macros below per instruction. They are the
+// threaded engine's handlers (engine.cpp) without the dispatch: the stack
+// pointers live in locals and the VM is only updated when the program halts
+// or fails, so the final stack, pc and error messages match the interpreter.
+// Each macro takes the address of the instruction it implements, which is
+// what `vm.pc` is left at if it fails. As in the threaded engine, pushes are
+// not checked: aot_program() is run under VM::guard_overflow.
+
+// Runs the translated program on `vm`. Throws std::runtime_error on errors.
+void aot_program(VM &vm);
+
+#define AOT_BEGIN(vm)                                                          \
+  VM &aot_vm = (vm);                                                           \
+  long *const data = aot_vm.data_memory.base();                                \
+  StackItem *const stack_base = aot_vm.register_stack.base();                  \
+  StackItem *sp = stack_base + aot_vm.register_stack.get_size();               \
+  StackItem *const calls_base = aot_vm.call_stack.base();                      \
+  StackItem *csp = calls_base + aot_vm.call_stack.get_size();                  \
+  const char *error = nullptr;                                                 \
+  unsigned long at = 0;                                                        \
+  long a, b;                                                                   \
+  (void)data;                                                                  \
+  (void)a;                                                                     \
+  (void)b
+// Copies the program's initialized data (an array) into data memory.
+#define AOT_DATA(words)                                                        \
+  std::copy(std::begin(words), std::end(words), data)
+
+#define AOT_END()                                                              \
+  aot_leave:                                                                   \
+  aot_vm.pc = at;                                                              \
+  aot_vm.register_stack.set_size(sp - stack_base);                             \
+  aot_vm.call_stack.set_size(csp - calls_base);                                \
+  if (error)                                                                   \
+    throw std::runtime_error(error)
+
+#define AOT_FAIL(pc, msg)                                                      \
+  do {                                                                         \
+    error = msg;                                                               \
+    at = (pc);                                                                 \
+    goto aot_leave;                                                            \
+  } while (0)
+#define AOT_NEED(pc, n)                                                        \
+  if (sp - stack_base < (n))                                                   \
+  AOT_FAIL(pc, "Stack Underflow")
+#define AOT_PUSH_INT(v) (sp++)->bits = StackItem::tag(v)
+#define AOT_BINARY(pc, expr)                                                   \
+  do {                                                                         \
+    AOT_NEED(pc, 2);                                                           \
+    b = sp[-1].value();                                                        \
+    a = sp[-2].value();                                                        \
+    --sp;                                                                      \
+    sp[-1].bits = StackItem::tag(expr);                                        \
+  } while (0)
+// Like AOT_BINARY, with `a` and `b` the tagged words and `expr` tagged.
+#define AOT_TAGGED(pc, expr)                                                   \
+  do {                                                                         \
+    AOT_NEED(pc, 2);                                                           \
+    b = sp[-1].bits;                                                           \
+    a = sp[-2].bits;                                                           \
+    --sp;                                                                      \
+    sp[-1].bits = (expr);                                                      \
+  } while (0)
+
+#define AOT_NOP(pc)
+#define AOT_PUSH(pc, k) AOT_PUSH_INT(k)
+#define AOT_POP(pc)                                                            \
+  do {                                                                         \
+    AOT_NEED(pc, 1);                                                           \
+    --sp;                                                                      \
+  } while (0)
+#define AOT_DUP(pc)                                                            \
+  do {                                                                         \
+    if (sp == stack_base)                                                      \
+      AOT_FAIL(pc, "Stack Underflow: Cannot duplicate from an empty stack.");  \
+    *sp = sp[-1];                                                              \
+    ++sp;                                                                      \
+  } while (0)
+#define AOT_PEEKPRINT(pc)                                                      \
+  do {                                                                         \
+    AOT_NEED(pc, 1);                                                           \
+    std::cout << sp[-1].value() << std::endl;                                  \
+  } while (0)
+#define AOT_ADD(pc) AOT_TAGGED(pc, tagged_add(a, b))
+#define AOT_SUB(pc) AOT_TAGGED(pc, tagged_sub(a, b))
+#define AOT_MUL(pc) AOT_TAGGED(pc, tagged_mul(a, b))
+#define AOT_DIV(pc)                                                            \
+  do {                                                                         \
+    AOT_NEED(pc, 2);                                                           \
+    if (sp[-1].value() == 0)                                                   \
+      AOT_FAIL(pc, "VM Runtime Error: Division by zero.");                     \
+    AOT_BINARY(pc, a / b);                                                     \
+  } while (0)
+#define AOT_CMP(pc) AOT_BINARY(pc, a < b ? 1 : 0)
+#define AOT_AND(pc) AOT_TAGGED(pc, tagged_and(a, b))
+#define AOT_OR(pc) AOT_TAGGED(pc, tagged_or(a, b))
+#define AOT_XOR(pc) AOT_TAGGED(pc, tagged_xor(a, b))
+#define AOT_NOT(pc)                                                            \
+  do {                                                                         \
+    AOT_NEED(pc, 1);                                                           \
+    sp[-1].bits = StackItem::tag(~sp[-1].value());                             \
+  } while (0)
+#define AOT_SHL(pc) AOT_BINARY(pc, a << b)
+#define AOT_SHR(pc) AOT_BINARY(pc, a >> b)
+#define AOT_JMP(pc, label) goto label
+#define AOT_JZ(pc, label)                                                      \
+  do {                                                                         \
+    AOT_NEED(pc, 1);                                                           \
+    if ((--sp)->value() == 0)                                                  \
+      goto label;                                                              \
+  } while (0)
+#define AOT_JNZ(pc, label)                                                     \
+  do {                                                                         \
+    AOT_NEED(pc, 1);                                                           \
+    if ((--sp)->value() != 0)                                                  \
+      goto label;                                                              \
+  } while (0)
+#define AOT_STORE(pc, i)                                                       \
+  do {                                                                         \
+    AOT_NEED(pc, 1);                                                           \
+    data[i] = (--sp)->value();                                                 \
+  } while (0)
+#define AOT_LOAD(pc, i) AOT_PUSH_INT(data[i])
+// `ret` is the address after the CALL.
+#define AOT_CALL(pc, ret, label)                                               \
+  do {                                                                         \
+    (csp++)->bits = StackItem::tag(ret);                                       \
+    goto label;                                                                \
+  } while (0)
+// Pops the return address into `a`; the translation then switches on it.
+#define AOT_RET(pc)                                                            \
+  do {                                                                         \
+    if (csp == calls_base)                                                     \
+      AOT_FAIL(pc, "Stack Underflow");                                         \
+    a = (--csp)->value();                                                      \
+  } while (0)
+#define AOT_CONS(pc)                                                           \
+  do {                                                                         \
+    AOT_NEED(pc, 2);                                                           \
+    aot_vm.register_stack.set_size(sp - stack_base);                           \
+    Object *obj = aot_vm.cons();                                               \
+    --sp;                                                                      \
+    sp[-1].bits = StackItem::tag((long)obj, true);                             \
+  } while (0)
+// `next` is the address after the HALT.
+#define AOT_HALT(pc, next)                                                     \
+  do {                                                                         \
+    at = (next);                                                               \
+    goto aot_leave;                                                            \
+  } while (0)
+// Execution ran past the last instruction, at address `pc`.
+#define AOT_OFF_END(pc)                                                        \
+  AOT_FAIL(pc, "VM Runtime Error: Program Counter out of bounds.")
+
+#endif // AOT_RUNTIME_HPP
@@ -0,0 +1,292 @@
+#include "container.hpp"
+#include "program.hpp"
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+static unsigned int crc32c_table(const unsigned char *bytes,
+                                 unsigned long size) {
+  static const std::array<unsigned int, 256> table = [] {
+    std::array<unsigned int, 256> t;
+    for (unsigned int i = 0; i < 256; ++i) {
+      unsigned int c = i;
+      for (int k = 0; k < 8; ++k)
+        c = c & 1 ? 0x82F63B78u ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
+  unsigned int crc = 0xFFFFFFFFu;
+  for (unsigned long i = 0; i < size; ++i)
+    crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFFu;
+}
+
+#if defined(__x86_64__)
+// SSE 4.2's crc32 instruction computes CRC-32C eight bytes at a time.
+__attribute__((target("sse4.2"))) static unsigned int
+crc32c_sse42(const unsigned char *bytes, unsigned long size) {
+  unsigned long crc = 0xFFFFFFFFu;
+  for (; size >= 8; size -= 8, bytes += 8) {
+    unsigned long word;
+    memcpy(&word, bytes, 8);
+    crc = __builtin_ia32_crc32di(crc, word);
+  }
+  for (; size; --size)
+    crc = __builtin_ia32_crc32qi(crc, *bytes++);
+  return crc ^ 0xFFFFFFFFu;
+}
+#endif
+
+unsigned int crc32c(const unsigned char *bytes, unsigned long size) {
+#if defined(__x86_64__)
+  static const bool sse42 = __builtin_cpu_supports("sse4.2");
+  if (sse42)
+    return crc32c_sse42(bytes, size);
+#endif
+  return crc32c_table(bytes, size);
+}
+
+bool is_container(const unsigned char *bytes, unsigned long size) {
+  return size >= 4 && memcmp(bytes, BVM_MAGIC, 4) == 0;
+}
+
+static void corrupt(const char *what) {
+  throw std::runtime_error(std::string("VM Load Error: Corrupt ") + what +
+                           " in .bvm file.");
+}
+
+static unsigned long get_le(const unsigned char *p, int bytes) {
+  unsigned long v = 0;
+  for (int i = bytes - 1; i >= 0; --i)
+    v = v << 8 | p[i];
+  return v;
+}
+
+// Reads the varints of one section.
+class SectionReader {
+public:
+  SectionReader(const unsigned char *p, unsigned long size, const char *what)
+      : p(p), end(p + size), what(what) {}
+
+  bool done() const { return p == end; }
+  unsigned char byte() {
+    if (p == end)
+      corrupt(what);
+    return *p++;
+  }
+  unsigned long varint() {
+    // Most operands fit in one byte.
+    if (p != end && *p < 0x80)
+      return *p++;
+    unsigned long v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      unsigned char b = byte();
+      v |= (unsigned long)(b & 0x7F) << shift;
+      if (!(b & 0x80))
+        return v;
+    }
+    corrupt(what);
+    return 0;
+  }
+  long zigzag() {
+    unsigned long v = varint();
+    return (long)(v >> 1) ^ -(long)(v & 1);
+  }
+  const unsigned char *bytes(unsigned long n) {
+    if ((unsigned long)(end - p) < n)
+      corrupt(what);
+    const unsigned char *start = p;
+    p += n;
+    return start;
+  }
+
+private:
+  const unsigned char *p;
+  const unsigned char *end;
+  const char *what;
+};
+
+static void read_code(const unsigned char *bytes, unsigned long size,
+                      unsigned long words, Memory &program) {
+  // Every word takes at least a byte.
+  if (words > size)
+    corrupt("code section");
+  static const std::array<bool, 256> operand = [] {
+    std::array<bool, 256> t;
+    for (unsigned int op = 0; op < 256; ++op)
+      t[op] = has_operand(op);
+    return t;
+  }();
+  program.resize(words);
+  long *image = program.base();
+  SectionReader in(bytes, size, "code section");
+  unsigned long pc = 0;
+  while (!in.done()) {
+    if (pc == words)
+      corrupt("code section");
+    unsigned char op = in.byte();
+    image[pc++] = op;
+    if (operand[op]) {
+      if (pc == words)
+        corrupt("code section");
+      image[pc++] = in.zigzag();
+    }
+  }
+  if (pc != words)
+    corrupt("code section");
+}
+
+static void read_data(const unsigned char *bytes, unsigned long size,
+                      unsigned long runs, Memory &data) {
+  SectionReader in(bytes, size, "data section");
+  long *mem = data.base();
+  for (unsigned long r = 0; r < runs; ++r) {
+    unsigned long start = in.varint();
+    unsigned long length = in.varint();
+    if (start > data.size() || length > data.size() - start)
+      throw std::runtime_error(
+          "VM Load Error: Initialized data does not fit in data memory.");
+    for (unsigned long i = 0; i < length; ++i)
+      mem[start + i] = in.zigzag();
+  }
+  if (!in.done())
+    corrupt("data section");
+}
+
+void DebugInfo::clear() {
+  file.release();
+  symbols = Section();
+  lines = Section();
+  symbols_read = false;
+  label_map.clear();
+  data_label_map.clear();
+  line_table.clear();
+}
+
+void DebugInfo::read_symbols() {
+  if (!symbols_read && symbols.count) {
+    if (crc32c(symbols.bytes, symbols.size) != symbols.checksum)
+      corrupt("symbol section");
+    SectionReader in(symbols.bytes, symbols.size, "symbol section");
+    for (unsigned long i = 0; i < symbols.count; ++i) {
+      unsigned char kind = in.byte();
+      unsigned long value = in.varint();
+      unsigned long length = in.varint();
+      std::string name((const char *)in.bytes(length), length);
+      if (kind == SYMBOL_CODE)
+        label_map.emplace(name, value);
+      else if (kind == SYMBOL_DATA)
+        data_label_map.emplace(name, value);
+      else
+        corrupt("symbol section");
+    }
+    if (!in.done())
+      corrupt("symbol section");
+  }
+  symbols_read = true;
+}
+
+const std::map<std::string, unsigned long> &DebugInfo::labels() {
+  read_symbols();
+  return label_map;
+}
+
+const std::map<std::string, unsigned long> &DebugInfo::data_labels() {
+  read_symbols();
+  return data_label_map;
+}
+
+unsigned long DebugInfo::line_of(unsigned long address) {
+  if (lines.count && line_table.empty()) {
+    if (crc32c(lines.bytes, lines.size) != lines.checksum)
+      corrupt("line section");
+    SectionReader in(lines.bytes, lines.size, "line section");
+    unsigned long at = 0;
+    long line = 0;
+    for (unsigned long i = 0; i < lines.count; ++i) {
+      at += in.varint();
+      line += in.zigzag();
+      line_table.push_back({at, (unsigned long)line});
+    }
+    if (!in.done())
+      corrupt("line section");
+  }
+  // The last entry at or before `address`.
+  unsigned long lo = 0, hi = line_table.size();
+  while (lo < hi) {
+    unsigned long mid = (lo + hi) / 2;
+    if (line_table[mid].first <= address)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo ? line_table[lo - 1].second : 0;
+}
+
+void read_container(int fd, unsigned long size, LoadMode mode,
+                    Memory &program, Memory &data, DebugInfo &debug) {
+  debug.clear();
+  try {
+    debug.file.map_file(fd, size, mode);
+  } catch (const std::runtime_error &) {
+    throw std::runtime_error("VM Load Error: Could not map file.");
+  }
+  const unsigned char *bytes = (const unsigned char *)debug.file.data();
+
+  if (size < BVM_HEADER_SIZE)
+    corrupt("header");
+  unsigned long version = get_le(bytes + 4, 2);
+  unsigned long flags = get_le(bytes + 6, 2);
+  unsigned long sections = get_le(bytes + 8, 4);
+  if (version != BVM_VERSION)
+    throw std::runtime_error("VM Load Error: Unsupported .bvm version " +
+                             std::to_string(version) + ".");
+  if (flags != 0)
+    throw std::runtime_error("VM Load Error: Unsupported .bvm flags " +
+                             std::to_string(flags) + ".");
+  if (sections > (size - BVM_HEADER_SIZE) / BVM_SECTION_SIZE ||
+      crc32c(bytes + BVM_HEADER_SIZE, sections * BVM_SECTION_SIZE) !=
+          get_le(bytes + 12, 4))
+    corrupt("section table");
+
+  bool have_code = false;
+  for (unsigned long s = 0; s < sections; ++s) {
+    const unsigned char *entry =
+        bytes + BVM_HEADER_SIZE + s * BVM_SECTION_SIZE;
+    DebugInfo::Section section;
+    unsigned long kind = get_le(entry, 4);
+    section.count = get_le(entry + 4, 4);
+    unsigned long offset = get_le(entry + 8, 8);
+    section.size = get_le(entry + 16, 4);
+    section.checksum = get_le(entry + 20, 4);
+    if (offset > size || section.size > size - offset)
+      corrupt("section table");
+    section.bytes = bytes + offset;
+
+    // Code and data are checked now, debug info when it is first used.
+    switch (kind) {
+    case SECTION_CODE:
+      if (have_code || crc32c(section.bytes, section.size) != section.checksum)
+        corrupt("code section");
+      read_code(section.bytes, section.size, section.count, program);
+      have_code = true;
+      break;
+    case SECTION_DATA:
+      if (crc32c(section.bytes, section.size) != section.checksum)
+        corrupt("data section");
+      read_data(section.bytes, section.size, section.count, data);
+      break;
+    case SECTION_SYMBOLS:
+      debug.symbols = section;
+      break;
+    case SECTION_LINES:
+      debug.lines = section;
+      break;
+    default: // Added by a later version; not needed to run the program
+      break;
+    }
+  }
+  if (!have_code || program.size() == 0)
+    throw std::runtime_error("VM Load Error: .bvm file has no code.");
+}
@@ -0,0 +1,97 @@
+#ifndef CONTAINER_HPP
+#define CONTAINER_HPP
+
+#include "memory.hpp"
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The .bvm container written by `assembler --bvm`, the compact alternative
+// to a raw .bin image. All integers are little-endian:
+//
+//   header    "BVM\0", u16 version, u16 flags, u32 section count, u32
+//             checksum of the section table
+//   table     per section: u32 kind, u32 count, u64 offset from the start of
+//             the file, u32 size, u32 checksum of the section
+//   CODE      the image's `count` words, as a 1-byte opcode per instruction
+//             followed by its operand, if any, as a zigzag varint
+//   DATA      `count` runs of initialized data memory: varint start, varint
+//             length, then `length` zigzag varint words
+//   SYMBOLS   `count` labels: u8 kind, varint value, varint name length, name
+//   LINES     `count` entries, by address: varint address delta, zigzag
+//             varint source line delta
+//
+// Varints are LEB128 and checksums CRC-32C. Addresses are image word
+// addresses, exactly as in a .bin, so jump operands, breakpoints and error
+// messages mean the same in both formats. Sections of unknown kinds are
+// skipped; unknown flags and versions are rejected.
+
+#define BVM_MAGIC "BVM"
+#define BVM_VERSION 1
+#define BVM_HEADER_SIZE 16
+#define BVM_SECTION_SIZE 24
+
+enum SectionKind {
+  SECTION_CODE = 1,
+  SECTION_DATA = 2,
+  SECTION_SYMBOLS = 3,
+  SECTION_LINES = 4,
+};
+
+enum SymbolKind {
+  SYMBOL_CODE = 0, // A code label; the value is its address
+  SYMBOL_DATA = 1, // A data label; the value is its data memory index
+};
+
+// What a .bvm carries besides code and data. Only the debugger needs it, so
+// it keeps the file mapped and reads the sections in place the first time
+// they are asked for. Until then their pages are not even read in, and
+// that is also when a damaged one is reported.
+class DebugInfo {
+public:
+  void clear();
+
+  // Code labels by name.
+  const std::map<std::string, unsigned long> &labels();
+  // Data labels by name.
+  const std::map<std::string, unsigned long> &data_labels();
+  // Source line of the instruction at `address`, or 0 if unknown.
+  unsigned long line_of(unsigned long address);
+
+private:
+  friend void read_container(int fd, unsigned long size, LoadMode mode,
+                             Memory &program, Memory &data,
+                             DebugInfo &debug);
+
+  void read_symbols();
+
+  struct Section {
+    const unsigned char *bytes = nullptr;
+    unsigned long size = 0;
+    unsigned long count = 0;
+    unsigned int checksum = 0;
+  };
+
+  Region file;
+  Section symbols, lines;
+  bool symbols_read = false;
+  std::map<std::string, unsigned long> label_map, data_label_map;
+  std::vector<std::pair<unsigned long, unsigned long>> line_table;
+};
+
+// Whether the `size` bytes at `bytes` start like a .bvm container. No raw
+// image does: its first word would be an unknown opcode.
+bool is_container(const unsigned char *bytes, unsigned long size);
+
+// Maps the .bvm of `size` bytes open on `fd` and unpacks it: `program`
+// receives the code as an image in the .bin layout, `data` the initialized
+// data and `debug` the symbols and lines. Throws std::runtime_error with a
+// "VM Load Error" diagnostic if the file is damaged or does not fit.
+void read_container(int fd, unsigned long size, LoadMode mode,
+                    Memory &program, Memory &data, DebugInfo &debug);
+
+// CRC-32C (Castagnoli) of `size` bytes, in hardware where the CPU has it.
+unsigned int crc32c(const unsigned char *bytes, unsigned long size);
+
+#endif // CONTAINER_HPP
@@ -0,0 +1,467 @@
+#include "vm.hpp"
+#include "op_codes.hpp"
+#include <iostream>
+#include <stdexcept>
+
+// Threaded execution engine.
+//
+// This is the production interpreter: it executes the decoded Program built
+// by VM::load, whose instructions carry the address of their handler, and
+// dispatches with computed gotos (a GCC/Clang extension) so every handler
+// ends in its own indirect jump instead of funnelling through a shared
+// switch. Opcodes, branch targets and memory indices were validated when the
+// program was decoded, so the only checks left on the hot path are for stack
+// underflow and division by zero. There are no verbose/debug checks and no
+// exceptions: HALT simply leaves the loop and runtime errors jump to a single
+// exit that throws after the machine state has been written back.
+//
+// Pushes are not checked at all: each stack ends in a guard page (see
+// region.hpp), and VM::run turns a push into it into a "Stack Overflow"
+// error. Such an overflow bypasses the exit, so the stack that overflowed is
+// left full and pc and the other stack are left as they were on entry.
+//
+// Programs the verifier accepted (see verifier.hpp) run in an instantiation
+// without the underflow checks either, as long as the run starts where the
+// verification did: at address 0 with empty stacks.
+//
+// Stack slots are tagged words (see stack.hpp) holding 63-bit values. Data
+// memory holds plain longs, which only agree with the values stored modulo
+// 2^63: a cell is wrapped when it is loaded, so the superinstructions that
+// update memory in place need not wrap their results. A slot compares with a
+// tagged integer as their values do, so the fused compares skip the untagging.
+//
+// Superinstructions (see fusion.cpp) first check that the whole sequence can
+// run without a stack error. If it cannot, they fall back to the handler of
+// the first instruction as written, so errors are reported exactly as the
+// unfused sequence would report them.
+//
+// With the JIT enabled, the targets of CALLs and backward branches get a
+// counting handler instead of their own. Once one has been reached
+// `jit_code.threshold` times, the region starting there is compiled (see
+// jit.hpp) and the handler is replaced by one that enters the native code.
+// Native code returns here at the instruction it could not run, whose
+// normal handler then executes it.
+//
+// `bvm --profile` runs instantiations that also report every instruction,
+// CALL and RET to `profiler` (see profiler.hpp), and `bvm --trace` ones that
+// append every instruction to `tracer` (see trace.hpp). They link the
+// instructions as written rather than the superinstructions, and never the
+// JIT, so that each address is seen by itself. The other instantiations
+// compile the hooks away.
+//
+// Debugger requests (SIGUSR1 setting debug_mode, or stats_requested) and
+// sample requests are only polled on taken control transfers, which is enough
+// to guarantee that any running program notices them promptly. When one is
+// seen, the engine stops and returns false so VM::run can continue in the
+// checked loop. It does the same at breakpoints, which are patched into the
+// instructions as OP_BREAK (see Program::set_break), so runs without any
+// check for none.
+
+static inline bool pending_request(const bool &flag) {
+  return *(volatile const bool *)&flag;
+}
+
+bool VM::run_threaded() {
+  if (profile)
+    return unchecked ? run_threaded<false, INSTRUMENT_PROFILE>()
+                     : run_threaded<true, INSTRUMENT_PROFILE>();
+  if (tracer.active())
+    return unchecked ? run_threaded<false, INSTRUMENT_TRACE>()
+                     : run_threaded<true, INSTRUMENT_TRACE>();
+  return unchecked ? run_threaded<false, INSTRUMENT_NONE>()
+                   : run_threaded<true, INSTRUMENT_NONE>();
+}
+
+template <bool checked, Instrumentation instrument> bool VM::run_threaded() {
+  static const void *table[OPCODE_TABLE_SIZE];
+  static bool table_ready = false;
+  if (!table_ready) {
+    table[NOP] = &&op_nop;
+    table[PUSH] = &&op_push;
+    table[POP] = &&op_pop;
+    table[DUP] = &&op_dup;
+    table[PEEKPRINT] = &&op_peekprint;
+    table[ADD] = &&op_add;
+    table[SUB] = &&op_sub;
+    table[MUL] = &&op_mul;
+    table[DIV] = &&op_div;
+    table[CMP] = &&op_cmp;
+    table[AND] = &&op_and;
+    table[OR] = &&op_or;
+    table[XOR] = &&op_xor;
+    table[NOT] = &&op_not;
+    table[SHL] = &&op_shl;
+    table[SHR] = &&op_shr;
+    table[JMP] = &&op_jmp;
+    table[JZ] = &&op_jz;
+    table[JNZ] = &&op_jnz;
+    table[STORE] = &&op_store;
+    table[LOAD] = &&op_load;
+    table[CALL] = &&op_call;
+    table[RET] = &&op_ret;
+    table[CONS] = &&op_cons;
+    table[HALT] = &&op_halt;
+    table[OP_END] = &&op_end;
+    table[OP_DUP_PUSH_CMP_JNZ] = &&op_dup_push_cmp_jnz;
+    table[OP_DUP_PUSH_CMP_JZ] = &&op_dup_push_cmp_jz;
+    table[OP_DUP_JZ] = &&op_dup_jz;
+    table[OP_DUP_JNZ] = &&op_dup_jnz;
+    table[OP_PUSH_ADD] = &&op_push_add;
+    table[OP_PUSH_SUB] = &&op_push_sub;
+    table[OP_LOAD_JZ] = &&op_load_jz;
+    table[OP_LOAD_ADD_STORE] = &&op_load_add_store;
+    table[OP_LOAD_PUSH_ADD_STORE] = &&op_load_push_add_store;
+    table[OP_LOAD_PUSH_SUB_STORE] = &&op_load_push_sub_store;
+    table[OP_PUSH_PUSH_ADD_POP] = &&op_push_push_add_pop;
+    table[OP_BREAK] = &&op_break;
+    table_ready = true;
+  }
+
+  if (program.linked != table) {
+    for (unsigned long i = 0; i < program.size(); ++i)
+      program.at(i).handler =
+          table[instrument != INSTRUMENT_NONE && !program.is_break(i)
+                    ? program.at(i).op
+                    : program.at(i).exec];
+    if (jit && instrument == INSTRUMENT_NONE && Jit::supported()) {
+      for (unsigned long i = 0; i < program.size(); ++i) {
+        const Instruction &ins = program.at(i);
+        bool backward = is_branch(ins.op) && (unsigned long)ins.operand <= i;
+        if (ins.op == CALL || backward) {
+          program.at(ins.operand).handler =
+              jit_code.compiled(ins.operand) ? &&op_jit : &&op_count;
+        }
+      }
+    }
+    program.linked = table;
+  }
+
+  long start = program.index_of(pc);
+  if (start < 0)
+    throw std::runtime_error(
+        "VM Runtime Error: Program Counter out of bounds.");
+
+  Instruction *const code = program.data();
+  const long *const index_of = program.index_table();
+  long *const data = data_memory.base();
+
+  StackItem *const stack_base = register_stack.base();
+  StackItem *const stack_limit = stack_base + register_stack.capacity();
+  StackItem *sp = stack_base + register_stack.get_size();
+
+  StackItem *const calls_base = call_stack.base();
+  StackItem *const calls_limit = calls_base + call_stack.capacity();
+  StackItem *csp = calls_base + call_stack.get_size();
+
+  const Instruction *ip = code + start;
+  const char *error = nullptr;
+  long a, b;
+  bool halted = false;
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (instrument == INSTRUMENT_PROFILE)                                      \
+      profiler.step(ip - code);                                                \
+    if (instrument == INSTRUMENT_TRACE && ip->exec != OP_BREAK)                \
+      tracer.record(code, *ip, sp - stack_base,                                \
+                    sp > stack_base ? sp[-1].bits : 0);                        \
+    goto *ip->handler;                                                         \
+  } while (0)
+#define FAIL(msg)                                                              \
+  do {                                                                         \
+    error = msg;                                                               \
+    goto leave;                                                                \
+  } while (0)
+#define NEED(n)                                                                \
+  if (checked && sp - stack_base < (n))                                        \
+  FAIL("Stack Underflow")
+#define PUSH_INT(v) (sp++)->bits = StackItem::tag(v)
+#define JUMP_TO(index)                                                         \
+  do {                                                                         \
+    ip = code + (index);                                                       \
+    if (pending_request(debug_mode) || pending_request(stats_requested) ||     \
+        pending_request(sample_requested))                                     \
+      goto leave;                                                              \
+  } while (0)
+#define UNFUSED_UNLESS(cond)                                                   \
+  if (checked && !(cond))                                                      \
+  goto *table[ip->op]
+#define BINARY(expr)                                                           \
+  NEED(2);                                                                     \
+  b = sp[-1].value();                                                          \
+  a = sp[-2].value();                                                          \
+  --sp;                                                                        \
+  sp[-1].bits = StackItem::tag(expr);                                          \
+  ++ip;                                                                        \
+  DISPATCH()
+// Like BINARY, with `a` and `b` the tagged words and `expr` tagged.
+#define TAGGED(expr)                                                           \
+  NEED(2);                                                                     \
+  b = sp[-1].bits;                                                             \
+  a = sp[-2].bits;                                                             \
+  --sp;                                                                        \
+  sp[-1].bits = (expr);                                                        \
+  ++ip;                                                                        \
+  DISPATCH()
+
+  if (instrument == INSTRUMENT_PROFILE)
+    profiler.start();
+  DISPATCH();
+
+op_nop:
+  ++ip;
+  DISPATCH();
+op_push:
+  PUSH_INT(ip->operand);
+  ++ip;
+  DISPATCH();
+op_pop:
+  NEED(1);
+  --sp;
+  ++ip;
+  DISPATCH();
+op_dup:
+  if (checked && sp == stack_base)
+    FAIL("Stack Underflow: Cannot duplicate from an empty stack.");
+  *sp = sp[-1];
+  ++sp;
+  ++ip;
+  DISPATCH();
+op_peekprint:
+  NEED(1);
+  std::cout << sp[-1].value() << std::endl;
+  ++ip;
+  DISPATCH();
+op_add:
+  TAGGED(tagged_add(a, b));
+op_sub:
+  TAGGED(tagged_sub(a, b));
+op_mul:
+  TAGGED(tagged_mul(a, b));
+op_div:
+  NEED(2);
+  if (sp[-1].value() == 0)
+    FAIL("VM Runtime Error: Division by zero.");
+  BINARY(a / b);
+op_cmp:
+  BINARY(a < b ? 1 : 0);
+op_and:
+  TAGGED(tagged_and(a, b));
+op_or:
+  TAGGED(tagged_or(a, b));
+op_xor:
+  TAGGED(tagged_xor(a, b));
+op_not:
+  NEED(1);
+  sp[-1].bits = StackItem::tag(~sp[-1].value());
+  ++ip;
+  DISPATCH();
+op_shl:
+  BINARY(a << b);
+op_shr:
+  BINARY(a >> b);
+op_jmp:
+  JUMP_TO(ip->operand);
+  DISPATCH();
+op_jz:
+  NEED(1);
+  --sp;
+  if (sp->value() == 0) {
+    JUMP_TO(ip->operand);
+  } else {
+    ++ip;
+  }
+  DISPATCH();
+op_jnz:
+  NEED(1);
+  --sp;
+  if (sp->value() != 0) {
+    JUMP_TO(ip->operand);
+  } else {
+    ++ip;
+  }
+  DISPATCH();
+op_store:
+  NEED(1);
+  data[ip->operand] = (--sp)->value();
+  ++ip;
+  DISPATCH();
+op_load:
+  PUSH_INT(data[ip->operand]);
+  ++ip;
+  DISPATCH();
+op_call:
+  (csp++)->bits = StackItem::tag(ip[1].pc);
+  if (instrument == INSTRUMENT_PROFILE)
+    profiler.call(ip->operand);
+  JUMP_TO(ip->operand);
+  DISPATCH();
+op_ret:
+  if (checked && csp == calls_base)
+    FAIL("Stack Underflow");
+  --csp;
+  if (instrument == INSTRUMENT_PROFILE)
+    profiler.ret();
+  // Return addresses are only ever pushed by CALL, so they always map to an
+  // instruction.
+  JUMP_TO(index_of[csp->value()]);
+  DISPATCH();
+op_cons: {
+  NEED(2);
+  register_stack.set_size(sp - stack_base); // The roots, if it collects
+  Object *obj = cons();
+  --sp;
+  sp[-1].bits = StackItem::tag((long)obj, true);
+  ++ip;
+  DISPATCH();
+}
+op_halt:
+  ++ip;
+  halted = true;
+  goto leave;
+op_break:
+  // VM::run stops here, or runs the instruction with VM::step.
+  goto leave;
+
+op_count: {
+  unsigned long index = ip - code;
+  if (++jit_code.counts[index] < jit_code.threshold)
+    goto *table[ip->exec];
+  if (!jit_code.compiled(index) &&
+      !jit_code.compile(program, register_code, index)) {
+    code[index].handler = table[ip->exec]; // Stop counting
+    goto *table[ip->exec];
+  }
+  code[index].handler = &&op_jit;
+}
+  // Fall through
+op_jit: {
+  JitState state;
+  state.sp = sp;
+  state.csp = csp;
+  state.stack_base = stack_base;
+  state.stack_limit = stack_limit;
+  state.calls_base = calls_base;
+  state.calls_limit = calls_limit;
+  state.data = data;
+  state.index_of = index_of;
+  state.native = jit_code.native_table();
+  state.debug_mode = &debug_mode;
+  state.stats_requested = &stats_requested;
+  state.sample_requested = &sample_requested;
+  ip = code + jit_code.enter(ip - code, state);
+  sp = state.sp;
+  csp = state.csp;
+  if (pending_request(debug_mode) || pending_request(stats_requested) ||
+      pending_request(sample_requested))
+    goto leave;
+  goto *table[ip->exec];
+}
+op_end:
+  FAIL("VM Runtime Error: Program Counter out of bounds.");
+
+  // DUP; PUSH k; CMP; JNZ L  ->  if (top < k) goto L
+op_dup_push_cmp_jnz:
+  UNFUSED_UNLESS(sp > stack_base && stack_limit - sp >= 2);
+  if (sp[-1].bits < StackItem::tag(ip[1].operand)) {
+    JUMP_TO(ip[3].operand);
+  } else {
+    ip += 4;
+  }
+  DISPATCH();
+  // DUP; PUSH k; CMP; JZ L  ->  if (!(top < k)) goto L
+op_dup_push_cmp_jz:
+  UNFUSED_UNLESS(sp > stack_base && stack_limit - sp >= 2);
+  if (!(sp[-1].bits < StackItem::tag(ip[1].operand))) {
+    JUMP_TO(ip[3].operand);
+  } else {
+    ip += 4;
+  }
+  DISPATCH();
+  // DUP; JZ L  ->  if (top == 0) goto L
+op_dup_jz:
+  UNFUSED_UNLESS(sp > stack_base && sp < stack_limit);
+  if (sp[-1].value() == 0) {
+    JUMP_TO(ip[1].operand);
+  } else {
+    ip += 2;
+  }
+  DISPATCH();
+  // DUP; JNZ L  ->  if (top != 0) goto L
+op_dup_jnz:
+  UNFUSED_UNLESS(sp > stack_base && sp < stack_limit);
+  if (sp[-1].value() != 0) {
+    JUMP_TO(ip[1].operand);
+  } else {
+    ip += 2;
+  }
+  DISPATCH();
+  // PUSH k; ADD  ->  top += k
+op_push_add:
+  UNFUSED_UNLESS(sp > stack_base && sp < stack_limit);
+  sp[-1].bits = tagged_add(sp[-1].bits, StackItem::tag(ip->operand));
+  ip += 2;
+  DISPATCH();
+  // PUSH k; SUB  ->  top -= k
+op_push_sub:
+  UNFUSED_UNLESS(sp > stack_base && sp < stack_limit);
+  sp[-1].bits = tagged_sub(sp[-1].bits, StackItem::tag(ip->operand));
+  ip += 2;
+  DISPATCH();
+  // LOAD i; JZ L  ->  if (mem[i] == 0) goto L
+op_load_jz:
+  UNFUSED_UNLESS(sp < stack_limit);
+  if (StackItem::tag(data[ip->operand]) == 0) {
+    JUMP_TO(ip[1].operand);
+  } else {
+    ip += 2;
+  }
+  DISPATCH();
+  // LOAD i; ADD; STORE i  ->  mem[i] += pop
+  // Memory holds what LOAD would push: the sum wrapped to a slot's range.
+op_load_add_store:
+  UNFUSED_UNLESS(sp > stack_base && sp < stack_limit);
+  --sp;
+  data[ip->operand] = wrap_value((long)((unsigned long)data[ip->operand] +
+                                        (unsigned long)sp->value()));
+  ip += 3;
+  DISPATCH();
+  // LOAD i; PUSH k; ADD; STORE i  ->  mem[i] += k
+op_load_push_add_store:
+  UNFUSED_UNLESS(stack_limit - sp >= 2);
+  data[ip->operand] = wrap_value((long)((unsigned long)data[ip->operand] +
+                                        (unsigned long)ip[1].operand));
+  ip += 4;
+  DISPATCH();
+  // LOAD i; PUSH k; SUB; STORE i  ->  mem[i] -= k
+op_load_push_sub_store:
+  UNFUSED_UNLESS(stack_limit - sp >= 2);
+  data[ip->operand] = wrap_value((long)((unsigned long)data[ip->operand] -
+                                        (unsigned long)ip[1].operand));
+  ip += 4;
+  DISPATCH();
+  // PUSH a; PUSH b; ADD; POP  ->  nothing
+op_push_push_add_pop:
+  UNFUSED_UNLESS(stack_limit - sp >= 2);
+  ip += 4;
+  DISPATCH();
+
+#undef DISPATCH
+#undef FAIL
+#undef NEED
+#undef PUSH_INT
+#undef JUMP_TO
+#undef UNFUSED_UNLESS
+#undef BINARY
+#undef TAGGED
+
+leave:
+  if (instrument == INSTRUMENT_PROFILE)
+    profiler.stop();
+  pc = ip->pc;
+  register_stack.set_size(sp - stack_base);
+  call_stack.set_size(csp - calls_base);
+  if (error)
+    throw std::runtime_error(error);
+  return halted;
+}
@@ -0,0 +1,162 @@
+#include "op_codes.hpp"
+#include "program.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+
+// Superinstruction fusion.
+//
+// Each pattern below is an idiom that shows up in the benchmarks and the
+// pipeline tests. Fusing it turns several dispatches into one and lets the
+// handler skip the intermediate pushes and pops. Patterns are tried longest
+// first at every instruction, including instructions inside another fused
+// sequence, so that a jump into the middle of a sequence still lands on the
+// best available handler.
+
+struct FusionPattern {
+  unsigned short fused;
+  unsigned int length;
+  unsigned short ops[4];
+  bool same_index; // First and last operand must name the same memory cell
+};
+
+static const FusionPattern patterns[] = {
+    {OP_DUP_PUSH_CMP_JNZ, 4, {DUP, PUSH, CMP, JNZ}, false},
+    {OP_DUP_PUSH_CMP_JZ, 4, {DUP, PUSH, CMP, JZ}, false},
+    {OP_LOAD_PUSH_ADD_STORE, 4, {LOAD, PUSH, ADD, STORE}, true},
+    {OP_LOAD_PUSH_SUB_STORE, 4, {LOAD, PUSH, SUB, STORE}, true},
+    {OP_PUSH_PUSH_ADD_POP, 4, {PUSH, PUSH, ADD, POP}, false},
+    {OP_LOAD_ADD_STORE, 3, {LOAD, ADD, STORE}, true},
+    {OP_DUP_JZ, 2, {DUP, JZ}, false},
+    {OP_DUP_JNZ, 2, {DUP, JNZ}, false},
+    {OP_PUSH_ADD, 2, {PUSH, ADD}, false},
+    {OP_PUSH_SUB, 2, {PUSH, SUB}, false},
+    {OP_LOAD_JZ, 2, {LOAD, JZ}, false},
+};
+
+unsigned int fused_length(unsigned int exec) {
+  for (const FusionPattern &p : patterns) {
+    if (p.fused == exec)
+      return p.length;
+  }
+  return 1;
+}
+
+unsigned long Program::fuse(const FusionProfile *profile,
+                            unsigned long min_count) {
+  unsigned long fused = 0;
+  // The sentinel is never part of a pattern.
+  unsigned long count = code.size() - 1;
+
+  unpatched.clear();
+  for (unsigned long i = 0; i < count; ++i) {
+    Instruction &head = code[i];
+    head.exec = head.op;
+
+    if (profile) {
+      FusionProfile::const_iterator hits = profile->find(head.pc);
+      if (hits == profile->end() || hits->second < min_count)
+        continue;
+    }
+
+    for (const FusionPattern &p : patterns) {
+      if (i + p.length > count)
+        continue;
+      bool match = true;
+      for (unsigned int k = 0; k < p.length && match; ++k)
+        match = code[i + k].op == p.ops[k];
+      if (match && p.same_index)
+        match = code[i].operand == code[i + p.length - 1].operand;
+      if (match) {
+        head.exec = p.fused;
+        ++fused;
+        break;
+      }
+    }
+  }
+
+  linked = nullptr;
+  return fused;
+}
+
+void Program::unfuse() {
+  unpatched.clear();
+  for (Instruction &ins : code)
+    ins.exec = ins.op;
+  linked = nullptr;
+}
+
+// Breaks. A superinstruction runs its whole sequence in one dispatch, so a
+// break inside one would never be seen: every sequence reaching the break is
+// unfused while it is set.
+
+// The longest sequence a superinstruction covers.
+static const unsigned long MAX_FUSED = 4;
+
+void Program::set_break(unsigned long index) {
+  if (is_break(index))
+    return;
+  unsigned long from = index >= MAX_FUSED - 1 ? index - (MAX_FUSED - 1) : 0;
+  for (unsigned long j = from; j <= index; ++j) {
+    auto saved = unpatched.find(j);
+    unsigned short exec =
+        saved != unpatched.end() ? saved->second : code[j].exec;
+    if (j < index && fused_length(exec) <= index - j)
+      continue;
+    unpatched.emplace(j, code[j].exec);
+    if (j == index)
+      code[j].exec = OP_BREAK;
+    else if (!is_break(j))
+      code[j].exec = code[j].op;
+  }
+  linked = nullptr;
+}
+
+void Program::clear_break(unsigned long index) {
+  if (!is_break(index))
+    return;
+  code[index].exec = code[index].op;
+  unsigned long from = index >= MAX_FUSED - 1 ? index - (MAX_FUSED - 1) : 0;
+  for (unsigned long j = from; j <= index; ++j) {
+    if (unpatched.count(j) && !is_break(j))
+      restore(j);
+  }
+  linked = nullptr;
+}
+
+void Program::restore(unsigned long index) {
+  unsigned short exec = unpatched.at(index);
+  // Still unfused if another break lies inside the sequence.
+  for (unsigned long k = index + 1; k < index + fused_length(exec); ++k) {
+    if (is_break(k)) {
+      code[index].exec = code[index].op;
+      return;
+    }
+  }
+  code[index].exec = exec;
+  unpatched.erase(index);
+}
+
+FusionProfile load_fusion_profile(const std::string &filename) {
+  std::ifstream in(filename);
+  if (!in)
+    throw std::runtime_error("Could not open fusion profile " + filename);
+
+  FusionProfile profile;
+  std::string line;
+  while (std::getline(in, line)) {
+    const char *p = line.c_str();
+    char *end;
+    unsigned long pc = std::strtoul(p, &end, 10);
+    if (end == p)
+      continue; // Header or comment
+    p = end;
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      ++p;
+    unsigned long count = std::strtoul(p, &end, 10);
+    if (end == p)
+      continue;
+    profile[pc] += count;
+  }
+  return profile;
+}
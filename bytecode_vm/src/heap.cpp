@@ -0,0 +1,204 @@
+#include "heap.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+
+static_assert(CHUNK_FIRST_WORD < CHUNK_BITMAP_WORDS,
+              "The chunk header leaves no room for cells");
+
+Heap::~Heap() {
+  while (chunks) {
+    Chunk *next = chunks->next;
+    munmap(chunks, CHUNK_SIZE);
+    chunks = next;
+  }
+}
+
+Object *Heap::allocate_slow() {
+  // Bitmap words before `word`, and chunks before `current`, had no clear
+  // bits when they were passed; sweeping starts over from the first chunk.
+  while (current) {
+    if (current->unswept) {
+      // `word` is at its start: a lazy sweep begins at the first chunk.
+      sweep_chunk(current);
+      ++lazily_swept;
+    }
+    for (; word < CHUNK_BITMAP_WORDS; ++word) {
+      if (~current->allocated[word]) {
+        free_bits = ~current->allocated[word];
+        free_word = &current->allocated[word];
+        free_base = (char *)current->cell(word * 64);
+        ++word;
+        return allocate();
+      }
+    }
+    if (!current->next)
+      break;
+    current = current->next;
+    word = CHUNK_FIRST_WORD;
+  }
+  Chunk *chunk = map_chunk();
+  if (last)
+    last->next = chunk;
+  else
+    chunks = chunk;
+  last = current = chunk;
+  word = CHUNK_FIRST_WORD;
+  return allocate_slow();
+}
+
+Chunk *Heap::map_chunk() {
+  // mmap only promises page alignment, so map twice the size and trim.
+  void *p = mmap(nullptr, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::runtime_error("Heap Allocation Failed");
+  char *start = (char *)p;
+  char *aligned =
+      (char *)(((uintptr_t)start + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1));
+  if (aligned != start)
+    munmap(start, aligned - start);
+  munmap(aligned + CHUNK_SIZE, start + 2 * CHUNK_SIZE - aligned - CHUNK_SIZE);
+  if (huge_pages)
+    madvise(aligned, CHUNK_SIZE, MADV_HUGEPAGE);
+
+  // The mapping is zeroed: no cells are allocated or marked.
+  Chunk *chunk = (Chunk *)aligned;
+  chunk->next = nullptr;
+  chunk->live = 0;
+  chunk->unswept = false;
+  ++mapped;
+  return chunk;
+}
+
+void Heap::unmap_chunk(Chunk *chunk) {
+  munmap(chunk, CHUNK_SIZE);
+  --mapped;
+}
+
+unsigned long Heap::sweep_chunk(Chunk *chunk) {
+  // The survivors are exactly the marked cells.
+  unsigned long freed = 0;
+  unsigned long live = 0;
+  for (unsigned long w = CHUNK_FIRST_WORD; w < CHUNK_BITMAP_WORDS; ++w) {
+    freed += __builtin_popcountl(chunk->allocated[w] & ~chunk->marks[w]);
+    live += __builtin_popcountl(chunk->marks[w]);
+  }
+  memcpy(chunk->allocated, chunk->marks, sizeof(chunk->marks));
+  memset(chunk->marks, 0, sizeof(chunk->marks));
+  chunk->live = live;
+  chunk->unswept = false;
+  return freed;
+}
+
+unsigned long Heap::sweep() {
+  unsigned long freed = 0;
+  for (Chunk *chunk = chunks; chunk; chunk = chunk->next)
+    freed += sweep_chunk(chunk);
+  release_empty();
+  return freed;
+}
+
+void Heap::release_empty() {
+  Chunk **link = &chunks;
+  last = nullptr;
+  while (Chunk *chunk = *link) {
+    if (chunk->live == 0) {
+      *link = chunk->next;
+      unmap_chunk(chunk);
+    } else {
+      last = chunk;
+      link = &chunk->next;
+    }
+  }
+  current = chunks;
+  word = CHUNK_FIRST_WORD;
+  free_bits = 0;
+}
+
+unsigned long Heap::sweep_lazily() {
+  unsigned long freed = 0;
+  for (Chunk *chunk = chunks; chunk; chunk = chunk->next) {
+    for (unsigned long w = CHUNK_FIRST_WORD; w < CHUNK_BITMAP_WORDS; ++w)
+      freed += __builtin_popcountl(chunk->allocated[w] & ~chunk->marks[w]);
+  }
+  defer_sweep();
+  return freed;
+}
+
+void Heap::defer_sweep() {
+  for (Chunk *chunk = chunks; chunk; chunk = chunk->next)
+    chunk->unswept = true;
+  lazy = true;
+  swept = nullptr;
+  current = chunks;
+  word = CHUNK_FIRST_WORD;
+  free_bits = 0;
+}
+
+bool Heap::sweep_some(unsigned long count) {
+  // Only this and finish_sweep() unmap chunks during a lazy sweep, so
+  // `swept` stays in the list.
+  while (lazy && count) {
+    Chunk **link = swept ? &swept->next : &chunks;
+    Chunk *chunk = *link;
+    if (!chunk) {
+      lazy = false;
+      break;
+    }
+    if (chunk->unswept) {
+      sweep_chunk(chunk);
+      --count;
+      if (chunk->live == 0 && chunk != current) {
+        *link = chunk->next;
+        if (last == chunk)
+          last = swept;
+        unmap_chunk(chunk);
+        continue;
+      }
+    }
+    swept = chunk;
+  }
+  return !lazy;
+}
+
+void Heap::finish_sweep() {
+  if (!lazy)
+    return;
+  lazy = false;
+  swept = nullptr;
+  // Allocation took a cell from each chunk it swept, empty or not, so only
+  // the chunks swept here can be left empty.
+  Chunk **link = &chunks;
+  last = nullptr;
+  while (Chunk *chunk = *link) {
+    if (chunk->unswept && (sweep_chunk(chunk), chunk->live == 0)) {
+      *link = chunk->next;
+      unmap_chunk(chunk);
+    } else {
+      last = chunk;
+      link = &chunk->next;
+    }
+  }
+  current = chunks;
+  word = CHUNK_FIRST_WORD;
+  free_bits = 0;
+}
+
+void Heap::clear_marks() {
+  for (Chunk *chunk = chunks; chunk; chunk = chunk->next)
+    memset(chunk->marks, 0, sizeof(chunk->marks));
+}
+
+bool Heap::contains(const Object *obj) const {
+  for (Chunk *chunk = chunks; chunk; chunk = chunk->next) {
+    if (chunk == chunk_of(obj)) {
+      unsigned long index = cell_index(obj);
+      return index >= CHUNK_FIRST_WORD * 64 &&
+             (const char *)obj == (const char *)chunk->cell(index) &&
+             (chunk->allocated[index / 64] >> (index % 64) & 1) &&
+             (!chunk->unswept || (chunk->marks[index / 64] >> (index % 64) & 1));
+    }
+  }
+  return false;
+}
@@ -0,0 +1,174 @@
+#ifndef HEAP_HPP
+#define HEAP_HPP
+
+#include "object.hpp"
+#include <cstddef>
+#include <cstdint>
+
+// Object heap.
+//
+// Objects live in chunks: CHUNK_SIZE bytes mapped straight from the kernel
+// at a CHUNK_SIZE-aligned address, so the chunk an object is in is found by
+// masking its address. Each chunk starts with a Chunk header and is carved
+// into cells of one size class. Every object is an Object, so there is a
+// single size class; a heap with more would keep a chunk list per class.
+//
+// Marks are not kept in the objects. Each chunk has two side bitmaps with a
+// bit per cell: `allocated` for cells holding an object and `marks` for the
+// objects the current collection has reached. Cells are handed out lowest
+// address first by finding clear bits in `allocated`, and a sweep is a pass
+// over the bitmap words that never touches an object: what survives is what
+// was marked. A sweep that leaves a chunk empty unmaps it.
+//
+// A lazy sweep (sweep_lazily) only counts the dead objects and flags every
+// chunk `unswept`. Allocation sweeps each chunk when it gets to it, and
+// finish_sweep() sweeps the rest. Until then, a chunk's objects are the ones
+// both allocated and marked.
+
+// Bytes in a chunk, and their alignment: one huge page on x86-64.
+#define CHUNK_SIZE (2UL << 20)
+
+// Words in each bitmap: enough for every cell-sized slot in the chunk,
+// including the ones the header takes up.
+#define CHUNK_BITMAP_WORDS (CHUNK_SIZE / sizeof(Object) / 64)
+
+struct Chunk {
+  Chunk *next;        // In the heap's list
+  unsigned long live; // Objects left by the last sweep
+  bool unswept;       // The lazy sweep has yet to get here
+  unsigned long marks[CHUNK_BITMAP_WORDS];
+  unsigned long allocated[CHUNK_BITMAP_WORDS];
+
+  Object *cell(unsigned long index) {
+    return (Object *)((char *)this + index * sizeof(Object));
+  }
+};
+
+// Cells start at the first bitmap word past the header, so every bit of the
+// words in [CHUNK_FIRST_WORD, CHUNK_BITMAP_WORDS) stands for a cell.
+static const unsigned long CHUNK_FIRST_WORD =
+    (sizeof(Chunk) + 64 * sizeof(Object) - 1) / (64 * sizeof(Object));
+
+inline Chunk *chunk_of(const Object *obj) {
+  return (Chunk *)((uintptr_t)obj & ~(CHUNK_SIZE - 1));
+}
+inline unsigned long cell_index(const Object *obj) {
+  return ((uintptr_t)obj & (CHUNK_SIZE - 1)) / sizeof(Object);
+}
+
+class Heap {
+public:
+  Heap() = default;
+  ~Heap();
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+
+  // A cell for a new object, with the fields of Object unset. Throws
+  // std::runtime_error if no chunk can be mapped.
+  Object *allocate() {
+    if (free_bits) {
+      unsigned long bit = __builtin_ctzl(free_bits);
+      free_bits &= free_bits - 1;
+      *free_word |= 1UL << bit;
+      return (Object *)(free_base + bit * sizeof(Object));
+    }
+    return allocate_slow();
+  }
+
+  // Marks `obj`, returning false if it already was.
+  static bool mark(const Object *obj) {
+    unsigned long index = cell_index(obj);
+    unsigned long &word = chunk_of(obj)->marks[index / 64];
+    unsigned long bit = 1UL << (index % 64);
+    if (word & bit)
+      return false;
+    word |= bit;
+    return true;
+  }
+  // As mark(), for marking from several threads at once.
+  static bool mark_atomic(const Object *obj) {
+    unsigned long index = cell_index(obj);
+    unsigned long *word = &chunk_of(obj)->marks[index / 64];
+    unsigned long bit = 1UL << (index % 64);
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+      return false;
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+  }
+  static bool is_marked(const Object *obj) {
+    unsigned long index = cell_index(obj);
+    return chunk_of(obj)->marks[index / 64] >> (index % 64) & 1;
+  }
+
+  // Frees the objects that are not marked and unmarks the others, chunk by
+  // chunk in address order. Returns the number freed.
+  unsigned long sweep();
+  // sweep() in two parts: sweep_chunk() for each chunk, which can be done
+  // for different chunks at once, and then release_empty() to unmap the
+  // chunks left empty.
+  static unsigned long sweep_chunk(Chunk *chunk);
+  void release_empty();
+  Chunk *first_chunk() const { return chunks; }
+  // Starts a lazy sweep, returning the number of objects it will free.
+  // Allocation and marking from then on must wait for finish_sweep().
+  unsigned long sweep_lazily();
+  // As sweep_lazily(), for a caller that already knows what it will free.
+  void defer_sweep();
+  // Sweeps up to `count` of the chunks the lazy sweep has yet to reach,
+  // unmapping those left empty but the one allocation is using. Returns
+  // true once no chunk is left to sweep.
+  bool sweep_some(unsigned long count);
+  // Sweeps the chunks the lazy sweep, if any, has yet to reach, unmapping
+  // those left empty.
+  void finish_sweep();
+  bool sweeping() const { return lazy; }
+  // Unmarks every object, to start marking over.
+  void clear_marks();
+
+  // Calls f(obj) for every object in the heap.
+  template <typename F> void each(F f) const {
+    for (Chunk *chunk = chunks; chunk; chunk = chunk->next) {
+      for (unsigned long w = CHUNK_FIRST_WORD; w < CHUNK_BITMAP_WORDS; ++w) {
+        unsigned long bits = chunk->allocated[w];
+        if (chunk->unswept)
+          bits &= chunk->marks[w];
+        for (; bits; bits &= bits - 1)
+          f(chunk->cell(w * 64 + __builtin_ctzl(bits)));
+      }
+    }
+  }
+  // Calls f(obj) for every marked object. Objects f marks may be skipped.
+  template <typename F> void each_marked(F f) const {
+    for (Chunk *chunk = chunks; chunk; chunk = chunk->next) {
+      for (unsigned long w = CHUNK_FIRST_WORD; w < CHUNK_BITMAP_WORDS; ++w) {
+        for (unsigned long bits = chunk->marks[w]; bits; bits &= bits - 1)
+          f(chunk->cell(w * 64 + __builtin_ctzl(bits)));
+      }
+    }
+  }
+  bool contains(const Object *obj) const;
+  unsigned long chunk_count() const { return mapped; }
+
+  // Ask for transparent huge pages for chunks mapped from now on.
+  bool huge_pages = false;
+  unsigned long lazily_swept = 0; // Chunks allocation swept, since creation
+
+private:
+  Object *allocate_slow();
+  Chunk *map_chunk();
+  void unmap_chunk(Chunk *chunk);
+
+  Chunk *chunks = nullptr;  // Oldest first
+  Chunk *last = nullptr;
+  Chunk *current = nullptr; // Where allocate() takes cells from
+  unsigned long word = 0;   // The next bitmap word of `current` to look at
+  // Clear bits of the `allocated` word being allocated from, the word, and
+  // the cell its bit 0 stands for
+  unsigned long free_bits = 0;
+  unsigned long *free_word = nullptr;
+  char *free_base = nullptr;
+  unsigned long mapped = 0;
+  bool lazy = false; // A lazy sweep has not been finished
+  Chunk *swept = nullptr; // The last chunk sweep_some() has passed, if any
+};
+
+#endif // HEAP_HPP
@@ -0,0 +1,758 @@
+#include "jit.hpp"
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define JIT_X86_64 1
+#endif
+
+#define JIT_ARENA_SIZE (16ul << 20)
+#define JIT_MAX_REGION_BLOCKS 1024
+
+#ifdef JIT_X86_64
+
+namespace {
+
+enum Reg {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+};
+
+// Machine state lives in callee-saved registers while compiled code runs, so
+// helper calls need no spilling.
+const int SP = RBX;          // Stack pointer (StackItem *)
+const int STACK_BASE = R12;  // register_stack.base()
+const int STACK_LIMIT = RBP; // register_stack.base() + its capacity
+const int CSP = R13;         // Call stack pointer
+const int DATA = R14;        // data_memory.base()
+const int STATE = R15;       // JitState *
+
+enum Shift { SHL = 4, SAR = 7 };
+enum Cond { CC_B = 2, CC_AE = 3, CC_Z = 4, CC_NZ = 5, CC_BE = 6, CC_A = 7 };
+const int ALWAYS = -1;
+
+const long SLOT = sizeof(StackItem);
+
+bool fits_int32(long v) { return v >= -2147483648L && v <= 2147483647L; }
+
+void jit_print(long value) { std::cout << value << std::endl; }
+
+// Minimal x86-64 encoder. Memory operands are always [base + disp32].
+class Emitter {
+public:
+  explicit Emitter(unsigned char *base) : base(base) {}
+
+  unsigned char *const base; // Address the code will run at
+  std::vector<unsigned char> buf;
+
+  unsigned char *here() const { return base + buf.size(); }
+
+  void byte(int b) { buf.push_back((unsigned char)b); }
+  void int32(long v) {
+    for (int i = 0; i < 4; ++i)
+      byte(v >> (8 * i));
+  }
+  void int64(long v) {
+    for (int i = 0; i < 8; ++i)
+      byte(v >> (8 * i));
+  }
+
+  void rex(bool w, int reg, int rm) {
+    int prefix = 0x40 | (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+    if (prefix != 0x40)
+      byte(prefix);
+  }
+  void mem(int reg, int base_reg, long disp) {
+    byte(0x80 | (reg & 7) << 3 | (base_reg & 7));
+    if ((base_reg & 7) == RSP)
+      byte(0x24); // SIB: no index
+    int32(disp);
+  }
+  void direct(int reg, int rm) { byte(0xC0 | (reg & 7) << 3 | (rm & 7)); }
+
+  void op_mem(int opcode, int reg, int base_reg, long disp) {
+    rex(true, reg, base_reg);
+    byte(opcode);
+    mem(reg, base_reg, disp);
+  }
+  void op_reg(int opcode, int reg, int rm) {
+    rex(true, reg, rm);
+    byte(opcode);
+    direct(reg, rm);
+  }
+
+  void load(int reg, int b, long disp) { op_mem(0x8B, reg, b, disp); }
+  void store(int b, long disp, int reg) { op_mem(0x89, reg, b, disp); }
+  void lea(int reg, int b, long disp) { op_mem(0x8D, reg, b, disp); }
+  void mov(int dst, int src) { op_reg(0x89, src, dst); }
+  void mov_imm(int reg, long imm) {
+    rex(true, 0, reg);
+    byte(0xB8 | (reg & 7));
+    int64(imm);
+  }
+  void store_imm(int b, long disp, long imm) {
+    if (fits_int32(imm)) {
+      op_mem(0xC7, 0, b, disp);
+      int32(imm);
+    } else {
+      mov_imm(RAX, imm);
+      store(b, disp, RAX);
+    }
+  }
+  void cmp_byte(int b, long disp, int imm) {
+    rex(false, 0, b);
+    byte(0x80);
+    mem(7, b, disp);
+    byte(imm);
+  }
+  // ADD/OR/AND/SUB/XOR/CMP reg, imm; `digit` selects the operation.
+  void alu_imm(int digit, int reg, long imm) {
+    if (fits_int32(imm)) {
+      rex(true, 0, reg);
+      byte(0x81);
+      direct(digit, reg);
+      int32(imm);
+    } else {
+      mov_imm(RCX, imm);
+      op_reg(0x03 + 8 * digit, reg, RCX);
+    }
+  }
+  // SHL/SAR reg, imm; `digit` selects the operation.
+  void shift_imm(int digit, int reg, int n) {
+    rex(true, 0, reg);
+    byte(0xC1);
+    direct(digit, reg);
+    byte(n);
+  }
+  void cmp(int a, int b) { op_reg(0x39, b, a); } // Flags of a - b
+  void test(int reg) { op_reg(0x85, reg, reg); }
+  void push(int reg) {
+    if (reg & 8)
+      byte(0x41);
+    byte(0x50 | (reg & 7));
+  }
+  void pop(int reg) {
+    if (reg & 8)
+      byte(0x41);
+    byte(0x58 | (reg & 7));
+  }
+  void jmp_reg(int reg) {
+    rex(false, 0, reg);
+    byte(0xFF);
+    direct(4, reg);
+  }
+  void call_reg(int reg) {
+    rex(false, 0, reg);
+    byte(0xFF);
+    direct(2, reg);
+  }
+
+  // Jump (or conditional jump) with a rel32 to be filled in; returns its
+  // position for patch().
+  unsigned long jump(int cc) {
+    if (cc == ALWAYS) {
+      byte(0xE9);
+    } else {
+      byte(0x0F);
+      byte(0x80 | cc);
+    }
+    unsigned long at = buf.size();
+    int32(0);
+    return at;
+  }
+  void patch(unsigned long at, const void *target) {
+    long rel = (const unsigned char *)target - (base + at + 4);
+    for (int i = 0; i < 4; ++i)
+      buf[at + i] = (unsigned char)(rel >> (8 * i));
+  }
+  void jump_to(int cc, const void *target) { patch(jump(cc), target); }
+};
+
+} // namespace
+
+// Compiles one region: a set of register tier blocks, emitted in order.
+class RegionCompiler {
+public:
+  RegionCompiler(Jit &jit, const Program &program, const RegisterCode &rc)
+      : jit(jit), program(program), rc(rc), e(jit.arena + jit.arena_used),
+        label(rc.blocks.size(), -1), in_region(rc.blocks.size(), false),
+        cached(NOTHING), cached_int(false) {}
+
+  bool compile(unsigned long index);
+
+private:
+  Jit &jit;
+  const Program &program;
+  const RegisterCode &rc;
+  Emitter e;
+  std::vector<long> label; // Offset of each block in the region, once emitted
+  std::vector<bool> in_region;
+  std::vector<std::pair<unsigned long, long>> block_fixups;
+  std::map<long, std::vector<unsigned long>> exits; // Index -> jumps to patch
+
+  // Register whose tagged word (see stack.hpp) rax still holds, so results
+  // that are consumed by the next instruction are not reloaded from the
+  // stack, and whether that word is known to be an integer.
+  static const long NOTHING = 1L << 40;
+  long cached;
+  bool cached_int;
+
+  long block_of(long header) const { return rc.code[header].d; }
+  unsigned long block_end(long block) const {
+    return (unsigned long)block + 1 < rc.blocks.size()
+               ? rc.entry[rc.blocks[block + 1].first]
+               : rc.code.size();
+  }
+  long index_at(long pc) const { return program.index_of(pc); }
+
+  long slot(long n) const { return n * SLOT; }
+  // Values are computed on tagged words where the tag bits cancel out, as
+  // with tagged_add() and friends, and untagged with a shift otherwise.
+  void set_word(long d, bool is_int = true) {
+    e.store(SP, slot(d), RAX);
+    cached = d;
+    cached_int = is_int;
+  }
+  void untag(int reg) { e.alu_imm(4, reg, ~1L); } // and
+  void untag_rax() {
+    if (!cached_int)
+      untag(RAX);
+  }
+  void load_value(int reg, int base_reg, long disp) {
+    e.load(reg, base_reg, disp);
+    e.shift_imm(SAR, reg, 1);
+  }
+  void load_rax(long n, long held) {
+    if (held != n) {
+      e.load(RAX, SP, slot(n));
+      cached_int = false;
+    }
+    cached = n;
+  }
+
+  void exit_to(int cc, long index) { exits[index].push_back(e.jump(cc)); }
+  void goto_block(int cc, long block) {
+    if (in_region[block]) {
+      block_fixups.push_back(std::make_pair(e.jump(cc), block));
+    } else if (jit.compiled(rc.blocks[block].first)) {
+      e.jump_to(cc, jit.native[rc.blocks[block].first]);
+    } else {
+      exit_to(cc, rc.blocks[block].first);
+    }
+  }
+  // Returns to the interpreter at `index` if the debugger wants control.
+  void poll(long index) {
+    e.load(RDX, STATE, offsetof(JitState, debug_mode));
+    e.cmp_byte(RDX, 0, 0);
+    exit_to(CC_NZ, index);
+    e.load(RDX, STATE, offsetof(JitState, stats_requested));
+    e.cmp_byte(RDX, 0, 0);
+    exit_to(CC_NZ, index);
+    e.load(RDX, STATE, offsetof(JitState, sample_requested));
+    e.cmp_byte(RDX, 0, 0);
+    exit_to(CC_NZ, index);
+  }
+
+  void select(long first);
+  void emit_block(long block, long next);
+  void emit(const RegInstruction &ins);
+  void binary(int opcode_rm, const RegInstruction &ins, bool imm, long held,
+              bool clear_tags);
+};
+
+void RegionCompiler::select(long first) {
+  // Everything reachable from the head through branches, calls and
+  // fall-through that is not compiled yet, up to a size limit.
+  std::vector<long> work(1, first);
+  unsigned long count = 0;
+  while (!work.empty() && count < JIT_MAX_REGION_BLOCKS) {
+    long block = work.back();
+    work.pop_back();
+    // Blocks at breaks are left to the interpreter, which stops there.
+    if (in_region[block] || jit.compiled(rc.blocks[block].first) ||
+        rc.code[rc.entry[rc.blocks[block].first]].op == R_BREAK)
+      continue;
+    in_region[block] = true;
+    ++count;
+
+    unsigned long begin = rc.entry[rc.blocks[block].first];
+    bool falls_through = true;
+    for (unsigned long i = begin; i < block_end(block); ++i) {
+      const RegInstruction &ins = rc.code[i];
+      switch (ins.op) {
+      case R_JZ:
+      case R_JNZ:
+        work.push_back(block_of(ins.b));
+        break;
+      case R_JMP:
+        work.push_back(block_of(ins.b));
+        falls_through = false;
+        break;
+      case R_CALL:
+        work.push_back(block_of(ins.b));
+        work.push_back(block + 1); // Where the call returns to
+        falls_through = false;
+        break;
+      case R_RET:
+      case R_CONS:
+      case R_HALT:
+      case R_END:
+        falls_through = false;
+        break;
+      }
+    }
+    if (falls_through && (unsigned long)block + 1 < rc.blocks.size())
+      work.push_back(block + 1);
+  }
+}
+
+// rax = word a <op> word b, clearing the operands' tags first if asked to.
+// Immediates are tagged integers, whose tag is always clear.
+void RegionCompiler::binary(int opcode_rm, const RegInstruction &ins,
+                            bool imm, long held, bool clear_tags) {
+  load_rax(ins.a, held);
+  if (clear_tags)
+    untag_rax();
+  if (imm) {
+    e.alu_imm(opcode_rm >> 3, RAX, StackItem::tag(ins.b));
+  } else {
+    e.load(RCX, SP, slot(ins.b));
+    if (clear_tags)
+      untag(RCX);
+    e.op_reg(opcode_rm, RAX, RCX);
+  }
+}
+
+void RegionCompiler::emit(const RegInstruction &ins) {
+  // Instructions that leave a register in rax record it again below.
+  long held = cached;
+  cached = NOTHING;
+  switch (ins.op) {
+  case R_MOVI:
+    e.store_imm(SP, slot(ins.d), StackItem::tag(ins.a));
+    break;
+  case R_MOV:
+    load_rax(ins.a, held);
+    set_word(ins.d, cached_int);
+    break;
+  case R_LOADMEM:
+    e.load(RAX, DATA, ins.a * sizeof(long));
+    e.shift_imm(SHL, RAX, 1);
+    set_word(ins.d);
+    break;
+  case R_STORE_R:
+    load_rax(ins.a, held);
+    e.mov(RCX, RAX);
+    e.shift_imm(SAR, RCX, 1);
+    e.store(DATA, ins.d * sizeof(long), RCX);
+    break;
+  case R_STORE_I:
+    e.store_imm(DATA, ins.d * sizeof(long), ins.a);
+    break;
+  case R_PRINT_R:
+  case R_PRINT_I:
+    if (ins.op == R_PRINT_R)
+      load_value(RDI, SP, slot(ins.a));
+    else
+      e.mov_imm(RDI, ins.a);
+    e.mov_imm(RAX, (long)&jit_print);
+    e.call_reg(RAX);
+    break;
+  case R_ADD_RR:
+  case R_ADD_RI:
+    binary(0x03, ins, ins.op == R_ADD_RI, held, true);
+    set_word(ins.d);
+    break;
+  case R_SUB_RR:
+  case R_SUB_RI:
+    binary(0x2B, ins, ins.op == R_SUB_RI, held, true);
+    set_word(ins.d);
+    break;
+  case R_AND_RR:
+  case R_AND_RI:
+    binary(0x23, ins, ins.op == R_AND_RI, held, false);
+    if (ins.op == R_AND_RR)
+      untag(RAX);
+    set_word(ins.d);
+    break;
+  case R_OR_RR:
+  case R_OR_RI:
+    binary(0x0B, ins, ins.op == R_OR_RI, held, false);
+    untag(RAX);
+    set_word(ins.d);
+    break;
+  case R_XOR_RR:
+  case R_XOR_RI:
+    binary(0x33, ins, ins.op == R_XOR_RI, held, false);
+    untag(RAX);
+    set_word(ins.d);
+    break;
+  case R_CMP_RR:
+  case R_CMP_RI:
+    // A word compares with a tagged integer as their values do.
+    binary(0x3B, ins, ins.op == R_CMP_RI, held, ins.op == R_CMP_RR);
+    e.byte(0x0F); // setl al
+    e.byte(0x9C);
+    e.byte(0xC0);
+    e.byte(0x0F); // movzx eax, al
+    e.byte(0xB6);
+    e.byte(0xC0);
+    e.shift_imm(SHL, RAX, 1);
+    set_word(ins.d);
+    break;
+  case R_MUL_RR:
+  case R_MUL_RI:
+    load_rax(ins.a, held);
+    e.shift_imm(SAR, RAX, 1);
+    if (ins.op == R_MUL_RI) {
+      e.mov_imm(RCX, StackItem::tag(ins.b));
+    } else {
+      e.load(RCX, SP, slot(ins.b));
+      untag(RCX);
+    }
+    e.rex(true, RAX, RCX); // imul rax, rcx
+    e.byte(0x0F);
+    e.byte(0xAF);
+    e.direct(RAX, RCX);
+    set_word(ins.d);
+    break;
+  case R_SHL_RR:
+  case R_SHR_RR:
+  case R_SHL_RI:
+  case R_SHR_RI: {
+    int digit = ins.op == R_SHL_RR || ins.op == R_SHL_RI ? SHL : SAR;
+    load_rax(ins.a, held);
+    e.shift_imm(SAR, RAX, 1);
+    if (ins.op == R_SHL_RI || ins.op == R_SHR_RI)
+      e.mov_imm(RCX, ins.b);
+    else
+      load_value(RCX, SP, slot(ins.b));
+    e.rex(true, 0, RAX);
+    e.byte(0xD3);
+    e.direct(digit, RAX);
+    e.shift_imm(SHL, RAX, 1);
+    set_word(ins.d);
+    break;
+  }
+  case R_NOT:
+    load_rax(ins.a, held);
+    e.rex(true, 0, RAX);
+    e.byte(0xF7);
+    e.direct(2, RAX);
+    untag(RAX);
+    set_word(ins.d);
+    break;
+  case R_DIV_RI:
+    load_rax(ins.a, held);
+    e.shift_imm(SAR, RAX, 1);
+    e.mov_imm(RCX, ins.b);
+    e.byte(0x48); // cqo
+    e.byte(0x99);
+    e.rex(true, 0, RCX); // idiv rcx
+    e.byte(0xF7);
+    e.direct(7, RCX);
+    e.shift_imm(SHL, RAX, 1);
+    set_word(ins.d);
+    break;
+  case R_DIV: {
+    long index = index_at(ins.d);
+    e.lea(RAX, STACK_BASE, 2 * SLOT);
+    e.cmp(SP, RAX);
+    exit_to(CC_B, index);
+    load_value(RCX, SP, -SLOT);
+    e.test(RCX);
+    exit_to(CC_Z, index);
+    load_value(RAX, SP, -2 * SLOT);
+    e.byte(0x48); // cqo
+    e.byte(0x99);
+    e.rex(true, 0, RCX); // idiv rcx
+    e.byte(0xF7);
+    e.direct(7, RCX);
+    e.shift_imm(SHL, RAX, 1);
+    set_word(-2);
+    e.alu_imm(5, SP, SLOT); // sub
+    cached = NOTHING;
+    break;
+  }
+  case R_ADJUST:
+    e.alu_imm(0, SP, ins.a * SLOT);
+    break;
+  case R_JMP:
+    poll(rc.blocks[block_of(ins.b)].first);
+    goto_block(ALWAYS, block_of(ins.b));
+    break;
+  case R_JZ:
+  case R_JNZ: {
+    // The value is zero if the word is 0 or 1.
+    load_rax(ins.a, held);
+    e.alu_imm(7, RAX, 1); // cmp
+    unsigned long not_taken = e.jump(ins.op == R_JZ ? CC_A : CC_BE);
+    poll(rc.blocks[block_of(ins.b)].first);
+    goto_block(ALWAYS, block_of(ins.b));
+    e.patch(not_taken, e.here());
+    break;
+  }
+  case R_CALL:
+    e.load(RAX, STATE, offsetof(JitState, calls_limit));
+    e.cmp(CSP, RAX);
+    exit_to(CC_AE, index_at(ins.d));
+    e.store_imm(CSP, 0, StackItem::tag(ins.a));
+    e.alu_imm(0, CSP, SLOT);
+    poll(rc.blocks[block_of(ins.b)].first);
+    goto_block(ALWAYS, block_of(ins.b));
+    break;
+  case R_RET: {
+    e.load(RAX, STATE, offsetof(JitState, calls_base));
+    e.cmp(CSP, RAX);
+    exit_to(CC_BE, index_at(ins.d));
+    e.alu_imm(5, CSP, SLOT);
+    load_value(RAX, CSP, 0);
+    // rax = index_of[rax]; rcx = native[rax]
+    e.load(RCX, STATE, offsetof(JitState, index_of));
+    e.byte(0x48);
+    e.byte(0x8B);
+    e.byte(0x04);
+    e.byte(0xC1);
+    e.load(RCX, STATE, offsetof(JitState, native));
+    e.byte(0x48);
+    e.byte(0x8B);
+    e.byte(0x0C);
+    e.byte(0xC1);
+    // Leave with the return index in rax if the debugger wants control or
+    // the caller is not compiled.
+    e.load(RDX, STATE, offsetof(JitState, debug_mode));
+    e.cmp_byte(RDX, 0, 0);
+    e.jump_to(CC_NZ, jit.exit_code);
+    e.load(RDX, STATE, offsetof(JitState, stats_requested));
+    e.cmp_byte(RDX, 0, 0);
+    e.jump_to(CC_NZ, jit.exit_code);
+    e.load(RDX, STATE, offsetof(JitState, sample_requested));
+    e.cmp_byte(RDX, 0, 0);
+    e.jump_to(CC_NZ, jit.exit_code);
+    e.test(RCX);
+    e.jump_to(CC_Z, jit.exit_code);
+    e.jmp_reg(RCX);
+    break;
+  }
+  case R_CONS:
+  case R_END:
+    exit_to(ALWAYS, index_at(ins.d));
+    break;
+  case R_HALT:
+    // Let the interpreter execute the HALT itself.
+    exit_to(ALWAYS, program.index_of(ins.a) - 1);
+    break;
+  }
+}
+
+void RegionCompiler::emit_block(long block, long next) {
+  label[block] = e.buf.size();
+  unsigned long begin = rc.entry[rc.blocks[block].first];
+  const RegInstruction &enter = rc.code[begin];
+  long first = rc.blocks[block].first;
+
+  // Entry check; blocks that would fault run in the interpreter.
+  if (enter.a > 0) {
+    e.lea(RAX, STACK_BASE, enter.a * SLOT);
+    e.cmp(SP, RAX);
+    exit_to(CC_B, first);
+  }
+  if (enter.b > 0) {
+    e.lea(RAX, SP, enter.b * SLOT);
+    e.cmp(RAX, STACK_LIMIT);
+    exit_to(CC_A, first);
+  }
+  cached = NOTHING;
+
+  bool falls_through = true;
+  for (unsigned long i = begin + 1; i < block_end(block); ++i) {
+    const RegInstruction &ins = rc.code[i];
+    emit(ins);
+    switch (ins.op) {
+    case R_JMP:
+    case R_CALL:
+    case R_RET:
+    case R_CONS:
+    case R_HALT:
+    case R_END:
+      falls_through = false;
+      break;
+    }
+  }
+  if (falls_through && next != block + 1)
+    goto_block(ALWAYS, block + 1);
+}
+
+bool RegionCompiler::compile(unsigned long index) {
+  long head = block_of(rc.entry[index]);
+  select(head);
+
+  std::vector<long> order;
+  for (unsigned long b = 0; b < rc.blocks.size(); ++b) {
+    if (in_region[b])
+      order.push_back(b);
+  }
+  if (order.empty())
+    return false;
+  for (unsigned long i = 0; i < order.size(); ++i)
+    emit_block(order[i], i + 1 < order.size() ? order[i + 1] : -1);
+
+  for (const std::pair<unsigned long, long> &fixup : block_fixups)
+    e.patch(fixup.first, e.base + label[fixup.second]);
+  for (const std::pair<const long, std::vector<unsigned long>> &exit : exits) {
+    for (unsigned long at : exit.second)
+      e.patch(at, e.here());
+    e.byte(0xB8); // mov eax, index
+    e.int32(exit.first);
+    e.jump_to(ALWAYS, jit.exit_code);
+  }
+
+  // Copy the code into the arena and make it executable.
+  unsigned long page = sysconf(_SC_PAGESIZE);
+  unsigned long size = (e.buf.size() + page - 1) / page * page;
+  if (jit.arena_used + size > JIT_ARENA_SIZE)
+    return false;
+  if (mprotect(e.base, size, PROT_READ | PROT_WRITE) != 0)
+    return false;
+  std::memcpy(e.base, e.buf.data(), e.buf.size());
+  if (mprotect(e.base, size, PROT_READ | PROT_EXEC) != 0)
+    return false;
+  jit.arena_used += size;
+
+  for (long b : order)
+    jit.native[rc.blocks[b].first] = e.base + label[b];
+  return true;
+}
+
+Jit::Jit()
+    : threshold(JIT_DEFAULT_THRESHOLD), regions(0), arena(nullptr),
+      arena_used(0), arena_reset(0), enter_code(nullptr), exit_code(nullptr) {}
+
+Jit::~Jit() {
+  if (arena)
+    munmap(arena, JIT_ARENA_SIZE);
+}
+
+bool Jit::supported() { return true; }
+
+bool Jit::map_arena() {
+  // One reservation for all code, so compiled regions can jump to each
+  // other with 32-bit displacements. Pages become accessible as they are
+  // filled.
+  void *p = mmap(nullptr, JIT_ARENA_SIZE, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    return false;
+  arena = (unsigned char *)p;
+
+  // long enter(JitState *state, const void *code)
+  Emitter e(arena);
+  e.push(RBX);
+  e.push(RBP);
+  e.push(R12);
+  e.push(R13);
+  e.push(R14);
+  e.push(R15);
+  e.alu_imm(5, RSP, 8); // Keep calls to helpers 16-byte aligned
+  e.mov(STATE, RDI);
+  e.load(SP, STATE, offsetof(JitState, sp));
+  e.load(STACK_BASE, STATE, offsetof(JitState, stack_base));
+  e.load(STACK_LIMIT, STATE, offsetof(JitState, stack_limit));
+  e.load(CSP, STATE, offsetof(JitState, csp));
+  e.load(DATA, STATE, offsetof(JitState, data));
+  e.jmp_reg(RSI);
+
+  // Exit: rax holds the index to resume at.
+  unsigned long exit_at = e.buf.size();
+  e.store(STATE, offsetof(JitState, sp), SP);
+  e.store(STATE, offsetof(JitState, csp), CSP);
+  e.alu_imm(0, RSP, 8);
+  e.pop(R15);
+  e.pop(R14);
+  e.pop(R13);
+  e.pop(R12);
+  e.pop(RBP);
+  e.pop(RBX);
+  e.byte(0xC3); // ret
+
+  unsigned long page = sysconf(_SC_PAGESIZE);
+  unsigned long size = (e.buf.size() + page - 1) / page * page;
+  if (mprotect(arena, size, PROT_READ | PROT_WRITE) != 0)
+    return false;
+  std::memcpy(arena, e.buf.data(), e.buf.size());
+  if (mprotect(arena, size, PROT_READ | PROT_EXEC) != 0)
+    return false;
+  enter_code = arena;
+  exit_code = arena + exit_at;
+  arena_used = arena_reset = size;
+  return true;
+}
+
+void Jit::reset(unsigned long instructions) {
+  counts.assign(instructions, 0);
+  native.assign(instructions, nullptr);
+  regions = 0;
+  arena_used = arena_reset;
+}
+
+bool Jit::compile(const Program &program, RegisterCode &code,
+                  unsigned long index) {
+  if (!arena && !map_arena())
+    return false;
+  if (code.empty())
+    code.translate(program);
+  if (code.block_entry(index) < 0)
+    return false;
+  RegionCompiler compiler(*this, program, code);
+  if (!compiler.compile(index))
+    return false;
+  ++regions;
+  return true;
+}
+
+long Jit::enter(unsigned long index, JitState &state) const {
+  typedef long (*EnterFn)(JitState *, const void *);
+  return ((EnterFn)enter_code)(&state, native[index]);
+}
+
+#else // !JIT_X86_64
+
+// No code generator for this architecture: nothing is ever compiled.
+
+Jit::Jit()
+    : threshold(JIT_DEFAULT_THRESHOLD), regions(0), arena(nullptr),
+      arena_used(0), arena_reset(0), enter_code(nullptr), exit_code(nullptr) {}
+
+Jit::~Jit() {}
+
+bool Jit::supported() { return false; }
+
+bool Jit::map_arena() { return false; }
+
+void Jit::reset(unsigned long instructions) {
+  counts.assign(instructions, 0);
+  native.assign(instructions, nullptr);
+  regions = 0;
+}
+
+bool Jit::compile(const Program &, RegisterCode &, unsigned long) {
+  return false;
+}
+
+long Jit::enter(unsigned long index, JitState &) const { return index; }
+
+#endif // JIT_X86_64
@@ -0,0 +1,89 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include "program.hpp"
+#include "regvm.hpp"
+#include "stack.hpp"
+#include <vector>
+
+// Baseline x86-64 JIT.
+//
+// The threaded engine counts how often each CALL target and each backward
+// branch target is reached. When one crosses `threshold`, the blocks
+// reachable from it are compiled, one machine-code template per register
+// tier instruction (see regvm.hpp), into an mmap'd arena that is only ever
+// mapped read+execute once written. Compiled code works directly on the VM's
+// stacks and data memory, so it can be entered and left at any block
+// boundary.
+//
+// Compiled code never reports errors itself. Whenever an instruction could
+// fail (a block that would under- or overflow the stack, DIV by zero, CALL
+// overflow, RET underflow), and for CONS, which allocates and may collect,
+// it returns to the interpreter at that instruction, which then executes it
+// with the usual semantics.
+
+// Machine state handed to and returned by compiled code.
+struct JitState {
+  StackItem *sp;
+  StackItem *csp;
+  StackItem *stack_base;
+  StackItem *stack_limit;
+  StackItem *calls_base;
+  StackItem *calls_limit;
+  long *data;
+  const long *index_of;
+  const void *const *native;
+  const bool *debug_mode;
+  const bool *stats_requested;
+  const bool *sample_requested;
+};
+
+class Jit {
+public:
+  Jit();
+  ~Jit();
+  Jit(const Jit &) = delete;
+  Jit &operator=(const Jit &) = delete;
+
+  // True if this build can generate code for the host.
+  static bool supported();
+
+  // Forgets all compiled code and counters for a program of `instructions`
+  // decoded instructions.
+  void reset(unsigned long instructions);
+
+  // Compiles the region starting at instruction `index`, which must start a
+  // block. Returns false if nothing could be compiled (e.g. the arena is
+  // full), in which case the caller should stop asking.
+  bool compile(const Program &program, RegisterCode &code,
+               unsigned long index);
+  bool compiled(unsigned long index) const {
+    return index < native.size() && native[index];
+  }
+
+  // Runs compiled code from instruction `index` until it returns to the
+  // interpreter. Returns the index of the next instruction to interpret.
+  long enter(unsigned long index, JitState &state) const;
+
+  const void *const *native_table() const { return native.data(); }
+
+  unsigned long threshold;          // Arrivals before a region is compiled
+  std::vector<unsigned int> counts; // Arrivals per instruction index
+  unsigned long regions;            // Regions compiled so far
+
+private:
+  friend class RegionCompiler;
+
+  bool map_arena();
+
+  unsigned char *arena;
+  unsigned long arena_used;
+  unsigned long arena_reset; // End of the entry/exit stubs
+  const unsigned char *enter_code;
+  const unsigned char *exit_code;
+  std::vector<const void *> native; // Entry point per instruction, if any
+};
+
+#define JIT_DEFAULT_THRESHOLD 1000
+
+#endif // JIT_HPP
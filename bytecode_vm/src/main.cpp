@@ -1,26 +1,118 @@
 #include "vm.hpp"
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <string>
 
 #include <csignal>
+#include <sys/time.h>
 
 VM *global_vm = nullptr;
 
+// Sampling rates for --sample, in samples per second of CPU time.
+#define DEFAULT_SAMPLE_HZ 1000
+#define MAX_SAMPLE_HZ 1000000
+
 void handle_signal(int sig) {
   if (global_vm) {
     if (sig == SIGUSR1) {
         global_vm->debug_mode = true;
+    } else if (sig == SIGPROF) {
+        global_vm->sample_requested = true;
     }
   }
 }
 
+// Parses the value of a size flag: a positive number no greater than `max`.
+static bool parse_size(const char *value, unsigned long max,
+                       unsigned long &size) {
+  char *end;
+  size = std::strtoul(value, &end, 10);
+  return end != value && *end == '\0' && size > 0 && size <= max;
+}
+
+// Prints the profile of a finished run and, given `out`, writes it to
+// <out>.csv, <out>.json and <out>.folded.
+static void write_profile(VM &vm, const std::string &out) {
+  vm.profiler.report(vm.program, vm.debug_info, std::cerr);
+  if (out.empty())
+    return;
+  std::ofstream csv(out + ".csv"), json(out + ".json"),
+      folded(out + ".folded");
+  vm.profiler.write_csv(vm.program, csv);
+  vm.profiler.write_json(vm.program, vm.debug_info, json);
+  vm.profiler.write_folded(vm.program, vm.debug_info, folded);
+  if (!csv || !json || !folded)
+    throw std::runtime_error("Could not write profile " + out);
+}
+
+// Prints the samples of a finished run and, given `out`, writes their
+// collapsed stacks to it.
+static void write_samples(VM &vm, const std::string &out) {
+  vm.sampler.report(vm.program, vm.debug_info, std::cerr);
+  if (out.empty())
+    return;
+  std::ofstream collapsed(out);
+  vm.sampler.write_collapsed(vm.program, vm.debug_info, collapsed);
+  if (!collapsed)
+    throw std::runtime_error("Could not write samples " + out);
+}
+
+// Delivers SIGPROF `hz` times per second of CPU time, or never if 0.
+static void set_sample_timer(unsigned long hz) {
+  struct itimerval timer = {};
+  if (hz) {
+    timer.it_interval.tv_sec = hz == 1 ? 1 : 0;
+    timer.it_interval.tv_usec = hz == 1 ? 0 : 1000000 / hz;
+    timer.it_value = timer.it_interval;
+  }
+  setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
 int main(int argc, char *argv[]) {
   std::string filename;
   bool verbose = false;
   bool debug = false;
+  bool print_stack = false;
+  EngineKind engine = ENGINE_THREADED;
+  bool fusion = true;
+  bool jit = true;
+  unsigned long jit_threshold = JIT_DEFAULT_THRESHOLD;
+  std::string fusion_profile;
+  unsigned long stack_size = STACK_SIZE;
+  unsigned long call_depth = STACK_SIZE;
+  unsigned long data_size = MEM_SIZE;
+  LoadMode load_mode = LOAD_LAZY;
+  bool profile = false;
+  std::string profile_out;
+  unsigned long sample_hz = 0;
+  std::string sample_out;
+  std::string trace_file;
+  unsigned long trace_records = TRACE_DEFAULT_RECORDS;
+  bool huge_pages = false;
+  bool gc_prefetch = false;
+  CollectorKind collector = COLLECTOR_MARK_SWEEP;
+  unsigned long nursery_size = NURSERY_OBJECTS;
+  unsigned long semispace_size = SEMISPACE_OBJECTS;
+  unsigned long gc_budget = GC_DEFAULT_BUDGET_US;
+  unsigned long gc_threads = 1;
+  bool lazy_sweep = false;
 
   if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " <bytecode_file> [--verbose] [--debug]"
+    std::cerr << "Usage: " << argv[0] << " <bytecode_file> [--verbose] [--debug] [--print-stack]"
+              << " [--engine=threaded|register|switch] [--no-fusion]"
+              << " [--no-jit] [--jit-threshold=<n>]"
+              << " [--fusion-profile=<file>]"
+              << " [--stack-size=<slots>] [--call-depth=<frames>]"
+              << " [--data-size=<words>] [--load=lazy|prefault|advise]"
+              << " [--profile] [--profile-out=<file>]"
+              << " [--sample[=<hz>]] [--sample-out=<file>]"
+              << " [--trace=<file>] [--trace-size=<records>]"
+              << " [--heap-huge-pages] [--gc-prefetch]"
+              << " [--gc=mark-sweep|generational|incremental|semispace]"
+              << " [--nursery-size=<objects>] [--gc-budget=<us>]"
+              << " [--semispace-size=<objects>]"
+              << " [--gc-threads=<n>] [--gc-lazy-sweep]"
               << std::endl;
     return 1;
   }
@@ -33,31 +125,173 @@ int main(int argc, char *argv[]) {
       verbose = true;
     } else if (arg == "--debug" || arg == "-d") {
       debug = true;
+    } else if (arg == "--print-stack") {
+      print_stack = true;
+    } else if (arg == "--engine=threaded") {
+      engine = ENGINE_THREADED;
+    } else if (arg == "--engine=register") {
+      engine = ENGINE_REGISTER;
+    } else if (arg == "--engine=switch") {
+      engine = ENGINE_SWITCH;
+    } else if (arg == "--no-fusion") {
+      fusion = false;
+    } else if (arg == "--no-jit") {
+      jit = false;
+    } else if (arg.rfind("--jit-threshold=", 0) == 0) {
+      const char *value = arg.c_str() + 16;
+      char *end;
+      jit_threshold = std::strtoul(value, &end, 10);
+      if (end == value || *end != '\0') {
+        std::cerr << "Invalid JIT threshold: " << value << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--fusion-profile=", 0) == 0) {
+      fusion_profile = arg.substr(17);
+    } else if (arg.rfind("--stack-size=", 0) == 0) {
+      if (!parse_size(arg.c_str() + 13, MAX_STACK_SIZE, stack_size)) {
+        std::cerr << "Invalid stack size: " << arg.substr(13) << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--call-depth=", 0) == 0) {
+      if (!parse_size(arg.c_str() + 13, MAX_STACK_SIZE, call_depth)) {
+        std::cerr << "Invalid call depth: " << arg.substr(13) << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--data-size=", 0) == 0) {
+      if (!parse_size(arg.c_str() + 12, MAX_MEM_SIZE, data_size)) {
+        std::cerr << "Invalid data size: " << arg.substr(12) << std::endl;
+        return 1;
+      }
+    } else if (arg == "--load=lazy") {
+      load_mode = LOAD_LAZY;
+    } else if (arg == "--load=prefault") {
+      load_mode = LOAD_PREFAULT;
+    } else if (arg == "--load=advise") {
+      load_mode = LOAD_ADVISE;
+    } else if (arg == "--profile") {
+      profile = true;
+    } else if (arg.rfind("--profile-out=", 0) == 0) {
+      profile = true;
+      profile_out = arg.substr(14);
+    } else if (arg == "--sample") {
+      sample_hz = DEFAULT_SAMPLE_HZ;
+    } else if (arg.rfind("--sample=", 0) == 0) {
+      if (!parse_size(arg.c_str() + 9, MAX_SAMPLE_HZ, sample_hz)) {
+        std::cerr << "Invalid sample rate: " << arg.substr(9) << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--sample-out=", 0) == 0) {
+      if (!sample_hz)
+        sample_hz = DEFAULT_SAMPLE_HZ;
+      sample_out = arg.substr(13);
+    } else if (arg.rfind("--trace=", 0) == 0) {
+      trace_file = arg.substr(8);
+    } else if (arg.rfind("--trace-size=", 0) == 0) {
+      if (!parse_size(arg.c_str() + 13, TRACE_MAX_RECORDS, trace_records)) {
+        std::cerr << "Invalid trace size: " << arg.substr(13) << std::endl;
+        return 1;
+      }
+    } else if (arg == "--heap-huge-pages") {
+      huge_pages = true;
+    } else if (arg == "--gc-prefetch") {
+      gc_prefetch = true;
+    } else if (arg == "--gc-lazy-sweep") {
+      lazy_sweep = true;
+    } else if (arg == "--gc=mark-sweep") {
+      collector = COLLECTOR_MARK_SWEEP;
+    } else if (arg == "--gc=generational") {
+      collector = COLLECTOR_GENERATIONAL;
+    } else if (arg == "--gc=incremental") {
+      collector = COLLECTOR_INCREMENTAL;
+    } else if (arg == "--gc=semispace") {
+      collector = COLLECTOR_SEMISPACE;
+    } else if (arg.rfind("--semispace-size=", 0) == 0) {
+      if (!parse_size(arg.c_str() + 17, MAX_SEMISPACE_OBJECTS, semispace_size)) {
+        std::cerr << "Invalid semispace size: " << arg.substr(17) << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--gc-budget=", 0) == 0) {
+      if (!parse_size(arg.c_str() + 12, GC_MAX_BUDGET_US, gc_budget)) {
+        std::cerr << "Invalid GC budget: " << arg.substr(12) << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--gc-threads=", 0) == 0) {
+      if (!parse_size(arg.c_str() + 13, MAX_GC_THREADS, gc_threads)) {
+        std::cerr << "Invalid GC thread count: " << arg.substr(13) << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--nursery-size=", 0) == 0) {
+      if (!parse_size(arg.c_str() + 15, MAX_NURSERY_OBJECTS, nursery_size)) {
+        std::cerr << "Invalid nursery size: " << arg.substr(15) << std::endl;
+        return 1;
+      }
     } else {
       std::cerr << "Unknown argument: " << arg << std::endl;
       return 1;
     }
   }
+  if (profile && !trace_file.empty()) {
+    std::cerr << "--profile and --trace cannot be combined" << std::endl;
+    return 1;
+  }
 
   VM vm;
   vm.setVerbose(verbose);
   vm.debug_mode = debug;
+  vm.engine = engine;
+  vm.load_mode = load_mode;
+  vm.fusion = fusion;
+  vm.jit = jit;
+  vm.jit_code.threshold = jit_threshold;
+  vm.profile = profile;
+  vm.heap.huge_pages = huge_pages;
+  vm.marker.prefetch = gc_prefetch;
+  vm.collector = collector;
+  vm.gc_budget_us = gc_budget;
+  vm.parallel.set_threads(gc_threads);
+  vm.lazy_sweep = lazy_sweep;
   
   global_vm = &vm;
   signal(SIGUSR1, handle_signal);
+  signal(SIGPROF, handle_signal);
   
-  // Unblock SIGUSR1 now that handler is installed
+  // Unblock the signals now that the handler is installed
   sigset_t set;
   sigemptyset(&set);
   sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGPROF);
   sigprocmask(SIG_UNBLOCK, &set, NULL);
 
   try {
+    vm.register_stack.resize(stack_size);
+    vm.call_stack.resize(call_depth);
+    vm.data_memory.resize(data_size);
+    if (collector == COLLECTOR_GENERATIONAL) {
+      vm.nursery.resize(nursery_size);
+    }
+    if (collector == COLLECTOR_SEMISPACE) {
+      vm.from_space.resize(semispace_size);
+      vm.to_space.resize(semispace_size);
+    }
+    if (!fusion_profile.empty()) {
+      vm.fusion_profile = load_fusion_profile(fusion_profile);
+    }
     vm.load(filename);
+    if (!trace_file.empty()) {
+      vm.tracer.open(trace_file, trace_records);
+    }
+    set_sample_timer(sample_hz);
     vm.run();
-    if (verbose) {
+    set_sample_timer(0);
+    if (verbose || print_stack) {
       vm.printStack();
     }
+    if (profile) {
+      write_profile(vm, profile_out);
+    }
+    if (sample_hz) {
+      write_samples(vm, sample_out);
+    }
   } catch (const std::runtime_error &e) {
     std::cerr << "VM Error: " << e.what() << std::endl;
     return 1;
@@ -0,0 +1,87 @@
+#include "marker.hpp"
+
+void Marker::mark(Object *obj) {
+  push(obj);
+  drain();
+  while (overflowed) {
+    overflowed = false;
+    ++overflows;
+    rescan();
+  }
+}
+
+bool Marker::mark_some(unsigned long count) {
+  while (count && !stack.empty()) {
+    Object *obj = stack.back();
+    stack.pop_back();
+    for (; obj && count; --count)
+      obj = scan(obj);
+    if (obj)
+      push_claimed(obj); // Out of work with the tail still to scan
+  }
+  if (stack.empty() && overflowed) {
+    overflowed = false;
+    ++overflows;
+    rescan();
+  }
+  return stack.empty() && !overflowed;
+}
+
+// Pushes the children of `obj` but one, which is returned if it still has
+// to be scanned.
+Object *Marker::scan(Object *obj) {
+  switch (obj->type) {
+  case OBJ_PAIR:
+    push(obj->pair.head);
+    return claim(obj->pair.tail) ? obj->pair.tail : nullptr;
+  case OBJ_CLOSURE:
+    push(obj->closure.fn);
+    return claim(obj->closure.env) ? obj->closure.env : nullptr;
+  case OBJ_FUNCTION:
+  case OBJ_FORWARDED:
+    break;
+  }
+  return nullptr;
+}
+
+void Marker::drain() {
+  if (prefetch) {
+    drain_prefetching();
+    return;
+  }
+  while (!stack.empty()) {
+    Object *obj = stack.back();
+    stack.pop_back();
+    while (obj)
+      obj = scan(obj);
+  }
+}
+
+// As drain(), but objects are held in a FIFO for MARK_PREFETCH_DISTANCE
+// pops after leaving the stack, so the prefetch push() issued has longer to
+// land before they are scanned.
+void Marker::drain_prefetching() {
+  Object *fifo[MARK_PREFETCH_DISTANCE];
+  unsigned long head = 0, count = 0;
+  while (!stack.empty() || count) {
+    if (!stack.empty() && count < MARK_PREFETCH_DISTANCE) {
+      Object *obj = stack.back();
+      stack.pop_back();
+      fifo[(head + count++) % MARK_PREFETCH_DISTANCE] = obj;
+      continue;
+    }
+    Object *obj = fifo[head];
+    head = (head + 1) % MARK_PREFETCH_DISTANCE;
+    --count;
+    if ((obj = scan(obj)))
+      push_claimed(obj);
+  }
+}
+
+void Marker::rescan() {
+  heap.each_marked([&](Object *obj) {
+    while ((obj = scan(obj))) {
+    }
+    drain();
+  });
+}
@@ -0,0 +1,87 @@
+#ifndef MARKER_HPP
+#define MARKER_HPP
+
+#include "heap.hpp"
+#include <vector>
+
+// Largest mark stack, in entries (8 MiB).
+#define MARK_STACK_LIMIT (1UL << 20)
+// Objects in flight between being prefetched and being scanned.
+#define MARK_PREFETCH_DISTANCE 8
+
+// Marking for the collector.
+//
+// Objects are marked when they are pushed onto an explicit mark stack, and
+// scanned for children when they are popped, so the depth of the object
+// graph never reaches the native stack. One child of each object, the tail
+// of a pair, is followed straight away instead of going through the stack,
+// so walking a list costs no pushes. The stack grows as needed up to
+// `limit` entries. Past that, pushes are dropped and the marker notes the
+// overflow: the dropped objects are marked but not scanned. Once the stack
+// drains, the heap is rescanned for marked objects with unmarked children,
+// which are pushed in turn, until a pass ends without overflowing.
+//
+// With `prefetch` set, objects are prefetched as they are pushed, and popped
+// objects go through a short FIFO: each is scanned MARK_PREFETCH_DISTANCE
+// pops later, by which time its cache line has usually arrived.
+class Marker {
+public:
+  explicit Marker(Heap &heap) : heap(heap) {}
+
+  // Marks `obj` and everything reachable from it. `obj` may be null.
+  void mark(Object *obj);
+
+  // Incremental marking, in the tri-color terms: an unmarked object is
+  // white, a marked one on the stack (or dropped from it) grey, and any
+  // other marked one black. shade() makes a white object grey, and
+  // mark_some() blackens up to `count` grey objects, returning true once
+  // none are left. mark() finishes the job in one go.
+  void shade(Object *obj) { push(obj); }
+  // Marks a new object black. Its fields must be shaded as they are stored.
+  void blacken(Object *obj) { claim(obj); }
+  bool mark_some(unsigned long count);
+  // Forgets the grey objects, when marking is abandoned or starts over.
+  void reset() {
+    stack.clear();
+    overflowed = false;
+    marked = 0;
+  }
+
+  bool prefetch = false;
+  unsigned long limit = MARK_STACK_LIMIT;
+  unsigned long overflows = 0; // Rescans of the heap, since creation
+  unsigned long marked = 0;    // Objects marked since reset()
+
+private:
+  // Marks `obj`, returning false if it is null or already was.
+  bool claim(Object *obj) {
+    if (!obj || !heap.mark(obj))
+      return false;
+    ++marked;
+    return true;
+  }
+  void push(Object *obj) {
+    if (claim(obj))
+      push_claimed(obj);
+  }
+  // Pushes an object that is already marked, or drops it if the stack is full.
+  void push_claimed(Object *obj) {
+    if (stack.size() < limit) {
+      if (prefetch)
+        __builtin_prefetch(obj);
+      stack.push_back(obj);
+    } else {
+      overflowed = true;
+    }
+  }
+  Object *scan(Object *obj);
+  void drain();
+  void drain_prefetching();
+  void rescan();
+
+  Heap &heap;
+  std::vector<Object *> stack;
+  bool overflowed = false;
+};
+
+#endif // MARKER_HPP
@@ -1,17 +1,31 @@
 #include "memory.hpp"
-#include <cstring>
 #include <stdexcept>
 
-Memory::Memory() { memset(mem, 0, sizeof(mem)); }
+Memory::Memory(unsigned long n) { resize(n); }
 
 Memory::~Memory() {}
 
+void Memory::resize(unsigned long n) {
+  // Stacks start on a page boundary by default. Starting half a page off
+  // keeps low addresses of memory and the stack from being 4 KiB apart,
+  // which makes the CPU stall loads from one behind stores to the other.
+  pages.reserve(n * sizeof(long), 2048);
+  mem = (long *)pages.data();
+  words = n;
+}
+
+void Memory::map_file(int fd, unsigned long n, LoadMode mode) {
+  pages.map_file(fd, n * sizeof(long), mode);
+  mem = (long *)pages.data();
+  words = n;
+}
+
 bool Memory::is_valid_address(unsigned long address) {
-  return address < MEM_SIZE;
+  return address < words;
 }
 
 void Memory::load(long array[], long size) {
-  if (size > MEM_SIZE)
+  if ((unsigned long)size > words)
     throw std::runtime_error(
         "Memory Load Error: Array size exceeds memory capacity.");
   for (long i = 0; i < size; ++i) {
@@ -19,7 +33,7 @@ void Memory::load(long array[], long size) {
   }
 }
 
-void Memory::reset() { memset(mem, 0, sizeof(mem)); }
+void Memory::reset() { pages.clear(); }
 
 void Memory::store(unsigned long address, long val) {
   if (!is_valid_address(address))
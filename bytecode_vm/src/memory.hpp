@@ -1,20 +1,40 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
-#define MEM_SIZE 1024 * 20
+#include "region.hpp"
 
+// Default size of data memory, in words. Pages are only committed when used.
+#define MEM_SIZE (1024 * 1024)
+// Largest memory compiled code can address (LOAD and STORE indices become
+// 32-bit displacements).
+#define MAX_MEM_SIZE (1UL << 28)
+
+// Words in a Region (see region.hpp). LOAD and STORE indices are checked
+// when a program is loaded, so nothing relies on the guard page being right
+// after the last word.
 class Memory {
 public:
-  Memory();
+  explicit Memory(unsigned long n = MEM_SIZE);
   ~Memory();
+  // Replaces the memory with `n` zeroed words.
+  void resize(unsigned long n);
+  // Replaces the memory with the first `n` words of the file open on `fd`,
+  // mapped rather than copied (see Region::map_file).
+  void map_file(int fd, unsigned long n, LoadMode mode);
   void load(long array[], long size);
   void reset();
   void store(unsigned long address, long val);
   bool is_valid_address(unsigned long address);
   long get(unsigned long address);
+  unsigned long size() const { return words; }
+
+  // Raw access for the threaded engine, which does its own bounds checks
+  long *base() { return mem; }
 
 private:
-  long mem[MEM_SIZE];
+  Region pages;
+  long *mem;
+  unsigned long words;
 };
 
 #endif // !MEMORY_H
@@ -0,0 +1,21 @@
+#include "nursery.hpp"
+#include <stdexcept>
+#include <sys/mman.h>
+
+Nursery::~Nursery() {
+  if (start)
+    munmap(start, capacity() * sizeof(Object));
+}
+
+void Nursery::resize(unsigned long objects) {
+  if (size())
+    throw std::runtime_error("Nursery Error: Cannot resize a nursery in use.");
+  void *p = mmap(nullptr, objects * sizeof(Object), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::runtime_error("Nursery Allocation Failed");
+  if (start)
+    munmap(start, capacity() * sizeof(Object));
+  start = top = (Object *)p;
+  end = start + objects;
+}
@@ -0,0 +1,62 @@
+#ifndef NURSERY_HPP
+#define NURSERY_HPP
+
+#include "object.hpp"
+#include <utility>
+
+// The young generation of the generational collector.
+//
+// New objects are bump-allocated from one mapped block. When it is full, a
+// minor collection (VM::collect_nursery) copies the objects still reachable
+// out to the mature heap, leaving an OBJ_FORWARDED object behind in each
+// one's place so that later references to it can be redirected, and then
+// empties the block. Objects never change once made, so a mature object can
+// only point at objects older than itself, never into the nursery: the
+// roots are all a minor collection has to trace from, and it costs time in
+// proportion to the survivors, whatever the size of the mature heap.
+//
+// The semispace collector uses two of these blocks as its halves.
+
+// Default size, in objects (1.5 MiB), and the largest --nursery-size.
+#define NURSERY_OBJECTS (1UL << 16)
+#define MAX_NURSERY_OBJECTS (1UL << 30)
+
+class Nursery {
+public:
+  Nursery() = default;
+  ~Nursery();
+  Nursery(const Nursery &) = delete;
+  Nursery &operator=(const Nursery &) = delete;
+
+  // Maps room for `objects` objects in place of the current block, which
+  // must be empty. Throws std::runtime_error if it cannot be mapped.
+  void resize(unsigned long objects);
+
+  // A cell for a new object, or null if the nursery is full or has no block.
+  Object *allocate() { return top < end ? top++ : nullptr; }
+
+  bool contains(const Object *obj) const { return obj >= start && obj < top; }
+  unsigned long size() const { return top - start; }
+  unsigned long capacity() const { return end - start; }
+
+  // Calls f(obj) for every object in the nursery, including any f
+  // allocates.
+  template <typename F> void each(F f) const {
+    for (Object *obj = start; obj < top; ++obj)
+      f(obj);
+  }
+  // Frees every object, once the survivors have been promoted.
+  void clear() { top = start; }
+  void swap(Nursery &other) {
+    std::swap(start, other.start);
+    std::swap(top, other.top);
+    std::swap(end, other.end);
+  }
+
+private:
+  Object *start = nullptr;
+  Object *top = nullptr; // Next object to hand out
+  Object *end = nullptr;
+};
+
+#endif // NURSERY_HPP
@@ -1,12 +1,13 @@
 #ifndef OBJECT_HPP
 #define OBJECT_HPP
 
-enum ObjectType { OBJ_PAIR, OBJ_FUNCTION, OBJ_CLOSURE };
+// OBJ_FORWARDED is only found in the nursery: the object has been promoted
+// and `forward` is its new address (see nursery.hpp).
+enum ObjectType { OBJ_PAIR, OBJ_FUNCTION, OBJ_CLOSURE, OBJ_FORWARDED };
 
+// Mark bits are kept beside the objects, in their heap chunk (see heap.hpp).
 struct Object {
-  bool marked;
   ObjectType type;
-  Object *next;
 
   union {
     struct {
@@ -23,6 +24,8 @@ struct Object {
       Object *fn;
       Object *env;
     } closure;
+
+    Object *forward;
   };
 };
 
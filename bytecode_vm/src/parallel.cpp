@@ -0,0 +1,205 @@
+#include "parallel.hpp"
+#include <csignal>
+
+ParallelCollector::ParallelCollector(Heap &heap) : heap(heap) {
+  workers.emplace_back(new Worker);
+}
+
+ParallelCollector::~ParallelCollector() { stop_threads(); }
+
+void ParallelCollector::set_threads(unsigned count) {
+  if (count < 1)
+    count = 1;
+  stop_threads();
+  workers.clear();
+  for (unsigned i = 0; i < count; ++i)
+    workers.emplace_back(new Worker);
+  for (unsigned id = 1; id < count; ++id)
+    pool.emplace_back(&ParallelCollector::thread_main, this, id, generation);
+}
+
+void ParallelCollector::stop_threads() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &thread : pool)
+    thread.join();
+  pool.clear();
+  stopping = false;
+}
+
+void ParallelCollector::run(const std::function<void(unsigned)> &f) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    job = &f;
+    ++generation;
+    running = pool.size();
+  }
+  wake.notify_all();
+  f(0);
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [this] { return running == 0; });
+  job = nullptr;
+}
+
+// `seen` is the last job started before the thread was.
+void ParallelCollector::thread_main(unsigned id, unsigned long seen) {
+  // Signals (the sampler's SIGPROF, stats on SIGUSR1) are for the thread
+  // running the program.
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, nullptr);
+  for (;;) {
+    const std::function<void(unsigned)> *f;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+      f = job;
+    }
+    (*f)(id);
+    std::lock_guard<std::mutex> guard(lock);
+    if (--running == 0)
+      done.notify_one();
+  }
+}
+
+void ParallelCollector::mark(const std::vector<Object *> &roots) {
+  unsigned next = 0;
+  for (Object *root : roots) {
+    if (root && Heap::mark_atomic(root)) {
+      workers[next]->stack.push_back(root);
+      next = (next + 1) % workers.size();
+    }
+  }
+  idle = 0;
+  run([this](unsigned id) { mark_worker(id); });
+  for (auto &worker : workers) {
+    steals += worker->steals;
+    worker->steals = 0;
+  }
+}
+
+void ParallelCollector::mark_worker(unsigned id) {
+  Worker &self = *workers[id];
+  for (;;) {
+    while (!self.stack.empty()) {
+      Object *obj = self.stack.back();
+      self.stack.pop_back();
+      while (obj)
+        obj = scan(self, obj);
+      // Share work when the stack is deep, or as soon as there is any to
+      // spare while another worker waits: a tree marked depth first never
+      // has a deep stack.
+      if (!self.shared_size && (self.stack.size() >= 2 * STEAL_BATCH ||
+                                (idle && self.stack.size() > 1)))
+        publish(self);
+    }
+    if (take_shared(self) || steal(id))
+      continue;
+    // Out of work. Nothing can be added to an idle worker's deque, so once
+    // all are idle every deque is empty and marking is done. Until then,
+    // watch for one to steal from.
+    ++idle;
+    for (;;) {
+      if (idle == workers.size())
+        return;
+      bool any = false;
+      for (auto &worker : workers)
+        any |= worker->shared_size != 0;
+      if (any) {
+        --idle;
+        if (steal(id))
+          break;
+        ++idle;
+      }
+      std::this_thread::yield();
+    }
+  }
+}
+
+// As Marker::scan().
+Object *ParallelCollector::scan(Worker &self, Object *obj) {
+  Object *pushed = nullptr, *followed = nullptr;
+  switch (obj->type) {
+  case OBJ_PAIR:
+    pushed = obj->pair.head;
+    followed = obj->pair.tail;
+    break;
+  case OBJ_CLOSURE:
+    pushed = obj->closure.fn;
+    followed = obj->closure.env;
+    break;
+  case OBJ_FUNCTION:
+  case OBJ_FORWARDED:
+    return nullptr;
+  }
+  if (pushed && Heap::mark_atomic(pushed))
+    self.stack.push_back(pushed);
+  return followed && Heap::mark_atomic(followed) ? followed : nullptr;
+}
+
+// Moves the oldest half of the stack, up to STEAL_BATCH entries, to the
+// deque.
+void ParallelCollector::publish(Worker &self) {
+  unsigned long count = self.stack.size() / 2;
+  if (count > STEAL_BATCH)
+    count = STEAL_BATCH;
+  std::lock_guard<std::mutex> guard(self.lock);
+  self.shared.insert(self.shared.end(), self.stack.begin(),
+                     self.stack.begin() + count);
+  self.stack.erase(self.stack.begin(), self.stack.begin() + count);
+  self.shared_size = self.shared.size();
+}
+
+// Takes back whatever is left in the worker's own deque.
+bool ParallelCollector::take_shared(Worker &self) {
+  if (!self.shared_size)
+    return false;
+  std::lock_guard<std::mutex> guard(self.lock);
+  self.stack.insert(self.stack.end(), self.shared.begin(), self.shared.end());
+  self.shared.clear();
+  self.shared_size = 0;
+  return !self.stack.empty();
+}
+
+// Takes half of the first non-empty deque after worker `id`'s own.
+bool ParallelCollector::steal(unsigned id) {
+  Worker &self = *workers[id];
+  for (unsigned i = 1; i < workers.size(); ++i) {
+    Worker &victim = *workers[(id + i) % workers.size()];
+    if (!victim.shared_size)
+      continue;
+    std::lock_guard<std::mutex> guard(victim.lock);
+    unsigned long count = (victim.shared.size() + 1) / 2;
+    if (!count)
+      continue;
+    self.stack.insert(self.stack.end(), victim.shared.begin(),
+                      victim.shared.begin() + count);
+    victim.shared.erase(victim.shared.begin(), victim.shared.begin() + count);
+    victim.shared_size = victim.shared.size();
+    ++self.steals;
+    return true;
+  }
+  return false;
+}
+
+unsigned long ParallelCollector::sweep() {
+  chunks.clear();
+  for (Chunk *chunk = heap.first_chunk(); chunk; chunk = chunk->next)
+    chunks.push_back(chunk);
+  next_chunk = 0;
+  freed = 0;
+  run([this](unsigned) {
+    unsigned long mine = 0;
+    for (unsigned long i; (i = next_chunk++) < chunks.size();)
+      mine += Heap::sweep_chunk(chunks[i]);
+    freed += mine;
+  });
+  heap.release_empty();
+  return freed;
+}
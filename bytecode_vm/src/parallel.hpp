@@ -0,0 +1,93 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include "heap.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Largest --gc-threads.
+#define MAX_GC_THREADS 64
+// Most entries a marking worker hands over for stealing at a time.
+#define STEAL_BATCH 256
+
+// Marking and sweeping on several threads, for --gc-threads.
+//
+// A pool of worker threads sleeps between collections; the thread that
+// starts one works as worker 0 alongside them. Marking begins with the
+// roots dealt out to the workers in turn. Each marks as Marker does, with a
+// private stack and the tail of a pair followed in place, but claims objects
+// with Heap::mark_atomic so that however many workers reach an object only
+// one scans it. A worker whose stack is deep, or that has entries to spare
+// while another is idle, moves its oldest entries, the ones likeliest to
+// have large graphs under them, to a deque of its own, and a worker that
+// runs dry steals half of another's deque. Marking is over once every
+// worker is idle, at which point no deque can hold anything.
+//
+// Sweeping deals out chunks one at a time from a shared counter. A chunk's
+// bitmaps are only ever touched by the worker sweeping it, and the chunks
+// left empty are unmapped afterwards by the calling thread, so the heap ends
+// up just as Heap::sweep() would leave it.
+class ParallelCollector {
+public:
+  explicit ParallelCollector(Heap &heap);
+  ~ParallelCollector();
+  ParallelCollector(const ParallelCollector &) = delete;
+  ParallelCollector &operator=(const ParallelCollector &) = delete;
+
+  // Uses `count` workers from now on, starting or stopping threads to suit.
+  // 1 means no threads: the collector is then serial.
+  void set_threads(unsigned count);
+  unsigned threads() const { return workers.size(); }
+
+  // Marks the roots, which may be null, and everything reachable from them.
+  void mark(const std::vector<Object *> &roots);
+  // As Heap::sweep().
+  unsigned long sweep();
+
+  unsigned long steals = 0; // Batches taken from other workers, since creation
+
+private:
+  struct Worker {
+    std::vector<Object *> stack;
+    std::mutex lock;             // Guards `shared`
+    std::deque<Object *> shared; // Entries up for stealing, oldest first
+    std::atomic<unsigned long> shared_size{0};
+    unsigned long steals = 0;
+  };
+
+  // Runs job(id) on every worker, the caller being worker 0, and returns
+  // once they have all finished.
+  void run(const std::function<void(unsigned)> &job);
+  void thread_main(unsigned id, unsigned long seen);
+  void stop_threads();
+
+  void mark_worker(unsigned id);
+  Object *scan(Worker &self, Object *obj);
+  void publish(Worker &self);
+  bool take_shared(Worker &self);
+  bool steal(unsigned id);
+
+  Heap &heap;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> pool;
+
+  std::mutex lock; // Guards the fields below, up to `idle`
+  std::condition_variable wake, done;
+  const std::function<void(unsigned)> *job = nullptr;
+  unsigned long generation = 0; // Jobs started
+  unsigned running = 0;         // Threads still on the current job
+  bool stopping = false;
+
+  std::atomic<unsigned> idle{0}; // Marking workers out of work
+  std::vector<Chunk *> chunks;
+  std::atomic<unsigned long> next_chunk{0};
+  std::atomic<unsigned long> freed{0};
+};
+
+#endif // PARALLEL_HPP
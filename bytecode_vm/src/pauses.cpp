@@ -0,0 +1,45 @@
+#include "pauses.hpp"
+
+// Values below 8 ns have a bucket each. Above, the bucket is the power of
+// two and the three bits below the leading one.
+static unsigned long bucket_of(unsigned long ns) {
+  if (ns < 8)
+    return ns;
+  unsigned long power = 63 - __builtin_clzl(ns);
+  return 8 * (power - 2) + (ns >> (power - 3) & 7);
+}
+
+// The largest value that falls in `bucket`.
+static unsigned long bucket_end(unsigned long bucket) {
+  if (bucket < 8)
+    return bucket;
+  unsigned long power = bucket / 8 + 2;
+  unsigned long step = 1UL << (power - 3);
+  return (8 + bucket % 8) * step + step - 1;
+}
+
+void PauseHistogram::record(unsigned long ns) {
+  ++buckets[bucket_of(ns)];
+  ++recorded;
+  sum += ns;
+  if (ns > longest)
+    longest = ns;
+}
+
+double PauseHistogram::percentile(double fraction) const {
+  if (!recorded)
+    return 0;
+  // The smallest bucket with at least `rank` pauses at or below it
+  unsigned long rank = (unsigned long)(fraction * recorded + 0.999999);
+  if (rank == 0)
+    rank = 1;
+  unsigned long seen = 0;
+  for (unsigned long b = 0; b < PAUSE_BUCKETS; ++b) {
+    seen += buckets[b];
+    if (seen >= rank) {
+      unsigned long end = bucket_end(b);
+      return (end < longest ? end : longest) / 1e3;
+    }
+  }
+  return max();
+}
@@ -0,0 +1,33 @@
+#ifndef PAUSES_HPP
+#define PAUSES_HPP
+
+// A histogram of pause times, for the collectors' statistics.
+//
+// Pauses are counted in log-linear buckets: each power of two of
+// nanoseconds is split into 8 buckets, so a percentile is known to within
+// an eighth of its value while the histogram stays a fixed 4 KiB however
+// many pauses it has seen. The longest pause and the total are exact.
+
+#define PAUSE_BUCKETS 496
+
+class PauseHistogram {
+public:
+  void record(unsigned long ns);
+
+  unsigned long count() const { return recorded; }
+  // In microseconds
+  double total() const { return sum / 1e3; }
+  double max() const { return longest / 1e3; }
+  double mean() const { return recorded ? total() / recorded : 0; }
+  // The time that `fraction` of the pauses took no longer than, rounded up
+  // to the end of its bucket. 0 if there are no pauses.
+  double percentile(double fraction) const;
+
+private:
+  unsigned long buckets[PAUSE_BUCKETS] = {};
+  unsigned long recorded = 0;
+  unsigned long sum = 0;
+  unsigned long longest = 0;
+};
+
+#endif // PAUSES_HPP
@@ -0,0 +1,319 @@
+#include "profiler.hpp"
+#include "op_codes.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+// Rows in each table of the text report.
+static const unsigned long REPORT_ROWS = 20;
+
+Profiler::Profiler() { reset(0); }
+
+void Profiler::reset(unsigned long instructions) {
+  counts.assign(instructions, 0);
+  ticks.assign(instructions + 1, 0);
+  none = instructions;
+  last = none;
+  tree.assign(1, Node{ROOT, ROOT, 1, 0, {}});
+  node = ROOT;
+  run_ticks = 0;
+  run_time = std::chrono::steady_clock::duration::zero();
+
+  // The cheapest of many back-to-back reads
+  overhead = ~0UL;
+  for (int i = 0; i < 1000; ++i) {
+    unsigned long a = clock();
+    unsigned long b = clock();
+    overhead = std::min(overhead, b - a);
+  }
+}
+
+void Profiler::start() {
+  last = none;
+  then = started = clock();
+  started_at = std::chrono::steady_clock::now();
+}
+
+void Profiler::stop() {
+  unsigned long now = clock();
+  ticks[last] += now - then;
+  last = none;
+  run_ticks += now - started;
+  run_time += std::chrono::steady_clock::now() - started_at;
+}
+
+void Profiler::call(unsigned long target) {
+  for (unsigned long child : tree[node].children) {
+    if (tree[child].function == target) {
+      node = child;
+      ++tree[node].calls;
+      return;
+    }
+  }
+  unsigned long child = tree.size();
+  tree.push_back(Node{target, node, 1, 0, {}});
+  tree[node].children.push_back(child);
+  node = child;
+}
+
+unsigned long Profiler::instructions() const {
+  unsigned long total = 0;
+  for (unsigned long count : counts)
+    total += count;
+  return total;
+}
+
+double Profiler::nanoseconds(unsigned long t) const {
+  if (run_ticks == 0)
+    return 0;
+  return (double)t *
+         std::chrono::duration<double, std::nano>(run_time).count() /
+         run_ticks;
+}
+
+std::vector<Profiler::Function> Profiler::functions() const {
+  // Instructions run in each subtree. Children are added after their
+  // parents, so one pass from the back adds each into its parent.
+  std::vector<unsigned long> total(tree.size());
+  for (unsigned long i = 0; i < tree.size(); ++i)
+    total[i] = tree[i].instructions;
+  for (unsigned long i = tree.size() - 1; i > 0; --i)
+    total[tree[i].parent] += total[i];
+
+  // A function's inclusive count is the total of its outermost nodes, so
+  // recursive calls are not counted twice.
+  std::vector<Function> result;
+  std::unordered_map<unsigned long, unsigned long> slot;
+  std::unordered_map<unsigned long, unsigned long> active;
+  std::vector<std::pair<unsigned long, unsigned long>> path; // Node, child
+  path.push_back({ROOT, 0});
+  while (!path.empty()) {
+    auto &top = path.back();
+    const Node &at = tree[top.first];
+    unsigned long key = top.first == ROOT ? ~0UL : at.function;
+    if (top.second == 0) {
+      auto found = slot.emplace(key, result.size());
+      if (found.second)
+        result.push_back(Function{top.first == ROOT, at.function, 0, 0, 0});
+      Function &f = result[found.first->second];
+      f.calls += at.calls;
+      f.exclusive += at.instructions;
+      if (active[key]++ == 0)
+        f.inclusive += total[top.first];
+    }
+    if (top.second < at.children.size()) {
+      unsigned long child = at.children[top.second++];
+      path.push_back({child, 0});
+    } else {
+      --active[key];
+      path.pop_back();
+    }
+  }
+  std::sort(result.begin(), result.end(),
+            [](const Function &a, const Function &b) {
+              return a.inclusive > b.inclusive;
+            });
+  return result;
+}
+
+static std::string op_name(unsigned int op) {
+  return op == OP_END ? "END" : opcodeToString((Opcode)op);
+}
+
+// Code labels by address; the first name in order if several share one.
+static std::map<unsigned long, std::string> label_names(DebugInfo &debug) {
+  std::map<unsigned long, std::string> names;
+  for (const auto &label : debug.labels())
+    names.emplace(label.second, label.first);
+  return names;
+}
+
+static std::string function_name(
+    const Program &program, const std::map<unsigned long, std::string> &names,
+    bool root, unsigned long index) {
+  if (root)
+    return "(main)";
+  unsigned long pc = program.at(index).pc;
+  auto name = names.find(pc);
+  return name != names.end() ? name->second : "pc_" + std::to_string(pc);
+}
+
+static double percent(unsigned long part, unsigned long whole) {
+  return whole ? 100.0 * part / whole : 0;
+}
+
+void Profiler::report(const Program &program, DebugInfo &debug,
+                      std::ostream &out) const {
+  auto names = label_names(debug);
+  unsigned long executed = instructions();
+  unsigned long timed = 0;
+  for (unsigned long i = 0; i < counts.size(); ++i)
+    timed += ticks[i];
+
+  out << "--- Profile ---" << std::endl;
+  out << "Instructions: " << executed << " in " << std::fixed
+      << std::setprecision(3) << nanoseconds(run_ticks) / 1e6 << " ms"
+      << std::endl;
+
+  // Opcodes, by time
+  std::map<unsigned int, std::pair<unsigned long, unsigned long>> ops;
+  for (unsigned long i = 0; i < counts.size(); ++i) {
+    if (counts[i]) {
+      auto &op = ops[program.at(i).op];
+      op.first += counts[i];
+      op.second += ticks[i];
+    }
+  }
+  std::vector<std::pair<unsigned int, std::pair<unsigned long, unsigned long>>>
+      by_time(ops.begin(), ops.end());
+  std::sort(by_time.begin(), by_time.end(), [](const auto &a, const auto &b) {
+    return a.second.second > b.second.second;
+  });
+  out << std::endl
+      << std::left << std::setw(12) << "opcode" << std::right << std::setw(14)
+      << "count" << std::setw(8) << "%" << std::setw(14) << "time ms"
+      << std::setw(8) << "%" << std::endl;
+  for (const auto &op : by_time) {
+    out << std::left << std::setw(12) << op_name(op.first) << std::right
+        << std::setw(14) << op.second.first << std::setw(8)
+        << std::setprecision(1) << percent(op.second.first, executed)
+        << std::setw(14) << std::setprecision(3)
+        << nanoseconds(op.second.second) / 1e6 << std::setw(8)
+        << std::setprecision(1) << percent(op.second.second, timed)
+        << std::endl;
+  }
+
+  // Addresses, by count
+  std::vector<unsigned long> hot;
+  for (unsigned long i = 0; i < counts.size(); ++i)
+    if (counts[i])
+      hot.push_back(i);
+  std::sort(hot.begin(), hot.end(), [this](unsigned long a, unsigned long b) {
+    return counts[a] != counts[b] ? counts[a] > counts[b] : a < b;
+  });
+  if (hot.size() > REPORT_ROWS)
+    hot.resize(REPORT_ROWS);
+  out << std::endl
+      << std::setw(8) << "pc" << std::setw(8) << "line" << "  " << std::left
+      << std::setw(12) << "opcode" << std::right << std::setw(14) << "count"
+      << std::setw(8) << "%" << std::setw(14) << "time ms" << std::endl;
+  for (unsigned long i : hot) {
+    const Instruction &ins = program.at(i);
+    unsigned long line = debug.line_of(ins.pc);
+    out << std::setw(8) << ins.pc << std::setw(8)
+        << (line ? std::to_string(line) : "-") << "  " << std::left
+        << std::setw(12) << op_name(ins.op) << std::right << std::setw(14)
+        << counts[i] << std::setw(8) << std::setprecision(1)
+        << percent(counts[i], executed) << std::setw(14)
+        << std::setprecision(3) << nanoseconds(ticks[i]) / 1e6 << std::endl;
+  }
+
+  // Functions, by inclusive instructions
+  std::vector<Function> called = functions();
+  if (called.size() > REPORT_ROWS)
+    called.resize(REPORT_ROWS);
+  out << std::endl
+      << std::left << std::setw(24) << "function" << std::right
+      << std::setw(12) << "calls" << std::setw(14) << "inclusive"
+      << std::setw(8) << "%" << std::setw(14) << "exclusive" << std::setw(8)
+      << "%" << std::endl;
+  for (const Function &f : called) {
+    out << std::left << std::setw(24)
+        << function_name(program, names, f.root, f.index)
+        << std::right << std::setw(12) << f.calls << std::setw(14)
+        << f.inclusive << std::setw(8) << std::setprecision(1)
+        << percent(f.inclusive, executed) << std::setw(14) << f.exclusive
+        << std::setw(8) << percent(f.exclusive, executed) << std::endl;
+  }
+  out << std::defaultfloat;
+}
+
+void Profiler::write_csv(const Program &program, std::ostream &out) const {
+  out << "pc,count,ns,opcode\n";
+  for (unsigned long i = 0; i < counts.size(); ++i) {
+    if (counts[i]) {
+      out << program.at(i).pc << "," << counts[i] << ","
+          << (unsigned long)nanoseconds(ticks[i]) << ","
+          << op_name(program.at(i).op) << "\n";
+    }
+  }
+}
+
+void Profiler::write_json(const Program &program, DebugInfo &debug,
+                          std::ostream &out) const {
+  auto names = label_names(debug);
+  std::map<unsigned int, std::pair<unsigned long, unsigned long>> ops;
+  for (unsigned long i = 0; i < counts.size(); ++i) {
+    if (counts[i]) {
+      auto &op = ops[program.at(i).op];
+      op.first += counts[i];
+      op.second += ticks[i];
+    }
+  }
+
+  out << "{\n  \"instructions\": " << instructions()
+      << ",\n  \"ns\": " << (unsigned long)nanoseconds(run_ticks)
+      << ",\n  \"opcodes\": [";
+  const char *separator = "\n";
+  for (const auto &op : ops) {
+    out << separator << "    {\"opcode\": \"" << op_name(op.first)
+        << "\", \"count\": " << op.second.first
+        << ", \"ns\": " << (unsigned long)nanoseconds(op.second.second)
+        << "}";
+    separator = ",\n";
+  }
+  out << "\n  ],\n  \"addresses\": [";
+  separator = "\n";
+  for (unsigned long i = 0; i < counts.size(); ++i) {
+    if (!counts[i])
+      continue;
+    const Instruction &ins = program.at(i);
+    out << separator << "    {\"pc\": " << ins.pc << ", \"line\": "
+        << debug.line_of(ins.pc) << ", \"opcode\": \"" << op_name(ins.op)
+        << "\", \"count\": " << counts[i]
+        << ", \"ns\": " << (unsigned long)nanoseconds(ticks[i]) << "}";
+    separator = ",\n";
+  }
+  out << "\n  ],\n  \"functions\": [";
+  separator = "\n";
+  for (const Function &f : functions()) {
+    out << separator << "    {\"function\": \""
+        << function_name(program, names, f.root, f.index) << "\", \"pc\": ";
+    if (f.root)
+      out << "null";
+    else
+      out << program.at(f.index).pc;
+    out << ", \"calls\": " << f.calls << ", \"inclusive\": " << f.inclusive
+        << ", \"exclusive\": " << f.exclusive << "}";
+    separator = ",\n";
+  }
+  out << "\n  ]\n}\n";
+}
+
+void Profiler::write_folded(const Program &program, DebugInfo &debug,
+                            std::ostream &out) const {
+  auto names = label_names(debug);
+  // Depth-first, keeping the chain of names down to the current node.
+  std::vector<std::pair<unsigned long, unsigned long>> path{{ROOT, 0}};
+  std::vector<std::string> chain{function_name(program, names, true, 0)};
+  while (!path.empty()) {
+    auto &top = path.back();
+    const Node &at = tree[top.first];
+    if (top.second == 0 && at.instructions) {
+      for (unsigned long i = 0; i < chain.size(); ++i)
+        out << (i ? ";" : "") << chain[i];
+      out << " " << at.instructions << "\n";
+    }
+    if (top.second < at.children.size()) {
+      unsigned long child = at.children[top.second++];
+      path.push_back({child, 0});
+      chain.push_back(
+          function_name(program, names, false, tree[child].function));
+    } else {
+      path.pop_back();
+      chain.pop_back();
+    }
+  }
+}
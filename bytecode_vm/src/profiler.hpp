@@ -0,0 +1,121 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include "container.hpp"
+#include "program.hpp"
+#include <chrono>
+#include <ostream>
+#include <vector>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Execution profile collected by `bvm --profile`.
+//
+// The threaded engine has instrumented instantiations (see engine.cpp) that
+// call step() before every instruction and call()/ret() on CALL and RET; the
+// normal ones contain none of this. They run the program unfused and without
+// the JIT, so every instruction is counted at its own address.
+//
+// Time is read from the time-stamp counter, where there is one, and charged
+// to the instruction that ran until the next step(), less the cost of
+// reading the clock, which is measured when the profile is reset. What
+// remains still includes the rest of the instrumentation, so it is best read
+// as a share of the total.
+//
+// Calls are tracked in a call tree with a node per distinct chain of CALL
+// targets from the start of the program, counting the instructions run in it
+// and how often it was entered. Per function totals, inclusive and
+// exclusive, and the folded stacks are computed from it when reporting.
+class Profiler {
+public:
+  Profiler();
+
+  // Clears the profile for a program of `instructions` decoded instructions.
+  void reset(unsigned long instructions);
+
+  // Hooks for the instrumented engine, which calls start() on entry and
+  // stop() on leaving.
+  void start();
+  void stop();
+  void step(unsigned long index) {
+    unsigned long now = clock();
+    unsigned long spent = now - then;
+    ticks[last] += spent > overhead ? spent - overhead : 0;
+    then = now;
+    last = index;
+    ++counts[index];
+    ++tree[node].instructions;
+  }
+  void call(unsigned long target);
+  void ret() {
+    if (node != ROOT)
+      node = tree[node].parent;
+  }
+
+  // Instructions executed so far.
+  unsigned long instructions() const;
+
+  // Sorted report of the hottest opcodes, addresses and functions. Labels
+  // and source lines are taken from `debug` where the program has them.
+  void report(const Program &program, DebugInfo &debug,
+              std::ostream &out) const;
+  // Count and time per address, one "<pc>,<count>,<ns>,<opcode>" line each
+  // after a header. The file can be passed to --fusion-profile.
+  void write_csv(const Program &program, std::ostream &out) const;
+  // The whole profile: opcodes, addresses and functions.
+  void write_json(const Program &program, DebugInfo &debug,
+                  std::ostream &out) const;
+  // One "<caller>;...;<callee> <instructions>" line per call chain, the
+  // input format of flame graph tools.
+  void write_folded(const Program &program, DebugInfo &debug,
+                    std::ostream &out) const;
+
+private:
+  static const unsigned long ROOT = 0;
+
+  struct Node {
+    unsigned long function; // Instruction index of the CALL target
+    unsigned long parent;
+    unsigned long calls;
+    unsigned long instructions; // Run in this node, not in its callees
+    std::vector<unsigned long> children;
+  };
+
+  struct Function {
+    bool root;           // The program's code outside any call
+    unsigned long index; // Instruction index of the entry
+    unsigned long calls;
+    unsigned long inclusive;
+    unsigned long exclusive;
+  };
+
+  static unsigned long clock() {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  double nanoseconds(unsigned long t) const;
+  std::vector<Function> functions() const;
+
+  std::vector<unsigned long> counts; // Per instruction index
+  std::vector<unsigned long> ticks;  // Per instruction index, plus `none`
+  std::vector<Node> tree;
+  unsigned long node; // The running function's call tree node
+  unsigned long last; // Instruction being timed, or `none`
+  unsigned long none;
+  unsigned long then;
+  unsigned long overhead; // Ticks between two step()s that ran nothing
+  // For converting ticks to nanoseconds
+  unsigned long run_ticks;
+  std::chrono::steady_clock::duration run_time;
+  unsigned long started;
+  std::chrono::steady_clock::time_point started_at;
+};
+
+#endif // PROFILER_HPP
@@ -0,0 +1,122 @@
+#include "program.hpp"
+#include "op_codes.hpp"
+#include <climits>
+#include <stdexcept>
+#include <string>
+
+bool has_operand(unsigned int op) {
+  switch (op) {
+  case PUSH:
+  case JMP:
+  case JZ:
+  case JNZ:
+  case STORE:
+  case LOAD:
+  case CALL:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool is_branch(unsigned int op) {
+  return op == JMP || op == JZ || op == JNZ || op == CALL;
+}
+
+static std::string at_address(unsigned long pc) {
+  return " at address " + std::to_string(pc) + ".";
+}
+
+Program::Program() : linked(nullptr), words(0) {}
+
+void Program::clear() {
+  code.clear();
+  pc_index.clear();
+  unpatched.clear();
+  linked = nullptr;
+  words = 0;
+}
+
+void Program::decode(const long *image, unsigned long count,
+                     unsigned long data_size) {
+  clear();
+  if (count >= UINT_MAX)
+    throw std::runtime_error("VM Load Error: Program is too large.");
+  pc_index.assign(count + 1, -1);
+  code.reserve(count + 1);
+
+  // Pass 1: split the image into instructions and validate the opcodes.
+  unsigned long pc = 0;
+  while (pc < count) {
+    long word = image[pc];
+    Opcode opcode;
+    try {
+      opcode = longToOpcode(word);
+    } catch (const std::runtime_error &) {
+      clear();
+      throw std::runtime_error("VM Load Error: Unknown opcode " +
+                               std::to_string(word) + at_address(pc));
+    }
+
+    Instruction ins;
+    ins.handler = nullptr;
+    ins.operand = 0;
+    ins.pc = pc;
+    ins.op = opcode;
+    ins.exec = opcode;
+    if (has_operand(opcode)) {
+      if (pc + 1 >= count) {
+        clear();
+        throw std::runtime_error("VM Load Error: Missing operand for " +
+                                 opcodeToString(opcode) + at_address(pc));
+      }
+      ins.operand = image[pc + 1];
+    }
+
+    pc_index[pc] = code.size();
+    code.push_back(ins);
+    pc += has_operand(opcode) ? 2 : 1;
+  }
+
+  // Running off the end lands on a sentinel, which branches may also target.
+  Instruction end;
+  end.handler = nullptr;
+  end.operand = 0;
+  end.pc = count;
+  end.op = OP_END;
+  end.exec = OP_END;
+  pc_index[count] = code.size();
+  code.push_back(end);
+
+  // Pass 2: resolve branch targets and check memory indices.
+  for (Instruction &ins : code) {
+    if (is_branch(ins.op)) {
+      long target = ins.operand;
+      long index = (target >= 0 && (unsigned long)target <= count)
+                       ? pc_index[target]
+                       : -1;
+      if (index < 0) {
+        std::string what = opcodeToString((Opcode)ins.op);
+        unsigned long where = ins.pc;
+        clear();
+        throw std::runtime_error("VM Load Error: " + what + " at address " +
+                                 std::to_string(where) + " targets " +
+                                 std::to_string(target) +
+                                 ", which is not the start of an instruction.");
+      }
+      ins.operand = index;
+    } else if (ins.op == STORE || ins.op == LOAD) {
+      if (ins.operand < 0 || (unsigned long)ins.operand >= data_size) {
+        std::string what = opcodeToString((Opcode)ins.op);
+        long index = ins.operand;
+        unsigned long where = ins.pc;
+        clear();
+        throw std::runtime_error("VM Load Error: " + what +
+                                 " uses invalid memory index " +
+                                 std::to_string(index) + at_address(where));
+      }
+    }
+  }
+
+  words = count;
+}
@@ -0,0 +1,119 @@
+#ifndef PROGRAM_HPP
+#define PROGRAM_HPP
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Opcodes that only exist in the decoded form and never appear in a .bin.
+enum InternalOpcode {
+  OP_END = 0x100, // Sentinel past the last instruction
+
+  // Superinstructions installed by Program::fuse
+  OP_DUP_PUSH_CMP_JNZ,
+  OP_DUP_PUSH_CMP_JZ,
+  OP_DUP_JZ,
+  OP_DUP_JNZ,
+  OP_PUSH_ADD,
+  OP_PUSH_SUB,
+  OP_LOAD_JZ,
+  OP_LOAD_ADD_STORE,
+  OP_LOAD_PUSH_ADD_STORE,
+  OP_LOAD_PUSH_SUB_STORE,
+  OP_PUSH_PUSH_ADD_POP,
+
+  OP_BREAK, // Patched in by Program::set_break
+
+  OP_INTERNAL_END
+};
+
+// Size of a dispatch table indexed by Instruction::op or Instruction::exec.
+#define OPCODE_TABLE_SIZE OP_INTERNAL_END
+
+// Execution counts per instruction address, used to restrict fusion to
+// code that actually runs.
+typedef std::unordered_map<unsigned long, unsigned long> FusionProfile;
+
+// One decoded instruction. Opcodes are validated, jump and CALL operands are
+// translated to instruction indices and STORE/LOAD indices are range checked
+// when the program is decoded, so executing it needs no further checks.
+//
+// `op` is always the instruction as written; `exec` is what the fast engines
+// run, which for the first instruction of a fused sequence is the
+// superinstruction covering the whole sequence. The remaining instructions of
+// the sequence are left untouched, so jumping into the middle of it or
+// stepping it in the debugger still works. A breakpoint replaces `exec` with
+// OP_BREAK, which the engines stop at; VM::step always runs `op`.
+struct Instruction {
+  const void *handler;  // Set from `exec` by the engine that links the program
+  long operand;         // Immediate, memory index or target instruction index
+  unsigned int pc;      // Address of the instruction in the .bin image
+  unsigned short op;    // Opcode or OP_END
+  unsigned short exec;  // `op`, a fused InternalOpcode or OP_BREAK
+};
+
+class Program {
+public:
+  Program();
+
+  // Decodes a raw image of `count` words. Throws std::runtime_error with a
+  // "VM Load Error" diagnostic naming the offending address on bad input.
+  void decode(const long *words, unsigned long count,
+              unsigned long data_size);
+  void clear();
+
+  // Replaces common instruction sequences with superinstructions. With a
+  // profile, only sequences whose first instruction ran at least
+  // `min_count` times are fused. Returns the number of sequences fused.
+  unsigned long fuse(const FusionProfile *profile = nullptr,
+                     unsigned long min_count = 1);
+  void unfuse();
+
+  // Patches OP_BREAK over the instruction at `index`, unfusing any sequence
+  // that would run through it, or undoes that. Fusing or unfusing again
+  // removes all breaks.
+  void set_break(unsigned long index);
+  void clear_break(unsigned long index);
+  bool is_break(unsigned long index) const {
+    return code[index].exec == OP_BREAK;
+  }
+
+  bool empty() const { return code.empty(); }
+  unsigned long size() const { return code.size(); }
+  unsigned long length() const { return words; } // Image size in words
+  Instruction *data() { return code.data(); }
+  Instruction &at(unsigned long index) { return code[index]; }
+  const Instruction &at(unsigned long index) const { return code[index]; }
+
+  // Instruction index for an address, or -1 if no instruction starts there.
+  long index_of(unsigned long pc) const {
+    return pc < pc_index.size() ? pc_index[pc] : -1;
+  }
+  // Unchecked variant of index_of for addresses known to be valid.
+  const long *index_table() const { return pc_index.data(); }
+
+  // Handler table the instructions are currently linked against.
+  const void *const *linked;
+
+private:
+  // Sets `exec` at `index` from its value before any break was set.
+  void restore(unsigned long index);
+
+  std::vector<Instruction> code;
+  std::vector<long> pc_index;
+  unsigned long words;
+  // `exec` as fuse() left it, for instructions changed by set_break
+  std::unordered_map<unsigned long, unsigned short> unpatched;
+};
+
+// True for opcodes followed by an operand word in the .bin format.
+bool has_operand(unsigned int op);
+// True for JMP, JZ, JNZ and CALL.
+bool is_branch(unsigned int op);
+// Number of instructions a superinstruction covers (1 for plain opcodes).
+unsigned int fused_length(unsigned int exec);
+// Reads a fusion profile: one "<pc> <count>" pair per line, separated by
+// whitespace or a comma. Lines that do not start with a number are skipped.
+FusionProfile load_fusion_profile(const std::string &filename);
+
+#endif // PROGRAM_HPP
@@ -0,0 +1,122 @@
+#include "region.hpp"
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static unsigned long page_size() {
+  static const unsigned long page = sysconf(_SC_PAGESIZE);
+  return page;
+}
+
+Region::~Region() {
+  if (map)
+    munmap(map, map_size);
+}
+
+void Region::reserve(unsigned long n, unsigned long gap) {
+  unsigned long page = page_size();
+  unsigned long usable = (n + gap + page - 1) / page * page;
+  if (usable < n + gap || n + gap < n)
+    throw std::runtime_error("Region Error: Size is too large.");
+  void *p = mmap(nullptr, usable + page, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::runtime_error("Region Error: Could not reserve address space.");
+  if (usable && mprotect(p, usable, PROT_READ | PROT_WRITE) != 0) {
+    munmap(p, usable + page);
+    throw std::runtime_error("Region Error: Could not reserve address space.");
+  }
+  if (map)
+    munmap(map, map_size);
+  map = (char *)p;
+  map_size = usable + page;
+  start = map + usable - gap - n;
+  bytes = n;
+}
+
+void Region::map_file(int fd, unsigned long n, LoadMode mode) {
+  unsigned long page = page_size();
+  unsigned long usable = (n + page - 1) / page * page;
+  if (usable < n)
+    throw std::runtime_error("Region Error: Size is too large.");
+  // Reserve the guard page along with the file's pages, then map the file
+  // over the front of the reservation.
+  void *p = mmap(nullptr, usable + page, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::runtime_error("Region Error: Could not reserve address space.");
+  int flags = MAP_PRIVATE | MAP_FIXED | (mode == LOAD_PREFAULT ? MAP_POPULATE : 0);
+  if (usable && mmap(p, usable, PROT_READ | PROT_WRITE, flags, fd, 0) ==
+                    MAP_FAILED) {
+    munmap(p, usable + page);
+    throw std::runtime_error("Region Error: Could not map file.");
+  }
+  if (usable && mode == LOAD_ADVISE)
+    madvise(p, usable, MADV_WILLNEED);
+  if (map)
+    munmap(map, map_size);
+  map = (char *)p;
+  map_size = usable + page;
+  start = map;
+  bytes = n;
+}
+
+void Region::release() {
+  if (map)
+    munmap(map, map_size);
+  map = start = nullptr;
+  map_size = bytes = 0;
+}
+
+void Region::clear() {
+  // Private anonymous pages read back as zero once dropped.
+  if (map)
+    madvise(map, map_size - page_size(), MADV_DONTNEED);
+}
+
+// --- Guard pages ---
+
+static thread_local GuardScope *active = nullptr;
+static struct sigaction previous;
+static bool installed = false;
+
+GuardScope::GuardScope(sigjmp_buf &env,
+                       std::initializer_list<const Region *> watched)
+    : env(env), count(0), hit(nullptr), outer(active) {
+  for (const Region *region : watched) {
+    if (count == MAX_REGIONS)
+      throw std::runtime_error("GuardScope Error: Too many regions.");
+    regions[count++] = region;
+  }
+  if (!installed) {
+    struct sigaction action = {};
+    action.sa_sigaction = on_fault;
+    // SA_NODEFER leaves SIGSEGV unblocked after jumping out of the handler.
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous);
+    installed = true;
+  }
+  active = this;
+}
+
+GuardScope::~GuardScope() { active = outer; }
+
+void GuardScope::on_fault(int sig, siginfo_t *info, void *context) {
+  for (GuardScope *scope = active; scope; scope = scope->outer) {
+    for (int i = 0; i < scope->count; ++i) {
+      if (scope->regions[i]->in_guard(info->si_addr)) {
+        // Scopes inside this one are being jumped out of.
+        scope->hit = scope->regions[i];
+        active = scope;
+        siglongjmp(scope->env, 1);
+      }
+    }
+  }
+  // Not an overflow we watch for: restore the previous action, which takes
+  // effect when the faulting instruction runs again on return.
+  sigaction(SIGSEGV, &previous, nullptr);
+  installed = false;
+  (void)sig;
+  (void)context;
+}
@@ -0,0 +1,88 @@
+#ifndef REGION_HPP
+#define REGION_HPP
+
+#include <csetjmp>
+#include <csignal>
+#include <initializer_list>
+
+// How Region::map_file brings a file's pages in.
+enum LoadMode {
+  LOAD_LAZY,     // On first touch, with the kernel's readahead
+  LOAD_PREFAULT, // All at once, while mapping (MAP_POPULATE)
+  LOAD_ADVISE,   // In the background, starting while mapping (MADV_WILLNEED)
+};
+
+// Address space for the VM's stacks and memories.
+//
+// A Region reserves its bytes followed by a guard page that is never
+// accessible. Nothing is committed up front: the kernel supplies a zeroed
+// page the first time one is touched, so a VM with large limits only costs
+// the pages its program actually uses, and clear() hands them back. The
+// usable bytes end `gap` bytes before the guard page (the start is offset
+// into the first page if need be), so with no gap the first access past the
+// end faults.
+class Region {
+public:
+  Region() = default;
+  explicit Region(unsigned long bytes) { reserve(bytes); }
+  ~Region();
+  Region(const Region &) = delete;
+  Region &operator=(const Region &) = delete;
+
+  // Replaces the region with `bytes` zeroed bytes. Throws
+  // std::runtime_error if the address space cannot be reserved.
+  void reserve(unsigned long bytes, unsigned long gap = 0);
+  // Replaces the region with the first `bytes` bytes of the file open on
+  // `fd`, which must hold at least that many. The mapping is private: the
+  // bytes can be written, but changes never reach the file. Throws
+  // std::runtime_error if the file cannot be mapped.
+  void map_file(int fd, unsigned long bytes, LoadMode mode = LOAD_LAZY);
+  // Zeroes the region, or restores a mapped file's bytes, giving its
+  // committed pages back to the system.
+  void clear();
+  // Unmaps the region, leaving it empty.
+  void release();
+
+  void *data() const { return start; }
+  unsigned long size() const { return bytes; }
+  bool in_guard(const void *addr) const {
+    return (const char *)addr >= start + bytes &&
+           (const char *)addr < map + map_size;
+  }
+
+private:
+  char *map = nullptr;
+  unsigned long map_size = 0;
+  char *start = nullptr;
+  unsigned long bytes = 0;
+};
+
+// Catches overflows into guard pages.
+//
+// While a GuardScope is alive, a fault in the guard page of one of its
+// regions jumps back to `env` (set with sigsetjmp in a frame that outlives
+// the scope) with the value 1, and region() tells which region was overrun.
+// Any other fault is left to the previous SIGSEGV action. Scopes nest; the
+// innermost one on the faulting thread that watches the region is used.
+class GuardScope {
+public:
+  GuardScope(sigjmp_buf &env, std::initializer_list<const Region *> regions);
+  ~GuardScope();
+  GuardScope(const GuardScope &) = delete;
+  GuardScope &operator=(const GuardScope &) = delete;
+
+  const Region *region() const { return hit; }
+
+private:
+  static void on_fault(int sig, siginfo_t *info, void *context);
+
+  static const int MAX_REGIONS = 4;
+
+  sigjmp_buf &env;
+  const Region *regions[MAX_REGIONS];
+  int count;
+  const Region *hit;
+  GuardScope *outer;
+};
+
+#endif // REGION_HPP
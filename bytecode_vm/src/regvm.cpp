@@ -0,0 +1,649 @@
+#include "regvm.hpp"
+#include "op_codes.hpp"
+#include "vm.hpp"
+#include <climits>
+#include <iostream>
+#include <stdexcept>
+
+// --- Translation ---
+
+namespace {
+
+// A value on the symbolic stack: a register (stack slot) or a constant.
+// Constants are kept wrapped to the range of a stack slot (see stack.hpp),
+// so folding them gives what running the instructions would.
+struct Value {
+  bool imm;
+  long v;
+};
+
+// Translates one block. The symbolic stack holds the values at positions
+// top - stack.size() .. top - 1, relative to the entry stack pointer. Values
+// below that were inherited and are still in their own slots.
+//
+// A value is either a constant or a register at or below its own position:
+// DUP copies a reference to the value below it. A slot is only written when
+// everything above it has been popped, so such references never go stale.
+class BlockTranslator {
+public:
+  BlockTranslator(RegisterCode &out) : out(out) {}
+
+  void translate(const Program &program, unsigned long first,
+                 unsigned long last);
+
+private:
+  RegisterCode &out;
+  std::vector<Value> stack;
+  long top;    // Stack depth relative to the entry depth
+  long need;   // Entry depth required by the block
+  long growth; // Peak depth above the entry depth
+
+  void emit(int op, long d, long a, long b) {
+    RegInstruction ins;
+    ins.handler = nullptr;
+    ins.op = op;
+    ins.d = d;
+    ins.a = a;
+    ins.b = b;
+    out.code.push_back(ins);
+  }
+
+  void push(Value v) {
+    stack.push_back(v);
+    if (++top > growth)
+      growth = top;
+  }
+
+  Value pop() {
+    --top;
+    if (stack.empty()) {
+      if (-top > need)
+        need = -top;
+      return Value{false, top};
+    }
+    Value v = stack.back();
+    stack.pop_back();
+    return v;
+  }
+
+  // Register holding `v`, loading a constant into the slot at `home`.
+  long in_register(Value v, long home) {
+    if (!v.imm)
+      return v.v;
+    emit(R_MOVI, home, v.v, 0);
+    return home;
+  }
+
+  // Writes every value to its own slot and moves the stack pointer to the
+  // final depth. Returns the adjustment, which later operands must allow for.
+  long flush() {
+    long base = top - stack.size();
+    for (unsigned long i = 0; i < stack.size(); ++i) {
+      const Value &v = stack[i];
+      long pos = base + i;
+      if (v.imm)
+        emit(R_MOVI, pos, v.v, 0);
+      else if (v.v != pos)
+        emit(R_MOV, pos, v.v, 0);
+    }
+    stack.clear();
+    long adjust = top;
+    if (adjust != 0)
+      emit(R_ADJUST, 0, adjust, 0);
+    top = 0;
+    return adjust;
+  }
+
+  void binary(unsigned int op);
+};
+
+int register_form(unsigned int op) {
+  switch (op) {
+  case ADD:
+    return R_ADD_RR;
+  case SUB:
+    return R_SUB_RR;
+  case MUL:
+    return R_MUL_RR;
+  case CMP:
+    return R_CMP_RR;
+  case AND:
+    return R_AND_RR;
+  case OR:
+    return R_OR_RR;
+  case XOR:
+    return R_XOR_RR;
+  case SHL:
+    return R_SHL_RR;
+  default:
+    return R_SHR_RR;
+  }
+}
+
+// Folds operations whose result does not depend on undefined behaviour.
+bool fold(unsigned int op, long a, long b, long &result) {
+  unsigned long ua = a, ub = b;
+  switch (op) {
+  case ADD:
+    result = (long)(ua + ub);
+    return true;
+  case SUB:
+    result = (long)(ua - ub);
+    return true;
+  case MUL:
+    result = (long)(ua * ub);
+    return true;
+  case CMP:
+    result = a < b ? 1 : 0;
+    return true;
+  case AND:
+    result = a & b;
+    return true;
+  case OR:
+    result = a | b;
+    return true;
+  case XOR:
+    result = a ^ b;
+    return true;
+  default:
+    return false;
+  }
+}
+
+void BlockTranslator::binary(unsigned int op) {
+  Value b = pop();
+  Value a = pop();
+  long folded;
+  if (a.imm && b.imm && fold(op, a.v, b.v, folded)) {
+    push(Value{true, wrap_value(folded)});
+    return;
+  }
+  long home = top;
+  long ra = in_register(a, home);
+  emit(register_form(op) + (b.imm ? 1 : 0), home, ra, b.v);
+  push(Value{false, home});
+}
+
+void BlockTranslator::translate(const Program &program, unsigned long first,
+                                unsigned long last) {
+  stack.clear();
+  top = need = growth = 0;
+
+  unsigned long enter = out.code.size();
+  emit(program.is_break(first) ? R_BREAK : R_ENTER, out.blocks.size(), 0, 0);
+  out.blocks.push_back(RegBlock{first, last - first, program.at(first).pc});
+
+  bool ends_with_jump = false;
+  for (unsigned long i = first; i < last; ++i) {
+    const Instruction &ins = program.at(i);
+    Value v;
+    long home;
+    switch (ins.op) {
+    case NOP:
+      break;
+    case PUSH:
+      push(Value{true, wrap_value(ins.operand)});
+      break;
+    case POP:
+      pop();
+      break;
+    case DUP:
+      v = pop();
+      push(v);
+      push(v);
+      break;
+    case PEEKPRINT:
+      v = pop();
+      emit(v.imm ? R_PRINT_I : R_PRINT_R, 0, v.v, 0);
+      push(v);
+      break;
+    case DIV:
+      if (!stack.empty() && stack.back().imm && stack.back().v != 0) {
+        Value b = pop();
+        home = top - 1;
+        long ra = in_register(pop(), home);
+        emit(R_DIV_RI, home, ra, b.v);
+        push(Value{false, home});
+      } else {
+        // The divisor may be zero: divide on the real stack so the error
+        // leaves the stack exactly as the stack interpreter would.
+        flush();
+        emit(R_DIV, ins.pc, 0, 0);
+      }
+      break;
+    case ADD:
+    case SUB:
+    case MUL:
+    case CMP:
+    case AND:
+    case OR:
+    case XOR:
+    case SHL:
+    case SHR:
+      binary(ins.op);
+      break;
+    case NOT:
+      v = pop();
+      if (v.imm) {
+        push(Value{true, ~v.v});
+      } else {
+        home = top;
+        emit(R_NOT, home, v.v, 0);
+        push(Value{false, home});
+      }
+      break;
+    case STORE:
+      v = pop();
+      emit(v.imm ? R_STORE_I : R_STORE_R, ins.operand, v.v, 0);
+      break;
+    case LOAD:
+      home = top;
+      emit(R_LOADMEM, home, ins.operand, 0);
+      push(Value{false, home});
+      break;
+    case JZ:
+    case JNZ: {
+      v = pop();
+      long adjust = flush();
+      if (v.imm) {
+        if ((v.v == 0) == (ins.op == JZ)) {
+          emit(R_JMP, 0, 0, ins.operand);
+          ends_with_jump = true;
+        }
+      } else {
+        emit(ins.op == JZ ? R_JZ : R_JNZ, 0, v.v - adjust, ins.operand);
+      }
+      break;
+    }
+    case JMP:
+      flush();
+      emit(R_JMP, 0, 0, ins.operand);
+      ends_with_jump = true;
+      break;
+    case CALL:
+      flush();
+      emit(R_CALL, ins.pc, program.at(i + 1).pc, ins.operand);
+      ends_with_jump = true;
+      break;
+    case RET:
+      flush();
+      emit(R_RET, ins.pc, 0, 0);
+      ends_with_jump = true;
+      break;
+    case CONS:
+      flush();
+      emit(R_CONS, ins.pc, 0, 0);
+      break;
+    case HALT:
+      flush();
+      emit(R_HALT, 0, program.at(i + 1).pc, 0);
+      ends_with_jump = true;
+      break;
+    case OP_END:
+      emit(R_END, ins.pc, 0, 0);
+      ends_with_jump = true;
+      break;
+    }
+  }
+  if (!ends_with_jump)
+    flush(); // Falls through into the next block
+
+  // No depth satisfies a break's header, so entering its block always
+  // dispatches to R_BREAK.
+  out.code[enter].a = program.is_break(first) ? LONG_MAX : need;
+  out.code[enter].b = growth;
+}
+
+bool ends_block(unsigned int op) {
+  switch (op) {
+  case JMP:
+  case JZ:
+  case JNZ:
+  case CALL:
+  case RET:
+  case CONS:
+  case HALT:
+  case OP_END:
+    return true;
+  default:
+    return false;
+  }
+}
+
+} // namespace
+
+RegisterCode::RegisterCode() : linked(nullptr) {}
+
+void RegisterCode::clear() {
+  code.clear();
+  blocks.clear();
+  entry.clear();
+  linked = nullptr;
+}
+
+void RegisterCode::translate(const Program &program) {
+  clear();
+  unsigned long n = program.size();
+
+  // Block leaders: the entry point, branch targets, breaks and anything
+  // following an instruction that transfers control (including CALL return
+  // addresses).
+  std::vector<bool> leader(n, false);
+  leader[0] = true;
+  for (unsigned long i = 0; i < n; ++i) {
+    const Instruction &ins = program.at(i);
+    if (is_branch(ins.op))
+      leader[ins.operand] = true;
+    if (ends_block(ins.op) && i + 1 < n)
+      leader[i + 1] = true;
+    if (program.is_break(i))
+      leader[i] = true;
+  }
+  // A DIV also ends its block unless it divides by a constant pushed in the
+  // same block, in which case it cannot fail and stays in registers.
+  for (unsigned long i = 0; i + 1 < n; ++i) {
+    if (program.at(i).op != DIV)
+      continue;
+    bool constant = i > 0 && !leader[i] && program.at(i - 1).op == PUSH &&
+                    program.at(i - 1).operand != 0;
+    if (!constant)
+      leader[i + 1] = true;
+  }
+
+  entry.assign(n, -1);
+  BlockTranslator translator(*this);
+  unsigned long first = 0;
+  for (unsigned long i = 1; i <= n; ++i) {
+    if (i == n || leader[i]) {
+      entry[first] = code.size();
+      translator.translate(program, first, i);
+      first = i;
+    }
+  }
+
+  // Branch operands were instruction indices; point them at block headers.
+  for (RegInstruction &ins : code) {
+    if (ins.op == R_JMP || ins.op == R_JZ || ins.op == R_JNZ ||
+        ins.op == R_CALL)
+      ins.b = entry[ins.b];
+  }
+}
+
+// --- Execution ---
+
+static inline bool pending_request(const bool &flag) {
+  return *(volatile const bool *)&flag;
+}
+
+// Executes one instruction with VM::step. Returns true if it was HALT.
+static bool step_once(VM &vm) {
+  try {
+    vm.step();
+  } catch (const std::runtime_error &e) {
+    if (std::string(e.what()) == "HALT")
+      return true;
+    throw;
+  }
+  return false;
+}
+
+bool VM::run_register() {
+  static const void *table[R_OPCODE_COUNT];
+  static bool table_ready = false;
+  if (!table_ready) {
+    table[R_ENTER] = &&r_enter;
+    table[R_BREAK] = &&r_break;
+    table[R_MOVI] = &&r_movi;
+    table[R_MOV] = &&r_mov;
+    table[R_LOADMEM] = &&r_loadmem;
+    table[R_STORE_R] = &&r_store_r;
+    table[R_STORE_I] = &&r_store_i;
+    table[R_PRINT_R] = &&r_print_r;
+    table[R_PRINT_I] = &&r_print_i;
+    table[R_ADD_RR] = &&r_add_rr;
+    table[R_ADD_RI] = &&r_add_ri;
+    table[R_SUB_RR] = &&r_sub_rr;
+    table[R_SUB_RI] = &&r_sub_ri;
+    table[R_MUL_RR] = &&r_mul_rr;
+    table[R_MUL_RI] = &&r_mul_ri;
+    table[R_DIV_RI] = &&r_div_ri;
+    table[R_DIV] = &&r_div;
+    table[R_CMP_RR] = &&r_cmp_rr;
+    table[R_CMP_RI] = &&r_cmp_ri;
+    table[R_AND_RR] = &&r_and_rr;
+    table[R_AND_RI] = &&r_and_ri;
+    table[R_OR_RR] = &&r_or_rr;
+    table[R_OR_RI] = &&r_or_ri;
+    table[R_XOR_RR] = &&r_xor_rr;
+    table[R_XOR_RI] = &&r_xor_ri;
+    table[R_SHL_RR] = &&r_shl_rr;
+    table[R_SHL_RI] = &&r_shl_ri;
+    table[R_SHR_RR] = &&r_shr_rr;
+    table[R_SHR_RI] = &&r_shr_ri;
+    table[R_NOT] = &&r_not;
+    table[R_ADJUST] = &&r_adjust;
+    table[R_JMP] = &&r_jmp;
+    table[R_JZ] = &&r_jz;
+    table[R_JNZ] = &&r_jnz;
+    table[R_CALL] = &&r_call;
+    table[R_RET] = &&r_ret;
+    table[R_CONS] = &&r_cons;
+    table[R_HALT] = &&r_halt;
+    table[R_END] = &&r_end;
+    table_ready = true;
+  }
+
+  if (register_code.empty())
+    register_code.translate(program);
+  if (register_code.linked != table) {
+    for (RegInstruction &ins : register_code.code)
+      ins.handler = table[ins.op];
+    register_code.linked = table;
+  }
+
+  // Resuming in the middle of a block (e.g. after single-stepping in the
+  // debugger): finish it with the stack interpreter first.
+  while (register_code.block_entry(program.index_of(pc)) < 0) {
+    if (step_once(*this))
+      return true;
+  }
+
+  const RegInstruction *const code = register_code.code.data();
+  const RegBlock *const blocks = register_code.blocks.data();
+  const long *const entry = register_code.entry.data();
+  const long *const index_of = program.index_table();
+  long *const data = data_memory.base();
+
+  StackItem *const stack_base = register_stack.base();
+  const long stack_slots = register_stack.capacity();
+  StackItem *sp = stack_base + register_stack.get_size();
+  StackItem *const calls_base = call_stack.base();
+  StackItem *csp = calls_base + call_stack.get_size();
+
+  const RegInstruction *ri =
+      code + register_code.block_entry(program.index_of(pc));
+  const char *error = nullptr;
+  bool halted = false;
+
+#define NEXT()                                                                 \
+  do {                                                                         \
+    ++ri;                                                                      \
+    goto *ri->handler;                                                         \
+  } while (0)
+#define FAIL(msg)                                                              \
+  do {                                                                         \
+    error = msg;                                                               \
+    pc = ri->d;                                                                \
+    goto leave;                                                                \
+  } while (0)
+#define SET_INT(slot, v) (slot).bits = StackItem::tag(v)
+// Enters the block whose R_ENTER is at `header`, doing the entry check here
+// rather than dispatching to the header unless it fails.
+#define ENTER_BLOCK(header)                                                    \
+  do {                                                                         \
+    ri = (header);                                                             \
+    long depth = sp - stack_base;                                              \
+    if (depth < ri->a || depth + ri->b > stack_slots)                          \
+      goto *ri->handler;                                                       \
+    ++ri;                                                                      \
+    goto *ri->handler;                                                         \
+  } while (0)
+#define GOTO_BLOCK(target)                                                     \
+  do {                                                                         \
+    if (pending_request(debug_mode) || pending_request(stats_requested) ||     \
+        pending_request(sample_requested)) {                                   \
+      pc = blocks[code[target].d].pc;                                          \
+      goto leave;                                                              \
+    }                                                                          \
+    ENTER_BLOCK(code + (target));                                              \
+  } while (0)
+#define BINARY(name, expr)                                                     \
+  r_##name##_rr : {                                                            \
+    long a = sp[ri->a].value(), b = sp[ri->b].value();                         \
+    SET_INT(sp[ri->d], expr);                                                  \
+    NEXT();                                                                    \
+  }                                                                            \
+  r_##name##_ri : {                                                            \
+    long a = sp[ri->a].value(), b = ri->b;                                     \
+    SET_INT(sp[ri->d], expr);                                                  \
+    NEXT();                                                                    \
+  }
+
+// Like BINARY, with `a` and `b` the tagged words and `expr` tagged.
+#define TAGGED(name, expr)                                                     \
+  r_##name##_rr : {                                                            \
+    long a = sp[ri->a].bits, b = sp[ri->b].bits;                               \
+    sp[ri->d].bits = (expr);                                                   \
+    NEXT();                                                                    \
+  }                                                                            \
+  r_##name##_ri : {                                                            \
+    long a = sp[ri->a].bits, b = StackItem::tag(ri->b);                        \
+    sp[ri->d].bits = (expr);                                                   \
+    NEXT();                                                                    \
+  }
+
+  goto *ri->handler;
+
+r_break:
+  pc = blocks[ri->d].pc;
+  goto leave;
+r_enter : {
+  long block = ri->d;
+  long depth = sp - stack_base;
+  if (depth >= ri->a && depth + ri->b <= stack_slots)
+    NEXT();
+  // The block would underflow or overflow the stack somewhere. Run it with
+  // the stack interpreter, which reports the error at the right instruction.
+  register_stack.set_size(depth);
+  call_stack.set_size(csp - calls_base);
+  pc = blocks[block].pc;
+  for (unsigned long i = 0; i < blocks[block].count; ++i) {
+    if (step_once(*this))
+      return true;
+  }
+  sp = stack_base + register_stack.get_size();
+  csp = calls_base + call_stack.get_size();
+  ri = code + register_code.block_entry(program.index_of(pc));
+  goto *ri->handler;
+}
+r_movi:
+  SET_INT(sp[ri->d], ri->a);
+  NEXT();
+r_mov:
+  sp[ri->d] = sp[ri->a];
+  NEXT();
+r_loadmem:
+  SET_INT(sp[ri->d], data[ri->a]);
+  NEXT();
+r_store_r:
+  data[ri->d] = sp[ri->a].value();
+  NEXT();
+r_store_i:
+  data[ri->d] = ri->a;
+  NEXT();
+r_print_r:
+  std::cout << sp[ri->a].value() << std::endl;
+  NEXT();
+r_print_i:
+  std::cout << ri->a << std::endl;
+  NEXT();
+
+  TAGGED(add, tagged_add(a, b))
+  TAGGED(sub, tagged_sub(a, b))
+  TAGGED(mul, tagged_mul(a, b))
+  BINARY(cmp, a < b ? 1 : 0)
+  TAGGED(and, tagged_and(a, b))
+  TAGGED(or, tagged_or(a, b))
+  TAGGED(xor, tagged_xor(a, b))
+  BINARY(shl, a << b)
+  BINARY(shr, a >> b)
+
+r_div_ri:
+  SET_INT(sp[ri->d], sp[ri->a].value() / ri->b);
+  NEXT();
+r_div:
+  if (sp - stack_base < 2)
+    FAIL("Stack Underflow");
+  if (sp[-1].value() == 0)
+    FAIL("VM Runtime Error: Division by zero.");
+  --sp;
+  SET_INT(sp[-1], sp[-1].value() / sp[0].value());
+  NEXT();
+r_not:
+  SET_INT(sp[ri->d], ~sp[ri->a].value());
+  NEXT();
+r_adjust:
+  sp += ri->a;
+  NEXT();
+r_jmp:
+  GOTO_BLOCK(ri->b);
+r_jz:
+  if (sp[ri->a].value() == 0)
+    GOTO_BLOCK(ri->b);
+  ENTER_BLOCK(ri + 1);
+r_jnz:
+  if (sp[ri->a].value() != 0)
+    GOTO_BLOCK(ri->b);
+  ENTER_BLOCK(ri + 1);
+r_call:
+  // Overflow runs into the call stack's guard page (see engine.cpp).
+  SET_INT(*csp, ri->a);
+  ++csp;
+  GOTO_BLOCK(ri->b);
+r_ret:
+  if (csp == calls_base)
+    FAIL("Stack Underflow");
+  --csp;
+  // Return addresses are only pushed by CALL and always start a block.
+  GOTO_BLOCK(entry[index_of[csp->value()]]);
+r_cons : {
+  if (sp - stack_base < 2)
+    FAIL("Stack Underflow");
+  register_stack.set_size(sp - stack_base); // The roots, if it collects
+  Object *obj = cons();
+  --sp;
+  sp[-1].bits = StackItem::tag((long)obj, true);
+  NEXT();
+}
+r_halt:
+  halted = true;
+  pc = ri->a;
+  goto leave;
+r_end:
+  FAIL("VM Runtime Error: Program Counter out of bounds.");
+
+#undef NEXT
+#undef FAIL
+#undef SET_INT
+#undef ENTER_BLOCK
+#undef GOTO_BLOCK
+#undef BINARY
+#undef TAGGED
+
+leave:
+  register_stack.set_size(sp - stack_base);
+  call_stack.set_size(csp - calls_base);
+  if (error)
+    throw std::runtime_error(error);
+  return halted;
+}
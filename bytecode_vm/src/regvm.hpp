@@ -0,0 +1,100 @@
+#ifndef REGVM_HPP
+#define REGVM_HPP
+
+#include "program.hpp"
+#include <vector>
+
+// Register tier.
+//
+// Each basic block of the stack bytecode is translated into three-address
+// code. The register file is the frame itself: register n is the stack slot
+// at offset n from the stack pointer the block was entered with (negative
+// offsets are values the block inherits). Every value is computed straight
+// into the slot the stack interpreter would have left it in, constants and
+// DUPs are propagated instead of being pushed, and the stack pointer only
+// moves once, at the end of the block. Calls, returns and branches always end
+// a block, so no register lives across blocks.
+
+enum RegOpcode {
+  R_ENTER,    // Block header: d = block number, a = depth needed, b = growth
+  R_BREAK,    // Header of a block starting at a break, a = LONG_MAX: leaves
+  R_MOVI,     // r[d] = a
+  R_MOV,      // r[d] = r[a]
+  R_LOADMEM,  // r[d] = mem[a]
+  R_STORE_R,  // mem[d] = r[a]
+  R_STORE_I,  // mem[d] = a
+  R_PRINT_R,  // print r[a]
+  R_PRINT_I,  // print a
+  R_ADD_RR,   // r[d] = r[a] + r[b]; the _RI forms take b as an immediate
+  R_ADD_RI,
+  R_SUB_RR,
+  R_SUB_RI,
+  R_MUL_RR,
+  R_MUL_RI,
+  R_DIV_RI,   // Only emitted for a known non-zero divisor
+  R_DIV,      // DIV on the real stack
+  R_CMP_RR,
+  R_CMP_RI,
+  R_AND_RR,
+  R_AND_RI,
+  R_OR_RR,
+  R_OR_RI,
+  R_XOR_RR,
+  R_XOR_RI,
+  R_SHL_RR,
+  R_SHL_RI,
+  R_SHR_RR,
+  R_SHR_RI,
+  R_NOT,      // r[d] = ~r[a]
+  R_ADJUST,   // sp += a
+  R_JMP,      // goto b
+  R_JZ,       // if (r[a] == 0) goto b
+  R_JNZ,      // if (r[a] != 0) goto b
+  R_CALL,     // push return address a, goto b
+  R_RET,
+  R_CONS,     // CONS on the real stack
+  R_HALT,     // a = address after the HALT
+  R_END,      // Program counter ran off the end
+
+  // R_DIV, R_CALL, R_RET, R_CONS and R_END can fail; their d is the address
+  // of the stack instruction they came from, for error reporting.
+
+  R_OPCODE_COUNT
+};
+
+struct RegInstruction {
+  const void *handler;
+  long a;
+  long b; // Register, immediate or index of the target block's R_ENTER
+  int d;
+  unsigned short op;
+};
+
+struct RegBlock {
+  unsigned long first; // Index of the first stack instruction
+  unsigned long count; // Number of stack instructions
+  unsigned int pc;     // Address of the first instruction
+};
+
+class RegisterCode {
+public:
+  RegisterCode();
+
+  void translate(const Program &program);
+  void clear();
+  bool empty() const { return code.empty(); }
+
+  // Index of the R_ENTER for the block starting at an instruction index, or
+  // -1 if no block starts there.
+  long block_entry(long index) const {
+    return index >= 0 && (unsigned long)index < entry.size() ? entry[index]
+                                                              : -1;
+  }
+
+  std::vector<RegInstruction> code;
+  std::vector<RegBlock> blocks;
+  std::vector<long> entry;
+  const void *const *linked;
+};
+
+#endif // REGVM_HPP
@@ -0,0 +1,183 @@
+#include "sampler.hpp"
+#include "op_codes.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <string>
+
+// Words in the ring, enough for about 1,000 samples of full depth before it
+// has to be drained.
+static const unsigned long RING_WORDS = 1UL << 16;
+// Ends a sample whose call stack was deeper than MAX_DEPTH.
+static const unsigned long TRUNCATED = ~0UL;
+// Rows in each table of the text report.
+static const unsigned long REPORT_ROWS = 20;
+
+Sampler::Sampler() : ring(RING_WORDS), used(0), taken(0) {}
+
+void Sampler::reset() {
+  used = 0;
+  taken = 0;
+  stacks.clear();
+}
+
+void Sampler::take(unsigned long pc, const Stack &calls) {
+  unsigned long depth = calls.get_size();
+  unsigned long kept = std::min(depth, MAX_DEPTH);
+  unsigned long words = 2 + kept + (depth > kept);
+  if (used + words > ring.size())
+    drain();
+  unsigned long *at = ring.data() + used;
+  *at++ = words - 1;
+  *at++ = pc;
+  for (unsigned long i = 0; i < kept; ++i)
+    *at++ = calls.get_item(depth - 1 - i).value();
+  if (depth > kept)
+    *at++ = TRUNCATED;
+  used += words;
+  ++taken;
+}
+
+void Sampler::drain() {
+  for (unsigned long at = 0; at < used; at += ring[at] + 1) {
+    const unsigned long *sample = ring.data() + at + 1;
+    ++stacks[std::vector<unsigned long>(sample, sample + ring[at])];
+  }
+  used = 0;
+}
+
+// Code labels by address; the first name in order if several share one.
+static std::map<unsigned long, std::string> label_names(DebugInfo &debug) {
+  std::map<unsigned long, std::string> names;
+  for (const auto &label : debug.labels())
+    names.emplace(label.second, label.first);
+  return names;
+}
+
+// "<label>+<offset>" for the nearest label at or before `pc`, or "pc_<pc>".
+static std::string location(const std::map<unsigned long, std::string> &names,
+                            unsigned long pc) {
+  auto after = names.upper_bound(pc);
+  if (after == names.begin())
+    return "pc_" + std::to_string(pc);
+  --after;
+  if (after->first == pc)
+    return after->second;
+  return after->second + "+" + std::to_string(pc - after->first);
+}
+
+// The function a frame is running, named after the target of the CALL that
+// pushed its return address. Every CALL is two words, so that is the
+// instruction two words before the return address.
+static std::string callee(const Program &program,
+                          const std::map<unsigned long, std::string> &names,
+                          unsigned long ret) {
+  long index = ret >= 2 ? program.index_of(ret - 2) : -1;
+  if (index < 0 || program.at(index).op != CALL)
+    return "pc_" + std::to_string(ret);
+  unsigned long entry = program.at(program.at(index).operand).pc;
+  auto name = names.find(entry);
+  return name != names.end() ? name->second : "pc_" + std::to_string(entry);
+}
+
+// The frames of a sample, outermost first.
+static std::vector<std::string>
+frames(const Program &program,
+       const std::map<unsigned long, std::string> &names,
+       const std::vector<unsigned long> &sample) {
+  std::vector<std::string> result;
+  unsigned long last = sample.size();
+  if (sample.back() == TRUNCATED) {
+    result.push_back("...");
+    --last;
+  } else {
+    result.push_back("(main)");
+  }
+  for (unsigned long i = last; i-- > 1;)
+    result.push_back(callee(program, names, sample[i]));
+  return result;
+}
+
+static double percent(unsigned long part, unsigned long whole) {
+  return whole ? 100.0 * part / whole : 0;
+}
+
+void Sampler::report(const Program &program, DebugInfo &debug,
+                     std::ostream &out) {
+  drain();
+  auto names = label_names(debug);
+
+  out << "--- Samples ---" << std::endl;
+  out << "Samples: " << taken << std::endl;
+
+  // Addresses, by samples
+  std::map<unsigned long, unsigned long> pcs;
+  // Functions: samples in which each is running, and in which it is anywhere
+  // on the stack.
+  std::map<std::string, std::pair<unsigned long, unsigned long>> functions;
+  for (const auto &stack : stacks) {
+    pcs[stack.first[0]] += stack.second;
+    std::vector<std::string> chain = frames(program, names, stack.first);
+    functions[chain.back()].first += stack.second;
+    std::sort(chain.begin(), chain.end());
+    chain.erase(std::unique(chain.begin(), chain.end()), chain.end());
+    for (const std::string &f : chain)
+      functions[f].second += stack.second;
+  }
+
+  std::vector<std::pair<unsigned long, unsigned long>> hot(pcs.begin(),
+                                                           pcs.end());
+  std::sort(hot.begin(), hot.end(), [](const auto &a, const auto &b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+  if (hot.size() > REPORT_ROWS)
+    hot.resize(REPORT_ROWS);
+  out << std::endl
+      << std::setw(8) << "pc" << std::setw(8) << "line" << "  " << std::left
+      << std::setw(24) << "location" << std::right << std::setw(10)
+      << "samples" << std::setw(8) << "%" << std::endl;
+  for (const auto &p : hot) {
+    unsigned long line = debug.line_of(p.first);
+    out << std::setw(8) << p.first << std::setw(8)
+        << (line ? std::to_string(line) : "-") << "  " << std::left
+        << std::setw(24) << location(names, p.first) << std::right
+        << std::setw(10) << p.second << std::setw(8) << std::fixed
+        << std::setprecision(1) << percent(p.second, taken) << std::endl;
+  }
+
+  std::vector<std::pair<std::string, std::pair<unsigned long, unsigned long>>>
+      by_total(functions.begin(), functions.end());
+  std::sort(by_total.begin(), by_total.end(),
+            [](const auto &a, const auto &b) {
+              return a.second.second > b.second.second;
+            });
+  if (by_total.size() > REPORT_ROWS)
+    by_total.resize(REPORT_ROWS);
+  out << std::endl
+      << std::left << std::setw(24) << "function" << std::right
+      << std::setw(10) << "self" << std::setw(8) << "%" << std::setw(10)
+      << "total" << std::setw(8) << "%" << std::endl;
+  for (const auto &f : by_total) {
+    out << std::left << std::setw(24) << f.first << std::right
+        << std::setw(10) << f.second.first << std::setw(8)
+        << percent(f.second.first, taken) << std::setw(10)
+        << f.second.second << std::setw(8) << percent(f.second.second, taken)
+        << std::endl;
+  }
+  out << std::defaultfloat;
+}
+
+void Sampler::write_collapsed(const Program &program, DebugInfo &debug,
+                              std::ostream &out) {
+  drain();
+  auto names = label_names(debug);
+  // Stacks that differ only in their pcs collapse to the same line.
+  std::map<std::string, unsigned long> lines;
+  for (const auto &stack : stacks) {
+    std::string line;
+    for (const std::string &f : frames(program, names, stack.first))
+      line += (line.empty() ? "" : ";") + f;
+    lines[line] += stack.second;
+  }
+  for (const auto &line : lines)
+    out << line.first << " " << line.second << "\n";
+}
@@ -0,0 +1,60 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include "container.hpp"
+#include "program.hpp"
+#include "stack.hpp"
+#include <map>
+#include <ostream>
+#include <vector>
+
+// Statistical profile collected by `bvm --sample`.
+//
+// A SIGPROF interval timer (see main.cpp) sets VM::sample_requested. The
+// fast engines and compiled code stop for it where they already poll for the
+// debugger, on taken jumps, calls and returns, and VM::interpret records a
+// sample with take() before resuming them. The pc and stacks they write
+// back there are exact, which they are not inside the signal handler. The
+// price is that samples only land on the targets of control transfers, so
+// straight-line code is charged to the branch target it started at.
+//
+// take() copies the pc and the innermost MAX_DEPTH return addresses into a
+// ring preallocated when the sampler is reset, and runs no allocator. Full
+// rings are folded into per-stack counts, by the same thread at the same
+// safepoint, so no locking is needed.
+class Sampler {
+public:
+  // Return addresses kept per sample; deeper stacks are truncated.
+  static const unsigned long MAX_DEPTH = 64;
+
+  Sampler();
+
+  // Clears the samples.
+  void reset();
+  // Records a sample at `pc` with return addresses `calls`.
+  void take(unsigned long pc, const Stack &calls);
+  unsigned long samples() const { return taken; }
+
+  // The addresses and functions that were sampled most, with their labels
+  // and source lines if the program has them.
+  void report(const Program &program, DebugInfo &debug,
+              std::ostream &out);
+  // One "<caller>;...;<callee> <samples>" line per sampled call stack, the
+  // input format of flame graph tools.
+  void write_collapsed(const Program &program, DebugInfo &debug,
+                       std::ostream &out);
+
+private:
+  // Moves the samples in the ring into `stacks`.
+  void drain();
+
+  // Samples as: length, pc, return addresses from the innermost out, then
+  // TRUNCATED if there were more.
+  std::vector<unsigned long> ring;
+  unsigned long used;
+  unsigned long taken;
+  // Sample count per stack (pc first)
+  std::map<std::vector<unsigned long>, unsigned long> stacks;
+};
+
+#endif // SAMPLER_HPP
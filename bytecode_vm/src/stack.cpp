@@ -1,20 +1,26 @@
 #include "stack.hpp"
 #include <stdexcept>
 
-Stack::Stack() : ind(0) {}
+Stack::Stack(unsigned long capacity) { resize(capacity); }
+
+void Stack::resize(unsigned long capacity) {
+  pages.reserve(capacity * sizeof(StackItem));
+  mem = (StackItem *)pages.data();
+  slots = capacity;
+  ind = 0;
+}
 
 void Stack::push(long val, bool is_obj) {
   if (is_full())
     throw std::runtime_error("Stack Overflow");
-  mem[ind].value = val;
-  mem[ind].is_obj = is_obj;
+  mem[ind].bits = StackItem::tag(val, is_obj);
   ind++;
 }
 
 long Stack::pop() {
   if (is_empty())
     throw std::runtime_error("Stack Underflow");
-  return mem[--ind].value;
+  return mem[--ind].value();
 }
 
 StackItem Stack::pop_item() {
@@ -26,7 +32,7 @@ StackItem Stack::pop_item() {
 long Stack::peek() {
   if (is_empty())
     throw std::runtime_error("Stack Underflow");
-  return mem[ind - 1].value;
+  return mem[ind - 1].value();
 }
 
 StackItem Stack::peek_item() {
@@ -35,21 +41,23 @@ StackItem Stack::peek_item() {
   return mem[ind - 1];
 }
 
-bool Stack::is_full() { return ind == STACK_SIZE; }
+bool Stack::is_full() { return ind == slots; }
 
 bool Stack::is_empty() { return ind == 0; }
 
 void Stack::dup() {
   if (is_empty())
     throw std::runtime_error("Stack Underflow: Cannot duplicate from an empty stack.");
-  StackItem item = mem[ind - 1];
-  push(item.value, item.is_obj);
+  if (is_full())
+    throw std::runtime_error("Stack Overflow");
+  mem[ind] = mem[ind - 1];
+  ind++;
 }
 
 std::vector<long> Stack::getElements() const {
     std::vector<long> elements;
     for (unsigned long i = 0; i < ind; ++i) {
-        elements.push_back(mem[i].value);
+        elements.push_back(mem[i].value());
     }
     return elements;
 }
\ No newline at end of file
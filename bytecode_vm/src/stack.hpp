@@ -1,19 +1,58 @@
 #ifndef STACK_H
 #define STACK_H
 
+#include "region.hpp"
 #include <vector>
 
-#define STACK_SIZE 1024 * 10
+// Default capacity, in slots. Stack pages are only committed when used.
+#define STACK_SIZE (1024 * 1024)
+// Largest capacity bvm accepts (a 32 GiB reservation).
+#define MAX_STACK_SIZE (1UL << 32)
 
+// A stack slot: a value and whether it is an object, in one word. The value
+// is stored shifted left by one with the object tag in the low bit, so slots
+// hold 63-bit values: integers wrap at 63 bits, and object addresses (user
+// space addresses need 48) fit unchanged.
 struct StackItem {
-  long value;
-  bool is_obj;
+  long bits;
+
+  long value() const { return bits >> 1; }
+  bool is_obj() const { return bits & 1; }
+
+  static long tag(long value, bool is_obj = false) {
+    return (long)((unsigned long)value << 1) | (is_obj ? 1 : 0);
+  }
 };
 
+static_assert(sizeof(StackItem) == sizeof(long), "StackItem is one word");
+
+// `v` wrapped to the range of a stack slot.
+inline long wrap_value(long v) { return StackItem::tag(v) >> 1; }
+
+// Arithmetic on the words of two slots, giving the tagged result of the
+// operation on their values without untagging both operands. Clearing a tag
+// bit leaves twice the value, which these operations carry through.
+inline long tagged_add(long a, long b) {
+  return (long)((unsigned long)(a & ~1L) + (unsigned long)(b & ~1L));
+}
+inline long tagged_sub(long a, long b) {
+  return (long)((unsigned long)(a & ~1L) - (unsigned long)(b & ~1L));
+}
+inline long tagged_mul(long a, long b) {
+  return (long)((unsigned long)(a >> 1) * (unsigned long)(b & ~1L));
+}
+inline long tagged_and(long a, long b) { return a & b & ~1L; }
+inline long tagged_or(long a, long b) { return (a | b) & ~1L; }
+inline long tagged_xor(long a, long b) { return (a ^ b) & ~1L; }
+
+// A stack of StackItems in a Region (see region.hpp), so the slot after the
+// last one is a guard page.
 class Stack {
 public:
-  Stack();
+  explicit Stack(unsigned long capacity = STACK_SIZE);
   ~Stack() = default;
+  // Replaces the stack with an empty one of `capacity` slots.
+  void resize(unsigned long capacity);
   void push(long val, bool is_obj = false);
   long pop();
   StackItem pop_item();
@@ -27,9 +66,17 @@ public:
   // For GC access
   unsigned long get_size() const { return ind; }
   const StackItem &get_item(unsigned long i) const { return mem[i]; }
+  unsigned long capacity() const { return slots; }
+
+  // For the threaded engine, which keeps the stack pointer in a local
+  StackItem *base() { return mem; }
+  void set_size(unsigned long n) { ind = n; }
+  const Region &region() const { return pages; }
 
 private:
-  StackItem mem[STACK_SIZE];
+  Region pages;
+  StackItem *mem;
+  unsigned long slots;
   unsigned long ind = 0;
 };
 
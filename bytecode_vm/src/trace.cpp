@@ -0,0 +1,101 @@
+#include "trace.hpp"
+#include "region.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static unsigned long file_size(unsigned long capacity) {
+  return sizeof(TraceHeader) + capacity * sizeof(TraceRecord);
+}
+
+Tracer::~Tracer() { close(); }
+
+void Tracer::open(const std::string &path, unsigned long capacity) {
+  close();
+  if (capacity == 0 ||
+      capacity > (~0UL - sizeof(TraceHeader)) / sizeof(TraceRecord))
+    throw std::runtime_error("Trace Error: Invalid ring size.");
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw std::runtime_error("Trace Error: Could not create " + path + ".");
+  void *p = MAP_FAILED;
+  if (ftruncate(fd, file_size(capacity)) == 0)
+    p = mmap(nullptr, file_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED,
+             fd, 0);
+  if (p == MAP_FAILED) {
+    ::close(fd);
+    fd = -1;
+    throw std::runtime_error("Trace Error: Could not map " + path + ".");
+  }
+  header = (TraceHeader *)p;
+  memcpy(header->magic, TRACE_MAGIC, 4);
+  header->version = TRACE_VERSION;
+  header->record_size = sizeof(TraceRecord);
+  header->reserved = 0;
+  header->capacity = capacity;
+  header->count = 0;
+  ring = (TraceRecord *)(header + 1);
+  this->capacity = capacity;
+  next = 0;
+  written = 0;
+}
+
+void Tracer::close() {
+  if (!ring)
+    return;
+  unsigned long count = header->count = written;
+  munmap(header, file_size(capacity));
+  if (count < capacity && ftruncate(fd, file_size(count)) != 0) {
+    // Readers ignore the unused records, so the file is still valid.
+  }
+  ::close(fd);
+  fd = -1;
+  header = nullptr;
+  ring = nullptr;
+}
+
+static void damaged(const std::string &path) {
+  throw std::runtime_error("Trace Error: " + path +
+                           " is not a trace or is damaged.");
+}
+
+Trace read_trace(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Trace Error: Could not open " + path + ".");
+  struct stat st;
+  Region file;
+  try {
+    if (fstat(fd, &st) != 0 || (unsigned long)st.st_size < sizeof(TraceHeader))
+      damaged(path);
+    file.map_file(fd, st.st_size);
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+
+  const TraceHeader *header = (const TraceHeader *)file.data();
+  if (memcmp(header->magic, TRACE_MAGIC, 4) != 0 ||
+      header->version != TRACE_VERSION ||
+      header->record_size != sizeof(TraceRecord) || header->capacity == 0)
+    damaged(path);
+  unsigned long kept =
+      header->count < header->capacity ? header->count : header->capacity;
+  if ((file.size() - sizeof(TraceHeader)) / sizeof(TraceRecord) < kept)
+    damaged(path);
+
+  // Once the ring has wrapped, the oldest record is the next to be written.
+  const TraceRecord *ring = (const TraceRecord *)(header + 1);
+  unsigned long oldest =
+      header->count > header->capacity ? header->count % header->capacity : 0;
+  Trace trace;
+  trace.count = header->count;
+  trace.records.reserve(kept);
+  trace.records.insert(trace.records.end(), ring + oldest, ring + kept);
+  trace.records.insert(trace.records.end(), ring, ring + oldest);
+  return trace;
+}
@@ -0,0 +1,109 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "op_codes.hpp"
+#include "program.hpp"
+#include <string>
+#include <vector>
+
+// Binary execution traces written by `bvm --trace=<file>` and read by
+// `bvm-trace`.
+//
+// A trace file is a TraceHeader followed by `capacity` TraceRecords, one per
+// instruction executed, in the byte order of the machine that wrote it. The
+// records are a ring: once `count` passes `capacity`, each record overwrites
+// the oldest, so the file keeps the last `capacity` instructions of a run.
+// The file is mapped shared, so records reach it even if bvm is killed, but
+// `count` is only brought up to date each time the ring wraps and when the
+// trace is closed: updating it with every record would cost more than
+// writing the record. A run that does not fill the ring truncates the file
+// to its records.
+
+#define TRACE_MAGIC "BVMT"
+#define TRACE_VERSION 1
+// Default ring size for --trace, in records (32 MiB).
+#define TRACE_DEFAULT_RECORDS (1UL << 20)
+// Largest ring --trace-size accepts (32 GiB).
+#define TRACE_MAX_RECORDS (1UL << 30)
+
+struct TraceHeader {
+  char magic[4];
+  unsigned short version;
+  unsigned short record_size; // sizeof(TraceRecord)
+  unsigned int reserved;
+  unsigned long capacity; // Records in the ring
+  unsigned long count;    // Records ever written
+};
+
+// The state just before an instruction ran.
+struct TraceRecord {
+  unsigned int pc;      // Address of the instruction
+  unsigned short op;    // Opcode
+  unsigned short reserved;
+  long operand;         // As written in the image, 0 if it has none
+  unsigned long depth;  // Register stack slots
+  long top;             // Top slot as stored (see StackItem), 0 if empty
+};
+
+static_assert(sizeof(TraceHeader) == 32 && sizeof(TraceRecord) == 32,
+              "Trace layouts are fixed");
+
+// The operand of `ins` as written: jump and CALL targets are decoded to
+// instruction indices (see program.hpp), which are mapped back.
+inline long written_operand(const Instruction *code, const Instruction &ins) {
+  if (ins.op == JMP || ins.op == JZ || ins.op == JNZ || ins.op == CALL)
+    return code[ins.operand].pc;
+  return ins.operand;
+}
+
+// Appends records to a trace file.
+class Tracer {
+public:
+  Tracer() = default;
+  ~Tracer();
+  Tracer(const Tracer &) = delete;
+  Tracer &operator=(const Tracer &) = delete;
+
+  // Creates `path` with a ring of `capacity` records. Throws
+  // std::runtime_error if it cannot be created or mapped.
+  void open(const std::string &path, unsigned long capacity);
+  // Finishes the file, truncating it if the ring never filled.
+  void close();
+  bool active() const { return ring != nullptr; }
+
+  void record(const Instruction *code, const Instruction &ins,
+              unsigned long depth, long top) {
+    TraceRecord &r = ring[next];
+    r.pc = ins.pc;
+    r.op = ins.op;
+    r.reserved = 0;
+    r.operand = written_operand(code, ins);
+    r.depth = depth;
+    r.top = top;
+    ++written;
+    if (++next == capacity) {
+      next = 0;
+      header->count = written;
+    }
+  }
+
+private:
+  int fd = -1;
+  TraceHeader *header = nullptr;
+  TraceRecord *ring = nullptr;
+  unsigned long capacity = 0;
+  unsigned long next = 0;
+  unsigned long written = 0; // Published to the header on wrapping and close
+};
+
+// A trace read back from a file, oldest record first.
+struct Trace {
+  unsigned long count; // Records written by the run
+  std::vector<TraceRecord> records; // The last ones, up to the ring's size
+};
+
+// Reads the trace in `path`. Throws std::runtime_error if it is not a
+// trace or is damaged.
+Trace read_trace(const std::string &path);
+
+#endif // TRACE_HPP
@@ -0,0 +1,180 @@
+#include "op_codes.hpp"
+#include "stack.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+
+// Rows in each table of the summary.
+static const unsigned long SUMMARY_ROWS = 20;
+
+static std::string op_name(unsigned int op) {
+  return op == OP_END ? "END" : opcodeToString((Opcode)op);
+}
+
+// The opcode called `name`, or -1 if there is none.
+static long op_named(const std::string &name) {
+  if (name == "END")
+    return OP_END;
+  for (unsigned int op = 0; op < 256; ++op)
+    if (opcodeToString((Opcode)op) == name)
+      return op;
+  return -1;
+}
+
+static bool parse_number(const char *value, unsigned long &n) {
+  char *end;
+  n = std::strtoul(value, &end, 10);
+  return end != value && *end == '\0';
+}
+
+static void render(const TraceRecord &r, unsigned long seq) {
+  std::cout << std::setw(10) << seq << std::setw(8) << r.pc << "  "
+            << std::left << std::setw(10) << op_name(r.op) << std::right;
+  if (r.op != OP_END && has_operand(r.op))
+    std::cout << std::setw(12) << r.operand;
+  else
+    std::cout << std::setw(12) << "";
+  std::cout << "  depth " << std::setw(6) << r.depth;
+  if (r.depth) {
+    StackItem top{r.top};
+    std::cout << "  top " << top.value() << (top.is_obj() ? " (object)" : "");
+  }
+  std::cout << '\n';
+}
+
+static double percent(unsigned long part, unsigned long whole) {
+  return whole ? 100.0 * part / whole : 0;
+}
+
+static void summarize(const Trace &trace,
+                      const std::vector<const TraceRecord *> &chosen) {
+  std::map<unsigned int, unsigned long> ops;
+  std::map<unsigned int, unsigned long> pcs;
+  unsigned long deepest = 0;
+  for (const TraceRecord *r : chosen) {
+    ++ops[r->op];
+    ++pcs[r->pc];
+    deepest = std::max(deepest, (unsigned long)r->depth);
+  }
+
+  std::cout << "--- Trace ---" << std::endl;
+  std::cout << "Instructions: " << trace.count << " (" << trace.records.size()
+            << " kept, " << chosen.size() << " selected)" << std::endl;
+  std::cout << "Deepest stack: " << deepest << std::endl;
+
+  std::vector<std::pair<unsigned int, unsigned long>> by_count(ops.begin(),
+                                                               ops.end());
+  std::sort(by_count.begin(), by_count.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+  std::cout << std::endl
+            << std::left << std::setw(12) << "opcode" << std::right
+            << std::setw(14) << "count" << std::setw(8) << "%" << std::endl;
+  for (const auto &op : by_count) {
+    std::cout << std::left << std::setw(12) << op_name(op.first) << std::right
+              << std::setw(14) << op.second << std::setw(8) << std::fixed
+              << std::setprecision(1) << percent(op.second, chosen.size())
+              << std::endl;
+  }
+
+  std::vector<std::pair<unsigned int, unsigned long>> hot(pcs.begin(),
+                                                          pcs.end());
+  std::sort(hot.begin(), hot.end(), [](const auto &a, const auto &b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+  if (hot.size() > SUMMARY_ROWS)
+    hot.resize(SUMMARY_ROWS);
+  std::cout << std::endl
+            << std::setw(8) << "pc" << std::setw(14) << "count"
+            << std::setw(8) << "%" << std::endl;
+  for (const auto &p : hot) {
+    std::cout << std::setw(8) << p.first << std::setw(14) << p.second
+              << std::setw(8) << percent(p.second, chosen.size())
+              << std::endl;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  bool summary = false;
+  bool have_pc = false;
+  unsigned long pc = 0;
+  long op = -1;
+  unsigned long first = 0;
+  unsigned long last = 0;
+
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <trace_file> [--summary]"
+              << " [--pc=<address>] [--op=<opcode>]"
+              << " [--first=<n>] [--last=<n>]" << std::endl;
+    return 1;
+  }
+
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--summary") {
+      summary = true;
+    } else if (arg.rfind("--pc=", 0) == 0) {
+      have_pc = true;
+      if (!parse_number(arg.c_str() + 5, pc)) {
+        std::cerr << "Invalid address: " << arg.substr(5) << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--op=", 0) == 0) {
+      op = op_named(arg.substr(5));
+      if (op < 0) {
+        std::cerr << "Unknown opcode: " << arg.substr(5) << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--first=", 0) == 0) {
+      if (!parse_number(arg.c_str() + 8, first)) {
+        std::cerr << "Invalid count: " << arg.substr(8) << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--last=", 0) == 0) {
+      if (!parse_number(arg.c_str() + 7, last)) {
+        std::cerr << "Invalid count: " << arg.substr(7) << std::endl;
+        return 1;
+      }
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  try {
+    Trace trace = read_trace(argv[1]);
+    // Sequence number of the oldest record kept
+    unsigned long base = trace.count - trace.records.size();
+
+    std::vector<const TraceRecord *> chosen;
+    std::vector<unsigned long> seqs;
+    for (unsigned long i = 0; i < trace.records.size(); ++i) {
+      const TraceRecord &r = trace.records[i];
+      if ((have_pc && r.pc != pc) || (op >= 0 && r.op != op))
+        continue;
+      chosen.push_back(&r);
+      seqs.push_back(base + i);
+    }
+    unsigned long from = 0, to = chosen.size();
+    if (first && first < to)
+      to = first;
+    if (last && last < to - from)
+      from = to - last;
+    chosen = std::vector<const TraceRecord *>(chosen.begin() + from,
+                                              chosen.begin() + to);
+
+    if (summary) {
+      summarize(trace, chosen);
+    } else {
+      for (unsigned long i = 0; i < chosen.size(); ++i)
+        render(*chosen[i], seqs[from + i]);
+    }
+  } catch (const std::runtime_error &e) {
+    std::cerr << "bvm-trace: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,201 @@
+#include "verifier.hpp"
+#include "op_codes.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+// Operands an instruction reads and results it leaves, CALL and RET aside.
+void stack_effect(unsigned int op, long &pops, long &pushes) {
+  switch (op) {
+  case PUSH:
+  case LOAD:
+    pops = 0;
+    pushes = 1;
+    break;
+  case POP:
+  case JZ:
+  case JNZ:
+  case STORE:
+    pops = 1;
+    pushes = 0;
+    break;
+  case DUP:
+    pops = 1;
+    pushes = 2;
+    break;
+  case PEEKPRINT:
+  case NOT:
+    pops = 1;
+    pushes = 1;
+    break;
+  case ADD:
+  case SUB:
+  case MUL:
+  case DIV:
+  case CMP:
+  case AND:
+  case OR:
+  case XOR:
+  case SHL:
+  case SHR:
+  case CONS:
+    pops = 2;
+    pushes = 1;
+    break;
+  default: // NOP, JMP, CALL, RET, HALT, OP_END
+    pops = 0;
+    pushes = 0;
+    break;
+  }
+}
+
+enum State { NOT_VISITED, IN_PROGRESS, DONE };
+
+// What a function does to the stack of its caller, relative to the depth it
+// was called at.
+struct Summary {
+  State state = NOT_VISITED;
+  long low = 0;          // Deepest value read (<= 0)
+  unsigned long low_at = 0; // Address of the instruction reading it
+  long high = 0;         // Highest depth reached (>= 0)
+  long calls = 0;        // Deepest nesting of calls made (0 for a leaf)
+  bool returns = false;  // Whether any RET is reachable
+  long effect = 0;       // Net change in depth at RET
+};
+
+class Verifier {
+public:
+  Verifier(const Program &program, Verification &result)
+      : program(program), result(result), summary(program.size()),
+        owner(program.size(), -1) {}
+
+  const Summary &function(unsigned long entry);
+
+private:
+  const Program &program;
+  Verification &result;
+  std::vector<Summary> summary; // Per function entry
+  std::vector<long> owner;      // Function each instruction belongs to
+
+  unsigned long pc(unsigned long index) const { return program.at(index).pc; }
+};
+
+const Summary &Verifier::function(unsigned long entry) {
+  Summary &s = summary[entry];
+  if (s.state == DONE)
+    return s;
+  if (s.state == IN_PROGRESS)
+    throw std::runtime_error("recursive CALL to address " +
+                             std::to_string(pc(entry)));
+  s.state = IN_PROGRESS;
+
+  std::vector<unsigned long> work;
+  auto reach = [&](unsigned long index, long depth) {
+    if (owner[index] < 0) {
+      owner[index] = entry;
+      result.depth[index] = depth;
+      work.push_back(index);
+    } else if (owner[index] != (long)entry) {
+      throw std::runtime_error("address " + std::to_string(pc(index)) +
+                               " is shared between functions");
+    } else if (result.depth[index] != depth) {
+      throw std::runtime_error(
+          "inconsistent stack depth at address " + std::to_string(pc(index)) +
+          " (" + std::to_string(result.depth[index]) + " and " +
+          std::to_string(depth) + ")");
+    }
+  };
+  auto read = [&](long depth, unsigned long index) {
+    if (depth < s.low) {
+      s.low = depth;
+      s.low_at = pc(index);
+    }
+  };
+
+  reach(entry, 0);
+  while (!work.empty()) {
+    unsigned long i = work.back();
+    work.pop_back();
+    const Instruction &ins = program.at(i);
+    long depth = result.depth[i];
+
+    if (ins.op == CALL) {
+      const Summary &callee = function(ins.operand);
+      read(depth + callee.low, i);
+      s.high = std::max(s.high, depth + callee.high);
+      s.calls = std::max(s.calls, callee.calls + 1);
+      if (callee.returns)
+        reach(i + 1, depth + callee.effect);
+      continue;
+    }
+
+    long pops, pushes;
+    stack_effect(ins.op, pops, pushes);
+    read(depth - pops, i);
+    long next = depth - pops + pushes;
+    s.high = std::max(s.high, next);
+
+    switch (ins.op) {
+    case JMP:
+      reach(ins.operand, next);
+      break;
+    case JZ:
+    case JNZ:
+      reach(ins.operand, next);
+      reach(i + 1, next);
+      break;
+    case RET:
+      if (entry == 0)
+        throw std::runtime_error("RET outside a function at address " +
+                                 std::to_string(ins.pc));
+      if (!s.returns) {
+        s.returns = true;
+        s.effect = next;
+      } else if (s.effect != next) {
+        throw std::runtime_error("inconsistent stack depth at RET, address " +
+                                 std::to_string(ins.pc));
+      }
+      break;
+    case HALT:
+    case OP_END:
+      break;
+    default:
+      reach(i + 1, next);
+      break;
+    }
+  }
+
+  s.state = DONE;
+  return s;
+}
+
+} // namespace
+
+Verification verify_program(const Program &program, unsigned long stack_slots,
+                            unsigned long call_slots) {
+  Verification result;
+  result.depth.assign(program.size(), VERIFY_UNREACHED);
+  if (program.empty())
+    return result;
+
+  try {
+    Verifier verifier(program, result);
+    const Summary &main = verifier.function(0);
+    if (main.low < 0)
+      throw std::runtime_error("stack underflow at address " +
+                               std::to_string(main.low_at));
+    if (main.high > (long)stack_slots)
+      throw std::runtime_error("needs " + std::to_string(main.high) +
+                               " stack slots");
+    if (main.calls > (long)call_slots)
+      throw std::runtime_error("nests " + std::to_string(main.calls) +
+                               " calls");
+    result.max_depth = main.high;
+    result.max_calls = main.calls;
+    result.verified = true;
+  } catch (const std::runtime_error &e) {
+    result.reason = e.what();
+  }
+  return result;
+}
@@ -0,0 +1,43 @@
+#ifndef VERIFIER_HPP
+#define VERIFIER_HPP
+
+#include "program.hpp"
+#include <string>
+#include <vector>
+
+// Static stack-depth verification.
+//
+// Program::decode already proves that every opcode is known and every branch
+// target and memory index is in range. The verifier additionally proves that
+// a run starting at address 0 with empty stacks can never underflow or
+// overflow the operand stack or the call stack, so the threaded engine can
+// drop those checks (division by zero is still checked at run time).
+//
+// Every CALL target starts a function, and address 0 starts the main
+// program. Each function is walked on its own with depths relative to its
+// entry: every instruction must be reached with a single depth, all RETs of
+// a function must agree on its net stack effect, and a CALL contributes the
+// callee's summary (the deepest it reads into its caller's values, how far
+// it grows the stack and its net effect). Programs whose call graph has a
+// cycle (any recursion, whose depth is not known statically), with code
+// shared between functions, or with a RET outside any function are rejected
+// and run with the checks in place.
+
+#define VERIFY_UNREACHED (-1L << 40)
+
+struct Verification {
+  bool verified = false;
+  std::string reason;         // Why the program was rejected
+  long max_depth = 0;         // Most values on the operand stack at once
+  long max_calls = 0;         // Most return addresses on the call stack
+  std::vector<long> depth;    // Depth before each instruction, relative to
+                              // its function's entry, or VERIFY_UNREACHED
+};
+
+// Verifies a decoded program for an operand stack of `stack_slots` slots
+// and a call stack of `call_slots`. Never throws; a rejected program just
+// has `verified` false.
+Verification verify_program(const Program &program, unsigned long stack_slots,
+                            unsigned long call_slots);
+
+#endif // VERIFIER_HPP
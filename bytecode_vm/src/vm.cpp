@@ -1,147 +1,585 @@
 #include "vm.hpp"
 #include "op_codes.hpp"
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <fcntl.h>
 #include <stdexcept>
-#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
 
-VM::VM() : pc(0), verbose(false), debug_mode(false), stats_requested(false), heap_head(nullptr), num_objects(0) {}
+VM::VM() : program_memory(0), pc(0), verbose(false), debug_mode(false), engine(ENGINE_SWITCH), load_mode(LOAD_LAZY), fusion(true), jit(true), unchecked(false), profile(false), collector(COLLECTOR_MARK_SWEEP), marker(heap), parallel(heap), num_objects(0), gc_budget_us(GC_DEFAULT_BUDGET_US), lazy_sweep(false), stats_requested(false), sample_requested(false) {}
 
 VM::~VM() {
   if (num_objects > 0) {
       std::cerr << "Memory Leak Detected: " << num_objects << " objects remaining on heap." << std::endl;
   }
-  while (heap_head) {
-    Object *next = heap_head->next;
-    free(heap_head);
-    heap_head = next;
-  }
 }
 
 void VM::setVerbose(bool v) { verbose = v; }
 
 void VM::load(const std::string &filename) {
-  FILE *file = fopen(filename.c_str(), "rb");
-  if (!file) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
     throw std::runtime_error("VM Load Error: Could not open file " + filename);
   }
 
-  fseek(file, 0, SEEK_END);
-  long file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
+  struct stat info;
+  long file_size = fstat(fd, &info) == 0 ? info.st_size : 0;
 
   if (file_size == 0) {
-    fclose(file);
+    close(fd);
     throw std::runtime_error("VM Load Error: File is empty.");
   }
-  if (file_size % sizeof(long) != 0) {
-    fclose(file);
+  unsigned char magic[4];
+  bool container =
+      pread(fd, magic, 4, 0) == 4 && is_container(magic, sizeof(magic));
+  if (!container && file_size % sizeof(long) != 0) {
+    close(fd);
     throw std::runtime_error(
         "VM Load Error: File size is not a multiple of sizeof(long).");
   }
 
-  size_t num_longs = file_size / sizeof(long);
-  if (num_longs > MEM_SIZE) {
-    fclose(file);
-    throw std::runtime_error(
-        "VM Load Error: Bytecode size exceeds memory capacity.");
+  // A raw image is decoded straight out of the page cache; program_memory
+  // keeps the mapping rather than a copy. A .bvm is unpacked into
+  // program_memory, and debug_info keeps it mapped. Data memory starts
+  // zeroed, whatever an earlier program left in it; the data section only
+  // writes its nonzero runs.
+  data_memory.reset();
+  if (container) {
+    try {
+      read_container(fd, file_size, load_mode, program_memory, data_memory,
+                     debug_info);
+    } catch (const std::runtime_error &) {
+      close(fd);
+      throw;
+    }
+  } else {
+    debug_info.clear();
+    try {
+      program_memory.map_file(fd, file_size / sizeof(long), load_mode);
+    } catch (const std::runtime_error &) {
+      close(fd);
+      throw std::runtime_error("VM Load Error: Could not map file " +
+                               filename);
+    }
   }
+  close(fd);
 
-  long buffer[num_longs];
-  fread(buffer, sizeof(long), num_longs, file);
-  fclose(file);
-
-  program_memory.load(buffer, num_longs);
+  size_t num_longs = program_memory.size();
+  program.decode(program_memory.base(), num_longs, data_memory.size());
+  verification = verify_program(program, register_stack.capacity(),
+                                call_stack.capacity());
+  register_code.clear();
+  jit_code.reset(program.size());
+  if (profile) {
+    profiler.reset(program.size());
+  }
+  sampler.reset();
+  if (fusion) {
+    program.fuse(fusion_profile.empty() ? nullptr : &fusion_profile);
+  }
+  // Breakpoints carry over to the new program where an instruction still
+  // starts at their address, and watchpoints where their word still exists.
+  for (auto bp = breakpoints.begin(); bp != breakpoints.end();) {
+    long index = program.index_of(bp->first);
+    if (index < 0 || program.at(index).op == OP_END) {
+      bp = breakpoints.erase(bp);
+    } else {
+      program.set_break(index);
+      ++bp;
+    }
+  }
+  for (auto wp = watchpoints.begin(); wp != watchpoints.end();) {
+    if (wp->first >= data_memory.size())
+      wp = watchpoints.erase(wp);
+    else
+      ++wp;
+  }
+  patch_watchpoints();
   pc = 0;
   std::cout << "Loaded " << file_size << " bytes from " << filename
             << std::endl;
+  if (verbose) {
+    if (verification.verified) {
+      std::cout << "Verified: max stack depth " << verification.max_depth
+                << ", max call depth " << verification.max_calls << std::endl;
+    } else {
+      std::cout << "Not verified: " << verification.reason << std::endl;
+    }
+  }
+}
+
+// --- Breakpoints ---
+
+void VM::set_breakpoint(unsigned long addr, const Breakpoint &bp) {
+  long index = program.index_of(addr);
+  if (index < 0 || program.at(index).op == OP_END)
+    throw std::runtime_error("No instruction at address " +
+                             std::to_string(addr));
+  breakpoints[addr] = bp;
+  program.set_break(index);
+  relink_breakpoints();
+}
+
+void VM::clear_breakpoint(unsigned long addr) {
+  if (!breakpoints.erase(addr))
+    return;
+  long index = program.index_of(addr);
+  if (watched_word(index) < 0)
+    program.clear_break(index);
+  relink_breakpoints();
+}
+
+// Every LOAD and STORE names its word as an immediate, so the instructions
+// that can touch a watched word are all known up front and are patched like
+// breakpoints. Nothing changes for runs without watchpoints.
+
+void VM::set_watchpoint(unsigned long index, bool reads) {
+  if (index >= data_memory.size())
+    throw std::runtime_error("No data memory word " + std::to_string(index));
+  Watchpoint &wp = watchpoints[index];
+  (reads ? wp.reads : wp.writes) = true;
+  patch_watchpoints();
+  relink_breakpoints();
+}
+
+void VM::clear_watchpoint(unsigned long index) {
+  if (!watchpoints.erase(index))
+    return;
+  for (unsigned long i = 0; i < program.size(); ++i) {
+    const Instruction &ins = program.at(i);
+    if ((ins.op == LOAD || ins.op == STORE) &&
+        (unsigned long)ins.operand == index && !breakpoints.count(ins.pc))
+      program.clear_break(i);
+  }
+  relink_breakpoints();
+}
+
+long VM::watched_word(unsigned long index) const {
+  const Instruction &ins = program.at(index);
+  if (ins.op != LOAD && ins.op != STORE)
+    return -1;
+  auto wp = watchpoints.find(ins.operand);
+  if (wp == watchpoints.end() ||
+      !(ins.op == LOAD ? wp->second.reads : wp->second.writes))
+    return -1;
+  return ins.operand;
+}
+
+void VM::patch_watchpoints() {
+  if (watchpoints.empty())
+    return;
+  for (unsigned long i = 0; i < program.size(); ++i) {
+    if (watched_word(i) >= 0)
+      program.set_break(i);
+  }
+}
+
+void VM::hit_watchpoint(unsigned long index, long word, long before) {
+  const Instruction &ins = program.at(index);
+  long after = data_memory.base()[word];
+  if (ins.op == STORE) {
+    if (after == before)
+      return;
+    std::cout << "Watchpoint data[" << word << "]: " << before << " -> "
+              << after;
+  } else {
+    std::cout << "Read watchpoint data[" << word << "] = " << after;
+  }
+  std::cout << " at PC " << ins.pc << " (hit " << ++watchpoints[word].hits
+            << ")" << std::endl;
+  debug_mode = true;
+}
+
+void VM::relink_breakpoints() {
+  // Register blocks and compiled code are built around the breaks, so they
+  // are rebuilt; program.linked was already reset.
+  register_code.clear();
+  jit_code.reset(program.size());
+}
+
+bool VM::hit_breakpoint() {
+  auto found = breakpoints.find(pc);
+  if (found == breakpoints.end())
+    return false;
+  Breakpoint &bp = found->second;
+  long value = 0;
+  switch (bp.subject) {
+  case Breakpoint::ALWAYS:
+    ++bp.hits;
+    return true;
+  case Breakpoint::TOP:
+    if (register_stack.is_empty())
+      return false;
+    value = register_stack.get_item(register_stack.get_size() - 1).value();
+    break;
+  case Breakpoint::MEMORY:
+    if (bp.index >= data_memory.size())
+      return false;
+    value = data_memory.base()[bp.index];
+    break;
+  }
+  bool holds = false;
+  switch (bp.relation) {
+  case Breakpoint::EQ: holds = value == bp.value; break;
+  case Breakpoint::NE: holds = value != bp.value; break;
+  case Breakpoint::LT: holds = value < bp.value; break;
+  case Breakpoint::LE: holds = value <= bp.value; break;
+  case Breakpoint::GT: holds = value > bp.value; break;
+  case Breakpoint::GE: holds = value >= bp.value; break;
+  }
+  if (holds)
+    ++bp.hits;
+  return holds;
 }
 
 // --- GC Implementation ---
 
-Object *VM::allocate(ObjectType type) {
-  Object *obj = (Object *)malloc(sizeof(Object));
-  if (!obj)
-    throw std::runtime_error("Heap Allocation Failed");
+// Adds the pause that began at `start` to `kind` and to all pauses.
+static void record_pause(GcStats &stats, PauseHistogram &kind,
+                         std::chrono::steady_clock::time_point start) {
+  unsigned long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  kind.record(ns);
+  stats.pauses.record(ns);
+}
 
-  obj->marked = false;
+Object *VM::allocate(ObjectType type, Object *&first, Object *&second) {
+  Object *obj;
+  if (collector == COLLECTOR_SEMISPACE) {
+    // A second collection is needed if the survivors filled the space, and
+    // copies into the larger space the first one left.
+    while (!(obj = from_space.allocate())) {
+      if (from_space.capacity() == 0) {
+        from_space.resize(SEMISPACE_OBJECTS);
+        to_space.resize(SEMISPACE_OBJECTS);
+      } else {
+        collect_semispace(first, second);
+      }
+    }
+  } else if (collector == COLLECTOR_GENERATIONAL) {
+    obj = nursery.allocate();
+    if (!obj) {
+      if (nursery.capacity() == 0)
+        nursery.resize(NURSERY_OBJECTS);
+      else
+        collect_nursery(first, second);
+      obj = nursery.allocate();
+    }
+  } else {
+    if (collector == COLLECTOR_INCREMENTAL &&
+        (cycle || heap.sweeping() ? ++allocations >= GC_INCREMENT_ALLOCATIONS
+                                  : num_objects >= next_full))
+      gc_increment(first, second);
+    obj = heap.allocate();
+    // Allocated black: its fields are shaded by new_pair and new_closure.
+    if (cycle)
+      marker.blacken(obj);
+  }
   obj->type = type;
-  obj->next = heap_head;
-  heap_head = obj;
   num_objects++;
 
   return obj;
 }
 
 Object *VM::new_pair(Object *head, Object *tail) {
-  Object *obj = allocate(OBJ_PAIR);
-  obj->pair.head = head;
-  obj->pair.tail = tail;
+  Object *obj = allocate(OBJ_PAIR, head, tail);
+  write_field(obj->pair.head, head);
+  write_field(obj->pair.tail, tail);
   return obj;
 }
 
 Object *VM::new_function() {
-  Object *obj = allocate(OBJ_FUNCTION);
+  Object *none = nullptr;
+  Object *obj = allocate(OBJ_FUNCTION, none, none);
   obj->func.address = 0; // Placeholder
   return obj;
 }
 
 Object *VM::new_closure(Object *fn, Object *env) {
-  Object *obj = allocate(OBJ_CLOSURE);
-  obj->closure.fn = fn;
-  obj->closure.env = env;
+  Object *obj = allocate(OBJ_CLOSURE, fn, env);
+  write_field(obj->closure.fn, fn);
+  write_field(obj->closure.env, env);
   return obj;
 }
 
-void VM::mark(Object *obj) {
-  if (!obj || obj->marked)
-    return;
+Object *VM::cons() {
+  unsigned long size = register_stack.get_size();
+  const StackItem &head = register_stack.get_item(size - 2);
+  const StackItem &tail = register_stack.get_item(size - 1);
+  return new_pair(head.is_obj() ? (Object *)head.value() : nullptr,
+                  tail.is_obj() ? (Object *)tail.value() : nullptr);
+}
 
-  obj->marked = true;
+void VM::mark(Object *obj) { marker.mark(obj); }
 
-  switch (obj->type) {
-  case OBJ_PAIR:
-    mark(obj->pair.head);
-    mark(obj->pair.tail);
-    break;
-  case OBJ_CLOSURE:
-    mark(obj->closure.fn);
-    mark(obj->closure.env);
-    break;
-  case OBJ_FUNCTION:
-    break;
+void VM::sweep() {
+  if (lazy_sweep)
+    num_objects -= heap.sweep_lazily();
+  else
+    num_objects -= parallel.threads() > 1 ? parallel.sweep() : heap.sweep();
+}
+
+void VM::gc() {
+  Object *none = nullptr;
+  if (collector == COLLECTOR_SEMISPACE) {
+    if (from_space.size())
+      collect_semispace(none, none);
+    return;
+  }
+  // The minor collection may have collected the heap already.
+  if (collector == COLLECTOR_GENERATIONAL && nursery.size() &&
+      collect_nursery(none, none))
+    return;
+  if (cycle) {
+    // Objects allocated black since the cycle began would survive it, so
+    // start over to free everything unreachable.
+    heap.clear_marks();
+    marker.reset();
+    cycle = false;
   }
+  collect_heap(none, none);
 }
 
-void VM::sweep() {
-  Object **curr = &heap_head;
-  while (*curr) {
-    Object *obj = *curr;
-    if (!obj->marked) {
-      *curr = obj->next;
-      free(obj);
-      num_objects--;
-    } else {
-      obj->marked = false;
-      curr = &obj->next;
+void VM::collect_heap(Object *first, Object *second) {
+  auto start = std::chrono::steady_clock::now();
+  if (verbose)
+    std::cout << "GC Triggered. Objects before: " << num_objects << std::endl;
+  // The marks of chunks the last lazy sweep left are still in use.
+  heap.finish_sweep();
+
+  if (parallel.threads() > 1) {
+    std::vector<Object *> roots{first, second};
+    for (unsigned long i = 0; i < register_stack.get_size(); ++i) {
+      const StackItem &item = register_stack.get_item(i);
+      if (item.is_obj())
+        roots.push_back((Object *)item.value());
+    }
+    parallel.mark(roots);
+  } else {
+    for (unsigned long i = 0; i < register_stack.get_size(); ++i) {
+      const StackItem &item = register_stack.get_item(i);
+      if (item.is_obj()) {
+        mark((Object *)item.value());
+      }
     }
+    mark(first);
+    mark(second);
   }
+
+  finish_cycle();
+
+  if (verbose)
+    std::cout << "GC Complete. Objects after: " << num_objects << std::endl;
+  record_pause(gc_stats, gc_stats.full, start);
 }
 
-void VM::gc() {
+void VM::finish_cycle() {
+  if (cycle) {
+    // Sweeping the whole heap would overrun the step's budget. Every marked
+    // object went through the marker, so it has the count, and the sweep is
+    // left to later steps and to allocation.
+    num_objects = marker.marked;
+    heap.defer_sweep();
+  } else {
+    sweep();
+  }
+  cycle = false;
+  next_full = 2 * num_objects > GC_HEAP_MIN ? 2 * num_objects : GC_HEAP_MIN;
+}
+
+Object *VM::evacuate(Object *obj) {
+  if (!obj)
+    return obj;
+  if (obj->type == OBJ_FORWARDED)
+    return obj->forward;
+  // The rest of a list is copied straight after its first pair. The scan
+  // alone goes breadth first, which would interleave lists reachable at
+  // the same depth, and a list is walked through its tails.
+  Object *first_copy = nullptr;
+  do {
+    Object *copy = to_space.allocate();
+    *copy = *obj;
+    obj->type = OBJ_FORWARDED;
+    obj->forward = copy;
+    if (!first_copy)
+      first_copy = copy;
+    obj = copy->type == OBJ_PAIR ? copy->pair.tail : nullptr;
+  } while (obj && obj->type != OBJ_FORWARDED);
+  return first_copy;
+}
+
+void VM::collect_semispace(Object *&first, Object *&second) {
+  auto start = std::chrono::steady_clock::now();
   if (verbose)
     std::cout << "GC Triggered. Objects before: " << num_objects << std::endl;
-
+  // to_space holds at least as much as from_space, so every copy fits.
+  StackItem *slots = register_stack.base();
   for (unsigned long i = 0; i < register_stack.get_size(); ++i) {
-    const StackItem &item = register_stack.get_item(i);
-    if (item.is_obj) {
-      mark((Object *)item.value);
-    }
+    if (slots[i].is_obj())
+      slots[i].bits =
+          StackItem::tag((long)evacuate((Object *)slots[i].value()), true);
   }
+  first = evacuate(first);
+  second = evacuate(second);
 
-  sweep();
+  // Cheney's scan: the copies not yet scanned are the queue, from the scan
+  // point to the top of to_space, and scanning one appends its children.
+  to_space.each([&](Object *obj) {
+    switch (obj->type) {
+    case OBJ_PAIR:
+      obj->pair.head = evacuate(obj->pair.head);
+      obj->pair.tail = evacuate(obj->pair.tail);
+      break;
+    case OBJ_CLOSURE:
+      obj->closure.fn = evacuate(obj->closure.fn);
+      obj->closure.env = evacuate(obj->closure.env);
+      break;
+    case OBJ_FUNCTION:
+    case OBJ_FORWARDED:
+      break;
+    }
+  });
+  num_objects = to_space.size();
+  from_space.clear();
+  from_space.swap(to_space);
+  unsigned long capacity = from_space.capacity();
+  if (from_space.size() > capacity / 2)
+    capacity *= 2;
+  if (to_space.capacity() < capacity)
+    to_space.resize(capacity);
 
   if (verbose)
     std::cout << "GC Complete. Objects after: " << num_objects << std::endl;
+  record_pause(gc_stats, gc_stats.full, start);
+}
+
+void VM::gc_increment(Object *first, Object *second) {
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::microseconds(gc_budget_us);
+  allocations = 0;
+  // The roots are shaded at the start of a cycle and again at its end. In
+  // between, the program can only reach objects it could reach at the
+  // start, or new ones, which are allocated black: no instruction reads a
+  // pointer out of an object. write_field() shades what any later one
+  // stores, so a black object never points at a white one.
+  auto shade_roots = [&] {
+    for (unsigned long i = 0; i < register_stack.get_size(); ++i) {
+      const StackItem &item = register_stack.get_item(i);
+      if (item.is_obj())
+        marker.shade((Object *)item.value());
+    }
+    marker.shade(first);
+    marker.shade(second);
+  };
+  auto out_of_time = [&] {
+    if (std::chrono::steady_clock::now() < deadline)
+      return false;
+    record_pause(gc_stats, gc_stats.increments, start);
+    return true;
+  };
+  if (!cycle) {
+    // The last cycle's sweep is finished before the next one starts, a
+    // chunk at a time like the marking. Steps come every few allocations
+    // until it is, and only start a cycle if the heap has doubled.
+    if (heap.sweeping()) {
+      while (!heap.sweep_some(1)) {
+        if (out_of_time())
+          return;
+      }
+      if (num_objects < next_full) {
+        record_pause(gc_stats, gc_stats.increments, start);
+        return;
+      }
+    }
+    cycle = true;
+    rescanned = false;
+    marker.reset();
+    shade_roots();
+    if (verbose)
+      std::cout << "GC Cycle Started. Objects: " << num_objects << std::endl;
+  } else {
+    marker.shade(first);
+    marker.shade(second);
+  }
+  for (;;) {
+    while (!marker.mark_some(GC_MARK_SLICE)) {
+      if (out_of_time())
+        return;
+    }
+    if (rescanned)
+      break;
+    shade_roots();
+    rescanned = true;
+  }
+  finish_cycle();
+  if (verbose)
+    std::cout << "GC Cycle Complete. Objects after: " << num_objects
+              << std::endl;
+  record_pause(gc_stats, gc_stats.increments, start);
+}
+
+Object *VM::promote(Object *obj) {
+  if (!nursery.contains(obj))
+    return obj;
+  if (obj->type == OBJ_FORWARDED)
+    return obj->forward;
+  Object *copy = heap.allocate();
+  *copy = *obj;
+  obj->type = OBJ_FORWARDED;
+  obj->forward = copy;
+  promoted.push_back(copy);
+  return copy;
+}
+
+bool VM::collect_nursery(Object *&first, Object *&second) {
+  auto start = std::chrono::steady_clock::now();
+  StackItem *slots = register_stack.base();
+  for (unsigned long i = 0; i < register_stack.get_size(); ++i) {
+    if (slots[i].is_obj())
+      slots[i].bits =
+          StackItem::tag((long)promote((Object *)slots[i].value()), true);
+  }
+  first = promote(first);
+  second = promote(second);
+
+  // Promote what the copies point at in turn. Only nursery objects are
+  // traced, so a copy's fields that are already mature are left alone.
+  unsigned long survivors = 0;
+  while (!promoted.empty()) {
+    Object *obj = promoted.back();
+    promoted.pop_back();
+    ++survivors;
+    switch (obj->type) {
+    case OBJ_PAIR:
+      obj->pair.head = promote(obj->pair.head);
+      obj->pair.tail = promote(obj->pair.tail);
+      break;
+    case OBJ_CLOSURE:
+      obj->closure.fn = promote(obj->closure.fn);
+      obj->closure.env = promote(obj->closure.env);
+      break;
+    case OBJ_FUNCTION:
+    case OBJ_FORWARDED:
+      break;
+    }
+  }
+  num_objects -= nursery.size() - survivors;
+  nursery.clear();
+
+  record_pause(gc_stats, gc_stats.minor, start);
+  gc_stats.promoted += survivors;
+  if (verbose)
+    std::cout << "Minor GC: " << survivors << " objects promoted."
+              << std::endl;
+
+  if (num_objects < next_full)
+    return false;
+  collect_heap(first, second);
+  return true;
 }
 
 void gc(VM &vm) { vm.gc(); }
@@ -151,16 +589,26 @@ void gc(VM &vm) { vm.gc(); }
 
 
 void VM::step() {
-    if (pc >= MEM_SIZE) {
+    // The program was validated when it was decoded, so instructions and
+    // their operands can be used as they are.
+    long index = program.index_of(pc);
+    if (index < 0 || program.at(index).op == OP_END) {
       throw std::runtime_error(
           "VM Runtime Error: Program Counter out of bounds.");
     }
 
-    long instruction = program_memory.get(pc++);
-    Opcode opcode = longToOpcode(instruction);
+    const Instruction &ins = program.at(index);
+    Opcode opcode = (Opcode)ins.op;
+    pc = program.at(index + 1).pc;
+
+    if (tracer.active()) {
+      unsigned long depth = register_stack.get_size();
+      tracer.record(program.data(), ins, depth,
+                    depth ? register_stack.get_item(depth - 1).bits : 0);
+    }
 
     if (verbose) {
-      std::cout << "PC: " << pc - 1 << ", Opcode: " << opcodeToString(opcode);
+      std::cout << "PC: " << ins.pc << ", Opcode: " << opcodeToString(opcode);
     }
 
     long val1, val2, addr, idx, amt;
@@ -170,10 +618,7 @@ void VM::step() {
         std::cout << " (NOP)" << std::endl;
       break;
     case PUSH:
-      if (pc >= MEM_SIZE)
-        throw std::runtime_error(
-            "VM Runtime Error: PUSH operand out of bounds.");
-      val1 = program_memory.get(pc++);
+      val1 = ins.operand;
       register_stack.push(val1); // Default is_obj=false
       if (verbose)
         std::cout << " " << val1 << " (PUSH " << val1 << ")" << std::endl;
@@ -274,19 +719,14 @@ void VM::step() {
         std::cout << " (SHR " << val1 << ", " << amt << ")" << std::endl;
       break;
     case JMP:
-      if (pc >= MEM_SIZE)
-        throw std::runtime_error(
-            "VM Runtime Error: JMP address out of bounds.");
-      addr = program_memory.get(pc++);
+      addr = program.at(ins.operand).pc;
       pc = addr;
       if (verbose)
         std::cout << " " << addr << " (JMP to " << addr << ")" << std::endl;
       break;
     case JZ:
-      if (pc >= MEM_SIZE)
-        throw std::runtime_error("VM Runtime Error: JZ address out of bounds.");
       val1 = register_stack.pop();
-      addr = program_memory.get(pc++);
+      addr = program.at(ins.operand).pc;
       if (val1 == 0) {
         pc = addr;
       }
@@ -295,11 +735,8 @@ void VM::step() {
                   << " == 0)" << std::endl;
       break;
     case JNZ:
-      if (pc >= MEM_SIZE)
-        throw std::runtime_error(
-            "VM Runtime Error: JNZ address out of bounds.");
       val1 = register_stack.pop();
-      addr = program_memory.get(pc++);
+      addr = program.at(ins.operand).pc;
       if (val1 != 0) {
         pc = addr;
       }
@@ -308,29 +745,21 @@ void VM::step() {
                   << " != 0)" << std::endl;
       break;
     case STORE:
-      if (pc >= MEM_SIZE)
-        throw std::runtime_error(
-            "VM Runtime Error: STORE index out of bounds.");
       val1 = register_stack.pop();
-      idx = program_memory.get(pc++);
-      data_memory.store(idx, val1);
+      idx = ins.operand;
+      data_memory.base()[idx] = val1;
       if (verbose)
         std::cout << " " << idx << " (STORE " << val1 << " at " << idx << ")"
                   << std::endl;
       break;
     case LOAD:
-      if (pc >= MEM_SIZE)
-        throw std::runtime_error("VM Runtime Error: LOAD index out of bounds.");
-      idx = program_memory.get(pc++);
-      register_stack.push(data_memory.get(idx));
+      idx = ins.operand;
+      register_stack.push(data_memory.base()[idx]);
       if (verbose)
         std::cout << " " << idx << " (LOAD from " << idx << ")" << std::endl;
       break;
     case CALL:
-      if (pc >= MEM_SIZE)
-        throw std::runtime_error(
-            "VM Runtime Error: CALL address out of bounds.");
-      addr = program_memory.get(pc++);
+      addr = program.at(ins.operand).pc;
       call_stack.push(pc);
       pc = addr;
       if (verbose)
@@ -344,10 +773,11 @@ void VM::step() {
     case CONS:
     
       {
-           long tail_val = register_stack.pop();
-           long head_val = register_stack.pop();
-           
-           Object* obj = new_pair((Object*)head_val, (Object*)tail_val);
+           if (register_stack.get_size() < 2)
+               throw std::runtime_error("Stack Underflow");
+           Object* obj = cons();
+           register_stack.pop();
+           register_stack.pop();
            register_stack.push((long)obj, true); // Push as Object
            if (verbose) std::cout << " (CONS)" << std::endl;
       }
@@ -364,6 +794,42 @@ void VM::step() {
     }
 }
 
+// Relations as written in a conditional break command.
+static const char *const RELATION_NAMES[] = {"==", "!=", "<", "<=", ">", ">="};
+
+static bool parse_relation(const std::string &text,
+                           Breakpoint::Relation &relation) {
+  for (int r = Breakpoint::EQ; r <= Breakpoint::GE; ++r) {
+    if (text == RELATION_NAMES[r]) {
+      relation = (Breakpoint::Relation)r;
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char *relation_name(Breakpoint::Relation relation) {
+  return RELATION_NAMES[relation];
+}
+
+unsigned long VM::code_address(const std::string &text) {
+  // An address, or a label if the program came with symbols
+  const auto &labels = debug_info.labels();
+  auto label = labels.find(text);
+  return label != labels.end() ? label->second : std::stoul(text);
+}
+
+unsigned long VM::data_index(const std::string &text) {
+  // A data memory index, or a data label
+  const auto &labels = debug_info.data_labels();
+  auto label = labels.find(text);
+  unsigned long idx =
+      label != labels.end() ? label->second : std::stoul(text);
+  if (idx >= data_memory.size())
+    throw std::out_of_range("mem");
+  return idx;
+}
+
 void VM::repl() {
     std::string line;
     while (true) {
@@ -384,13 +850,110 @@ void VM::repl() {
             debug_mode = false;
             return;
         } else if (line.rfind("break ", 0) == 0) {
+            // break <addr|label> [if top <rel> <n> | if mem <index|label> <rel> <n>]
+            std::istringstream in(line.substr(6));
+            std::string where, word, subject, relation;
+            Breakpoint bp;
             try {
-                unsigned long addr = std::stoul(line.substr(6));
-                breakpoints.insert(addr);
+                in >> where;
+                unsigned long addr = code_address(where);
+                if (in >> word) {
+                    if (word != "if" || !(in >> subject))
+                        throw std::invalid_argument("break");
+                    if (subject == "top") {
+                        bp.subject = Breakpoint::TOP;
+                    } else if (subject == "mem" && in >> word) {
+                        bp.subject = Breakpoint::MEMORY;
+                        bp.index = data_index(word);
+                    } else {
+                        throw std::invalid_argument("break");
+                    }
+                    if (!(in >> relation >> bp.value) ||
+                        !parse_relation(relation, bp.relation) ||
+                        in >> word)
+                        throw std::invalid_argument("break");
+                }
+                set_breakpoint(addr, bp);
                 std::cout << "Breakpoint set at " << addr << std::endl;
+            } catch (...) {
+                std::cout << "Invalid breakpoint" << std::endl;
+            }
+        } else if (line.rfind("delete ", 0) == 0) {
+            try {
+                unsigned long addr = code_address(line.substr(7));
+                if (breakpoints.count(addr)) {
+                    clear_breakpoint(addr);
+                    std::cout << "Breakpoint deleted at " << addr << std::endl;
+                } else {
+                    std::cout << "No breakpoint at " << addr << std::endl;
+                }
             } catch (...) {
                 std::cout << "Invalid address" << std::endl;
             }
+        } else if (line.rfind("watch ", 0) == 0 ||
+                   line.rfind("rwatch ", 0) == 0) {
+            bool reads = line[0] == 'r';
+            try {
+                unsigned long idx = data_index(line.substr(reads ? 7 : 6));
+                set_watchpoint(idx, reads);
+                std::cout << (reads ? "Read watchpoint" : "Watchpoint")
+                          << " set on data[" << idx << "]" << std::endl;
+            } catch (...) {
+                std::cout << "Invalid index" << std::endl;
+            }
+        } else if (line.rfind("unwatch ", 0) == 0) {
+            try {
+                unsigned long idx = data_index(line.substr(8));
+                if (watchpoints.count(idx)) {
+                    clear_watchpoint(idx);
+                    std::cout << "Watchpoints deleted on data[" << idx << "]"
+                              << std::endl;
+                } else {
+                    std::cout << "No watchpoint on data[" << idx << "]"
+                              << std::endl;
+                }
+            } catch (...) {
+                std::cout << "Invalid index" << std::endl;
+            }
+        } else if (line == "breaks") {
+            std::map<unsigned long, Breakpoint> sorted(breakpoints.begin(),
+                                                       breakpoints.end());
+            for (const auto &bp : sorted) {
+                std::cout << "  " << bp.first << ": hit " << bp.second.hits;
+                if (bp.second.subject != Breakpoint::ALWAYS) {
+                    std::cout << ", if "
+                              << (bp.second.subject == Breakpoint::TOP
+                                      ? "top"
+                                      : "mem " + std::to_string(bp.second.index))
+                              << " " << relation_name(bp.second.relation) << " "
+                              << bp.second.value;
+                }
+                std::cout << std::endl;
+            }
+            std::map<unsigned long, Watchpoint> watched(watchpoints.begin(),
+                                                        watchpoints.end());
+            for (const auto &wp : watched) {
+                std::cout << "  data[" << wp.first << "]: "
+                          << (wp.second.writes && wp.second.reads
+                                  ? "watch, rwatch"
+                                  : wp.second.writes ? "watch" : "rwatch")
+                          << ", hit " << wp.second.hits << std::endl;
+            }
+            if (sorted.empty() && watched.empty())
+                std::cout << "No breakpoints" << std::endl;
+        } else if (line.rfind("mem ", 0) == 0) {
+            try {
+                unsigned long idx = data_index(line.substr(4));
+                std::cout << "data[" << idx << "] = "
+                          << data_memory.base()[idx] << std::endl;
+            } catch (...) {
+                std::cout << "Invalid index" << std::endl;
+            }
+        } else if (line == "where") {
+            std::cout << "PC: " << pc;
+            if (unsigned long source_line = debug_info.line_of(pc))
+                std::cout << " (line " << source_line << ")";
+            std::cout << std::endl;
         } else if (line == "stack") {
             printStack();
         } else if (line == "memstat") {
@@ -399,16 +962,17 @@ void VM::repl() {
             gc(); 
         } else if (line == "leaks") {
              std::cout << "Heap dump:" << std::endl;
-             Object* curr = heap_head;
              int count = 0;
-             while(curr) {
+             auto dump = [&](Object *curr) {
                  std::cout << "  Object at " << curr << " Type: " << curr->type << std::endl;
-                 curr = curr->next;
                  count++;
-             }
+             };
+             nursery.each(dump);
+             from_space.each(dump);
+             heap.each(dump);
              std::cout << "Total active objects: " << count << std::endl;
         } else if (line == "help") {
-            std::cout << "Commands: step(s), continue(c), break <addr>, stack, memstat, gc, leaks" << std::endl;
+            std::cout << "Commands: step(s), continue(c), break <addr|label> [if top|mem <index|label> ==|!=|<|<=|>|>= <n>], delete <addr|label>, watch|rwatch|unwatch <index|label>, breaks, where, mem <index|label>, stack, memstat, gc, leaks" << std::endl;
         } else if (line == "quit") {
             exit(0);
         } else {
@@ -426,18 +990,65 @@ void VM::run() {
   } else {
     std::cout << "VM running..." << std::endl;
   }
+  // The verifier's guarantees only hold for runs that start where it did.
+  unchecked = verification.verified && pc == 0 &&
+              register_stack.get_size() == 0 && call_stack.get_size() == 0;
+  guard_overflow([](VM &vm) { vm.interpret(); });
+}
+
+void VM::guard_overflow(void (*body)(VM &)) {
+  sigjmp_buf overflow;
+  GuardScope guard(overflow, {&register_stack.region(), &call_stack.region()});
+  if (sigsetjmp(overflow, 0)) {
+    // The fast engines keep their stack pointers and pc in locals, so all
+    // that is known is that the stack that overflowed is full.
+    Stack &full = guard.region() == &register_stack.region() ? register_stack
+                                                              : call_stack;
+    full.set_size(full.capacity());
+    throw std::runtime_error("Stack Overflow");
+  }
+  body(*this);
+}
 
+void VM::interpret() {
   while (true) {
+      if (sample_requested) {
+          sample_requested = false;
+          sampler.take(pc, call_stack);
+      }
+      // The fast engines run until HALT, or until the debugger needs
+      // per-instruction control, in which case we carry on below. Profiles
+      // and traces come from the threaded engine whichever was chosen. They
+      // also stop at breaks, whose instruction is run below.
+      if ((engine != ENGINE_SWITCH || profile || tracer.active()) &&
+          !verbose && !debug_mode && !stats_requested) {
+          if (engine == ENGINE_REGISTER && !profile && !tracer.active()
+                  ? run_register()
+                  : run_threaded()) {
+              break;
+          }
+          if (!at_break())
+              continue;
+      }
       if (stats_requested) {
           stats_requested = false;
           printStats();
       }
-      if (debug_mode || breakpoints.count(pc)) {
+      long index = program.index_of(pc);
+      bool patched = index >= 0 && program.is_break(index);
+      bool hit = patched && hit_breakpoint();
+      if (debug_mode || hit) {
           debug_mode = true; // Hit breakpoint triggers debug mode
-          std::cout << "Stopped at PC: " << pc << std::endl;
+          std::cout << "Stopped at PC: " << pc;
+          if (hit)
+              std::cout << " (breakpoint, hit " << breakpoints[pc].hits << ")";
+          std::cout << std::endl;
           repl();
       }
-      
+      // Watched accesses stop the program after the instruction runs.
+      long word = patched ? watched_word(index) : -1;
+      long before = word >= 0 ? data_memory.base()[word] : 0;
+
       try {
           step();
       } catch (const std::runtime_error& e) {
@@ -446,23 +1057,66 @@ void VM::run() {
           }
           throw;
       }
+      if (word >= 0)
+          hit_watchpoint(index, word, before);
   }
 }
 
 void VM::printStack() {
   std::cout << "Stack (top to bottom):" << std::endl;
-  std::vector<long> stack_elements = register_stack.getElements();
-  for (int i = stack_elements.size() - 1; i >= 0; --i) {
-    std::cout << "  " << stack_elements[i] << std::endl;
+  for (long i = (long)register_stack.get_size() - 1; i >= 0; --i) {
+    const StackItem &item = register_stack.get_item(i);
+    if (item.is_obj()) {
+      std::cout << "  " << (Object *)item.value() << " (object)" << std::endl;
+    } else {
+      std::cout << "  " << item.value() << std::endl;
+    }
   }
-  if (stack_elements.empty()) {
+  if (register_stack.is_empty()) {
     std::cout << "  (empty)" << std::endl;
   }
 }
 
 void VM::printStats() {
+    // Finish any lazy sweep, so the chunks are those of a swept heap.
+    heap.finish_sweep();
     std::cout << "--- VM Memory Stats ---" << std::endl;
     std::cout << "Stack Size: " << register_stack.get_size() << std::endl;
     std::cout << "Heap Objects: " << num_objects << std::endl;
+    std::cout << "Heap Chunks: " << heap.chunk_count() << std::endl;
+    if (lazy_sweep) {
+        std::cout << "Chunks Swept by Allocation: " << heap.lazily_swept
+                  << std::endl;
+    }
+    if (collector == COLLECTOR_SEMISPACE) {
+        std::cout << "Semispace Objects: " << from_space.size() << " of "
+                  << from_space.capacity() << std::endl;
+    }
+    if (collector == COLLECTOR_GENERATIONAL) {
+        std::cout << "Nursery Objects: " << nursery.size() << " of "
+                  << nursery.capacity() << std::endl;
+    }
+    if (parallel.threads() > 1) {
+        std::cout << "GC Threads: " << parallel.threads() << std::endl;
+    }
+    if (collector == COLLECTOR_INCREMENTAL) {
+        std::cout << "Incremental Cycle: " << (cycle ? "marking" : "idle")
+                  << std::endl;
+    }
+    auto print_pauses = [](const char *name, const PauseHistogram &pauses) {
+        if (!pauses.count())
+            return;
+        std::cout << name << ": " << pauses.count() << ", p50 "
+                  << pauses.percentile(0.5) << " us, p99 "
+                  << pauses.percentile(0.99) << " us, max " << pauses.max()
+                  << " us" << std::endl;
+    };
+    print_pauses("Minor GCs", gc_stats.minor);
+    if (gc_stats.minor.count()) {
+        std::cout << "Objects Promoted: " << gc_stats.promoted << std::endl;
+    }
+    print_pauses("Incremental Steps", gc_stats.increments);
+    print_pauses("Full GCs", gc_stats.full);
+    print_pauses("GC Pauses", gc_stats.pauses);
     std::cout << "-----------------------" << std::endl;
 }
@@ -1,11 +1,90 @@
 #ifndef VM_H
 #define VM_H
 
+#include "container.hpp"
+#include "heap.hpp"
+#include "jit.hpp"
+#include "marker.hpp"
 #include "memory.hpp"
+#include "nursery.hpp"
+#include "parallel.hpp"
 #include "object.hpp"
+#include "pauses.hpp"
+#include "profiler.hpp"
+#include "program.hpp"
+#include "regvm.hpp"
+#include "sampler.hpp"
 #include "stack.hpp"
+#include "trace.hpp"
+#include "verifier.hpp"
 #include <string>
-#include <set>
+#include <unordered_map>
+#include <vector>
+
+enum EngineKind { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_REGISTER };
+
+// How objects are allocated and collected. The mark-sweep collector only
+// runs when gc() is called. The generational one allocates from `nursery`
+// and collects it whenever it fills (see nursery.hpp), then also collects
+// the mature heap once it has doubled since it was last collected. The
+// incremental one starts marking once the heap has doubled, and marks a
+// little at a time as the program allocates (see VM::gc_increment). The
+// semispace one allocates from `from_space` and, when it fills, copies what
+// is reachable to `to_space` and swaps the two (see VM::collect_semispace).
+enum CollectorKind {
+  COLLECTOR_MARK_SWEEP,
+  COLLECTOR_GENERATIONAL,
+  COLLECTOR_INCREMENTAL,
+  COLLECTOR_SEMISPACE
+};
+
+// Objects below which neither automatic collector collects the heap.
+#define GC_HEAP_MIN (1UL << 16)
+// Default pause budget of an incremental step, in microseconds, and the
+// largest --gc-budget.
+#define GC_DEFAULT_BUDGET_US 500
+#define GC_MAX_BUDGET_US 1000000
+// Allocations between incremental steps
+#define GC_INCREMENT_ALLOCATIONS 4096
+// Objects an incremental step marks between looks at the clock
+#define GC_MARK_SLICE 1024
+// Default size of each semispace, in objects, and the largest
+// --semispace-size.
+#define SEMISPACE_OBJECTS (1UL << 16)
+#define MAX_SEMISPACE_OBJECTS (1UL << 30)
+
+// Collections so far, and the pauses they took.
+struct GcStats {
+  PauseHistogram minor;      // Nursery collections
+  PauseHistogram increments; // Incremental steps
+  PauseHistogram full;       // Collections of the heap in one pause
+  PauseHistogram pauses;     // All of them
+  unsigned long promoted = 0; // Objects copied out of the nursery
+};
+
+// A debugger breakpoint: the program stops before the instruction at its
+// address whenever the condition holds there.
+struct Breakpoint {
+  enum Subject { ALWAYS, TOP, MEMORY };       // What the condition tests
+  enum Relation { EQ, NE, LT, LE, GT, GE };
+
+  Subject subject = ALWAYS;
+  unsigned long index = 0; // Data memory index, for MEMORY
+  Relation relation = EQ;
+  long value = 0;
+  unsigned long hits = 0; // Times it stopped the program
+};
+
+// A debugger watchpoint on a data memory word. The program stops after any
+// STORE that changes it (`writes`) or any LOAD of it (`reads`).
+struct Watchpoint {
+  bool writes = false;
+  bool reads = false;
+  unsigned long hits = 0; // Times it stopped the program
+};
+
+// Hooks compiled into an instantiation of the threaded engine.
+enum Instrumentation { INSTRUMENT_NONE, INSTRUMENT_PROFILE, INSTRUMENT_TRACE };
 
 class VM {
 public:
@@ -16,35 +95,153 @@ public:
   Stack register_stack;
   Memory program_memory;
   Memory data_memory;
+  Program program; // Decoded form of program_memory
+  Verification verification; // Static checks on `program`, done on load
+  DebugInfo debug_info;      // Labels and lines, if loaded from a .bvm
+  RegisterCode register_code; // Register tier translation, built on demand
+  Jit jit_code;               // Native code for hot regions
+  Profiler profiler;          // Filled in by runs with `profile` set
+  Sampler sampler;            // Filled in at each sample_requested
+  Tracer tracer;              // Records every instruction once opened
   unsigned long pc;
   bool verbose;
   bool debug_mode;
-  std::set<unsigned long> breakpoints;
+  EngineKind engine;
+  LoadMode load_mode;           // How load() maps the .bin (see region.hpp)
+  bool fusion;                  // Install superinstructions on load
+  FusionProfile fusion_profile; // Restricts fusion to hot code if not empty
+  bool jit;                     // Compile hot code (threaded engine only)
+  bool unchecked; // This run started where verification did; see engine.cpp
+  bool profile;   // Run the instrumented threaded engine (see profiler.hpp)
+  // Set through set_breakpoint(), by address
+  std::unordered_map<unsigned long, Breakpoint> breakpoints;
+  // Set through set_watchpoint(), by data memory index
+  std::unordered_map<unsigned long, Watchpoint> watchpoints;
 
-  Object *heap_head;
+  CollectorKind collector;
+  Heap heap;       // The mature objects, or all of them for mark-sweep
+  Nursery nursery; // The young objects, for the generational collector
+  // The semispace collector's two halves: objects are allocated from
+  // `from_space` and the survivors copied to `to_space`.
+  Nursery from_space;
+  Nursery to_space;
+  Marker marker;   // Marks objects in `heap`
+  // Marks and sweeps `heap` for full collections instead, when it has more
+  // than one thread. Incremental steps are always serial.
+  ParallelCollector parallel;
   size_t num_objects;
+  GcStats gc_stats;
 
-  Object *allocate(ObjectType type);
+  // A new object of `type`, which is to hold `first` and `second`. They are
+  // roots for any collection this sets off, and are updated if they move.
+  Object *allocate(ObjectType type, Object *&first, Object *&second);
   Object *new_pair(Object *head, Object *tail);
   Object *new_function();
   Object *new_closure(Object *fn, Object *env);
+  // CONS for the engines: pairs the top two slots of the register stack,
+  // whose size must be up to date, keeping a slot only if it holds an
+  // object.
+  Object *cons();
 
   void mark(Object *obj);
   void sweep();
   void gc();
+  // Promotes the nursery objects reachable from the register stack or from
+  // `first` and `second` to `heap`, updating the references to them, and
+  // empties the nursery. Returns true if that grew the heap enough to
+  // collect it as well, which it then has.
+  bool collect_nursery(Object *&first, Object *&second);
+  // One step of incremental collection, called by allocate(): for up to
+  // `gc_budget_us`, sweeps what the last cycle left, starts a cycle if the
+  // heap has doubled, or marks, ending the cycle if nothing is left to mark.
+  // The heap is then swept by later steps and by allocation. `first` and
+  // `second` are roots, as for allocate().
+  void gc_increment(Object *first, Object *second);
+  // Copies the objects reachable from the register stack or from `first`
+  // and `second` out of `from_space`, breadth first but with each list's
+  // pairs kept together, updating the references to them, and swaps the
+  // spaces. The new `to_space` is made as large as the new `from_space`, or
+  // twice as large if the survivors fill more than half of it.
+  void collect_semispace(Object *&first, Object *&second);
+  bool marking() const { return cycle; } // An incremental cycle is under way
+  // Stores `value` in `field` of a heap object. Nothing changes objects
+  // after they are made today; any code that does must come through here,
+  // so that incremental marking sees the new reference.
+  void write_field(Object *&field, Object *value) {
+    field = value;
+    if (cycle)
+      marker.shade(value);
+  }
+  unsigned long gc_budget_us; // Pause budget of an incremental step
+  // Collections only mark, and allocation sweeps `heap` a chunk at a time
+  // (Heap::sweep_lazily). num_objects is still exact.
+  bool lazy_sweep;
 
   void load(const std::string &filename);
   void run();
+  // Runs `body` on this VM, turning a push past the end of either stack
+  // into a "Stack Overflow" error (see region.hpp).
+  void guard_overflow(void (*body)(VM &));
   void run_debug(); // Main loop variant for debug mode
   void repl();      // Read-Eval-Print Loop for debug commands
   void step();      // Execute single instruction
+  bool run_threaded(); // Fast engine; false if stopped for the debugger
+  bool run_register(); // Register tier; false if stopped for the debugger
+  // Patches a breakpoint in at `addr`, replacing any already there. Throws
+  // std::runtime_error if no instruction starts there.
+  void set_breakpoint(unsigned long addr, const Breakpoint &bp = Breakpoint());
+  void clear_breakpoint(unsigned long addr);
+  // Watches writes to, or reads of, data memory word `index` by patching a
+  // break over every STORE or LOAD of it. Throws std::runtime_error if the
+  // index is outside data memory.
+  void set_watchpoint(unsigned long index, bool reads);
+  void clear_watchpoint(unsigned long index);
   void setVerbose(bool v);
   void printStack();
   void printStats();
   
   bool stats_requested;
+  bool sample_requested; // Set by SIGPROF (see sampler.hpp)
 
 private:
+  void interpret(); // The loop of run(), switching engines as needed
+  // Parse debugger arguments, throwing if they are invalid.
+  unsigned long code_address(const std::string &text);
+  unsigned long data_index(const std::string &text);
+  bool at_break() const {
+    long index = program.index_of(pc);
+    return index >= 0 && program.is_break(index);
+  }
+  // Whether the breakpoint at pc stops the program, counting it if so.
+  bool hit_breakpoint();
+  // The word the instruction at `index` accesses if it is watched, or -1.
+  long watched_word(unsigned long index) const;
+  // Patches breaks over all the watched LOADs and STOREs.
+  void patch_watchpoints();
+  // Reports the watched access the instruction at `index` just made to
+  // data memory word `word`, which held `before`, if it stops the program.
+  void hit_watchpoint(unsigned long index, long word, long before);
+  // Makes the engines see the current breakpoints and watchpoints.
+  void relink_breakpoints();
+  template <bool checked, Instrumentation instrument> bool run_threaded();
+  // The mature address of `obj`, copying it out of the nursery if it has
+  // not been yet.
+  Object *promote(Object *obj);
+  // As promote(), for collect_semispace(): the address of `obj` in
+  // `to_space`.
+  Object *evacuate(Object *obj);
+  // Marks from the register stack, `first` and `second`, and sweeps `heap`.
+  void collect_heap(Object *first, Object *second);
+  // Sweeps `heap` once marking is done and sets when to collect it next.
+  void finish_cycle();
+
+  std::vector<Object *> promoted; // Copies whose fields are yet to promote
+  // Mature objects at which the generational collector next sweeps `heap`,
+  // or the incremental one starts a cycle
+  size_t next_full = GC_HEAP_MIN;
+  bool cycle = false;            // See marking()
+  bool rescanned = false; // The cycle has shaded the roots a second time
+  unsigned long allocations = 0; // Since the last incremental step
 };
 
 void gc(VM &vm);
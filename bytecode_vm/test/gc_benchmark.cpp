@@ -1,6 +1,8 @@
 #include "../src/vm.hpp"
 #include <iostream>
+#include <algorithm>
 #include <chrono>
+#include <random>
 #include <vector>
 
 void run_benchmark() {
@@ -58,11 +60,338 @@ void run_benchmark() {
     } else {
         std::cout << "[FAILURE] Mismatch in freed objects." << std::endl;
     }
+
+    // 3. Reallocation Phase
+    // Allocate as many objects as were freed: they reuse the swept cells.
+    auto start_realloc = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < freed; ++i) {
+        vm.new_pair(nullptr, nullptr);
+    }
+    auto end_realloc = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> realloc_ms = end_realloc - start_realloc;
+    std::cout << "Reallocation Complete." << std::endl;
+    std::cout << "  Reallocated: " << freed << std::endl;
+    std::cout << "  Reallocation Time: " << realloc_ms.count() << " ms" << std::endl;
+    std::cout << "  Heap Chunks: " << vm.heap.chunk_count() << std::endl;
+}
+
+// Sweeps heaps of 10^4 to 10^7 pairs, 10% of them reachable, and reports
+// how many objects (live and dead) the sweep gets through per nanosecond.
+void run_sweep_benchmark() {
+    std::cout << "Sweep Throughput:" << std::endl;
+    for (size_t total_objects = 10000; total_objects <= 10000000; total_objects *= 10) {
+        VM vm;
+        for (size_t i = 0; i < total_objects; ++i) {
+            Object* obj = vm.new_pair(nullptr, nullptr);
+            if (i % 10 == 0) {
+                vm.register_stack.push((long)obj, true);
+            }
+        }
+        for (unsigned long i = 0; i < vm.register_stack.get_size(); ++i) {
+            vm.mark((Object*)vm.register_stack.get_item(i).value());
+        }
+
+        auto start_sweep = std::chrono::high_resolution_clock::now();
+        vm.sweep();
+        auto end_sweep = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> sweep_ns = end_sweep - start_sweep;
+
+        std::cout << "  " << total_objects << " objects: " << sweep_ns.count() / 1e6
+                  << " ms, " << total_objects / sweep_ns.count() << " objects/ns" << std::endl;
+        vm.register_stack.set_size(0);
+        vm.gc();
+    }
+}
+
+// Times a full collection of the object graph rooted at `root`, with and
+// without mark prefetching.
+void time_mark(const char* shape, VM& vm, Object* root) {
+    vm.register_stack.push((long)root, true);
+    for (bool prefetch : {false, true}) {
+        vm.marker.prefetch = prefetch;
+        auto start_gc = std::chrono::high_resolution_clock::now();
+        vm.gc();
+        auto end_gc = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> gc_ms = end_gc - start_gc;
+        std::cout << "  " << shape << (prefetch ? " (prefetch): " : ": ")
+                  << vm.num_objects << " objects, " << gc_ms.count() << " ms" << std::endl;
+    }
+    vm.register_stack.set_size(0);
+    vm.gc();
+}
+
+// Marks a 10^6 pair list and a 10^6 pair chain through heads, deeper than a
+// recursive marker could follow, and two binary trees of 2^20 - 1 pairs, one
+// with its nodes in allocation order and one in a random order. Only the
+// random tree misses the cache on most objects.
+void run_mark_benchmark() {
+    std::cout << "Mark Throughput:" << std::endl;
+    const size_t length = 1000000;
+    const size_t nodes = (1UL << 20) - 1;
+    {
+        VM vm;
+        Object* list = nullptr;
+        for (size_t i = 0; i < length; ++i) {
+            list = vm.new_pair(nullptr, list);
+        }
+        time_mark("Deep list", vm, list);
+    }
+    {
+        VM vm;
+        Object* nested = nullptr;
+        for (size_t i = 0; i < length; ++i) {
+            nested = vm.new_pair(nested, nullptr);
+        }
+        time_mark("Deep head chain", vm, nested);
+    }
+    for (bool shuffled : {false, true}) {
+        VM vm;
+        std::vector<Object*> cells(nodes);
+        for (size_t i = 0; i < nodes; ++i) {
+            cells[i] = vm.new_pair(nullptr, nullptr);
+        }
+        if (shuffled) {
+            std::shuffle(cells.begin(), cells.end(), std::mt19937(42));
+        }
+        // Node i has children 2i + 1 and 2i + 2.
+        for (size_t i = 0; 2 * i + 2 < nodes; ++i) {
+            cells[i]->pair.head = cells[2 * i + 1];
+            cells[i]->pair.tail = cells[2 * i + 2];
+        }
+        time_mark(shuffled ? "Random tree" : "Ordered tree", vm, cells[0]);
+    }
+}
+
+// A list program: builds a list of `live` pairs, then makes `allocations`
+// more pairs, of which every 100th joins the list and the rest die at once.
+// The mark-sweep collector is run every NURSERY_OBJECTS pairs, as often as
+// the generational one collects its nursery.
+void run_list_program(CollectorKind collector, size_t live, size_t allocations,
+                      unsigned long budget_us = GC_DEFAULT_BUDGET_US,
+                      bool lazy_sweep = false) {
+    VM vm;
+    vm.collector = collector;
+    vm.gc_budget_us = budget_us;
+    vm.lazy_sweep = lazy_sweep;
+    vm.register_stack.push(0, true);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < live + allocations; ++i) {
+        if (i < live || i % 100 == 0) {
+            Object* list = (Object*)vm.register_stack.pop_item().value();
+            vm.register_stack.push((long)vm.new_pair(nullptr, list), true);
+        } else {
+            vm.new_pair(nullptr, nullptr);
+        }
+        if (collector == COLLECTOR_MARK_SWEEP && (i + 1) % NURSERY_OBJECTS == 0) {
+            vm.gc();
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> total_ms = end - start;
+
+    const GcStats& stats = vm.gc_stats;
+    const char* names[] = {"mark-sweep:  ", "generational:", "incremental: "};
+    std::cout << "  " << live << " live, " << names[collector] << " ";
+    if (collector == COLLECTOR_INCREMENTAL) {
+        std::cout << "(" << budget_us << " us budget) ";
+    }
+    if (lazy_sweep) {
+        std::cout << "(lazy sweep) ";
+    }
+    std::cout << stats.minor.count() << " minor, " << stats.increments.count()
+              << " incremental, " << stats.full.count() << " full; pauses p50 "
+              << stats.pauses.percentile(0.5) << " us, p99 "
+              << stats.pauses.percentile(0.99) << " us, max " << stats.pauses.max()
+              << " us; " << (live + allocations) / total_ms.count() / 1000
+              << " M pairs/s" << std::endl;
+    vm.register_stack.set_size(0);
+    vm.gc();
+}
+
+// Pauses and allocation throughput of the collectors on list programs with
+// heaps of 10^4 to 10^6 live pairs, and of the incremental collector with
+// other pause budgets and on a heap of 3 * 10^6 live pairs, whose sweep alone
+// would take several budgets.
+void run_collector_benchmark() {
+    std::cout << "List Programs (5,000,000 pairs):" << std::endl;
+    for (size_t live = 10000; live <= 1000000; live *= 10) {
+        run_list_program(COLLECTOR_MARK_SWEEP, live, 5000000);
+        run_list_program(COLLECTOR_GENERATIONAL, live, 5000000);
+        run_list_program(COLLECTOR_INCREMENTAL, live, 5000000);
+    }
+    for (unsigned long budget : {100UL, 2000UL}) {
+        run_list_program(COLLECTOR_INCREMENTAL, 1000000, 5000000, budget);
+    }
+    run_list_program(COLLECTOR_INCREMENTAL, 3000000, 5000000);
+}
+
+// Collects heaps of 10^6 and 10^7 pairs, every 10th of them live, with the
+// sweep done in the pause and left to allocation, then allocates as many
+// pairs as died and finishes any sweep that is left.
+void run_lazy_sweep_benchmark() {
+    std::cout << "Lazy Sweep:" << std::endl;
+    for (size_t total_objects = 1000000; total_objects <= 10000000; total_objects *= 10) {
+        for (bool lazy : {false, true}) {
+            VM vm;
+            vm.lazy_sweep = lazy;
+            for (size_t i = 0; i < total_objects; ++i) {
+                Object* obj = vm.new_pair(nullptr, nullptr);
+                if (i % 10 == 0) {
+                    vm.register_stack.push((long)obj, true);
+                }
+            }
+            size_t dead = total_objects - vm.register_stack.get_size();
+            auto start_gc = std::chrono::high_resolution_clock::now();
+            vm.gc();
+            auto start_alloc = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < dead; ++i) {
+                vm.new_pair(nullptr, nullptr);
+            }
+            auto start_finish = std::chrono::high_resolution_clock::now();
+            vm.heap.finish_sweep();
+            auto end = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double, std::milli> gc_ms = start_alloc - start_gc;
+            std::chrono::duration<double, std::milli> alloc_ms = start_finish - start_alloc;
+            std::chrono::duration<double, std::milli> finish_ms = end - start_finish;
+            std::cout << "  " << total_objects << " objects" << (lazy ? ", lazy: " : ":       ")
+                      << "gc() " << gc_ms.count() << " ms, " << dead << " allocations "
+                      << alloc_ms.count() << " ms, finish " << finish_ms.count() << " ms"
+                      << std::endl;
+            vm.register_stack.set_size(0);
+            vm.gc();
+        }
+    }
+    for (CollectorKind collector : {COLLECTOR_MARK_SWEEP, COLLECTOR_INCREMENTAL}) {
+        for (bool lazy : {false, true}) {
+            run_list_program(collector, 1000000, 5000000, GC_DEFAULT_BUDGET_US, lazy);
+        }
+    }
+}
+
+// Marks and sweeps a heap of 4 * 2^20 - 1 live pairs, a binary tree in random
+// order, and as many garbage pairs, with 1, 2, 4 and 8 GC threads. 1 is the
+// serial collector. The garbage is made again before each collection.
+void run_parallel_benchmark() {
+    std::cout << "Parallel GC Scaling:" << std::endl;
+    const size_t nodes = (4UL << 20) - 1;
+    VM vm;
+    std::vector<Object*> cells(nodes);
+    for (size_t i = 0; i < nodes; ++i) {
+        cells[i] = vm.new_pair(nullptr, nullptr);
+    }
+    std::shuffle(cells.begin(), cells.end(), std::mt19937(42));
+    for (size_t i = 0; 2 * i + 2 < nodes; ++i) {
+        cells[i]->pair.head = cells[2 * i + 1];
+        cells[i]->pair.tail = cells[2 * i + 2];
+    }
+    Object* root = cells[0];
+    cells.clear();
+    vm.register_stack.push((long)root, true);
+    for (unsigned threads : {1, 2, 4, 8}) {
+        vm.parallel.set_threads(threads);
+        for (size_t i = 0; i < nodes; ++i) {
+            vm.new_pair(nullptr, nullptr);
+        }
+        auto start_mark = std::chrono::high_resolution_clock::now();
+        if (threads > 1) {
+            vm.parallel.mark({root});
+        } else {
+            vm.mark(root);
+        }
+        auto start_sweep = std::chrono::high_resolution_clock::now();
+        vm.sweep();
+        auto end_sweep = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> mark_ms = start_sweep - start_mark;
+        std::chrono::duration<double, std::milli> sweep_ms = end_sweep - start_sweep;
+        std::cout << "  " << threads << " thread" << (threads > 1 ? "s: " : ": ")
+                  << vm.num_objects << " objects, mark " << mark_ms.count()
+                  << " ms, sweep " << sweep_ms.count() << " ms, "
+                  << vm.parallel.steals << " steals" << std::endl;
+    }
+    vm.register_stack.set_size(0);
+    vm.gc();
+}
+
+// Nanoseconds per pair to walk the lists on the stack, best of 5 walks.
+double time_traversal(VM& vm) {
+    double best = 0;
+    for (int pass = 0; pass < 5; ++pass) {
+        size_t pairs = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (unsigned long i = 0; i < vm.register_stack.get_size(); ++i) {
+            for (Object* cur = (Object*)vm.register_stack.get_item(i).value(); cur;
+                 cur = cur->pair.tail) {
+                ++pairs;
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> ns = end - start;
+        if (pass == 0 || ns.count() / pairs < best) {
+            best = ns.count() / pairs;
+        }
+    }
+    return best;
+}
+
+// Walks 2^20 pairs of lists before and after a collection, under the
+// mark-sweep and semispace collectors. The lists are 8 lists built a pair
+// of each at a time, so that consecutive pairs of one list are 8 cells
+// apart, and one list whose pairs are linked in a random order.
+void run_locality_benchmark() {
+    std::cout << "List Traversal Locality (2^20 pairs):" << std::endl;
+    const size_t pairs = 1UL << 20;
+    for (bool shuffled : {false, true}) {
+        for (CollectorKind collector : {COLLECTOR_MARK_SWEEP, COLLECTOR_SEMISPACE}) {
+            VM vm;
+            vm.collector = collector;
+            if (collector == COLLECTOR_SEMISPACE) {
+                vm.from_space.resize(2 * pairs);
+                vm.to_space.resize(2 * pairs);
+            }
+            if (shuffled) {
+                std::vector<Object*> cells(pairs);
+                for (size_t i = 0; i < pairs; ++i) {
+                    cells[i] = vm.new_pair(nullptr, nullptr);
+                }
+                std::shuffle(cells.begin(), cells.end(), std::mt19937(42));
+                for (size_t i = 0; i + 1 < pairs; ++i) {
+                    cells[i]->pair.tail = cells[i + 1];
+                }
+                vm.register_stack.push((long)cells[0], true);
+            } else {
+                std::vector<Object*> lists(8, nullptr);
+                for (size_t i = 0; i < pairs; ++i) {
+                    lists[i % 8] = vm.new_pair(nullptr, lists[i % 8]);
+                }
+                for (Object* list : lists) {
+                    vm.register_stack.push((long)list, true);
+                }
+            }
+            double before = time_traversal(vm);
+            auto start_gc = std::chrono::high_resolution_clock::now();
+            vm.gc();
+            auto end_gc = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double, std::milli> gc_ms = end_gc - start_gc;
+            double after = time_traversal(vm);
+            std::cout << "  " << (shuffled ? "Random list, " : "8 interleaved lists, ")
+                      << (collector == COLLECTOR_SEMISPACE ? "semispace:  " : "mark-sweep: ")
+                      << before << " ns/pair before gc(), " << after << " ns/pair after; gc() "
+                      << gc_ms.count() << " ms" << std::endl;
+            vm.register_stack.set_size(0);
+            vm.gc();
+        }
+    }
 }
 
 int main() {
     try {
         run_benchmark();
+        run_sweep_benchmark();
+        run_mark_benchmark();
+        run_collector_benchmark();
+        run_parallel_benchmark();
+        run_lazy_sweep_benchmark();
+        run_locality_benchmark();
     } catch (const std::exception& e) {
         std::cerr << "Benchmark Failed: " << e.what() << std::endl;
         return 1;
@@ -0,0 +1,140 @@
+#include "../src/op_codes.hpp"
+#include "../src/vm.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Startup latency: time from VM::load() being called to the first
+// instruction running, for programs from 1 KB up. The program is a HALT
+// followed by PUSH/POP pairs, so run() stops on its first instruction and
+// the time is all loading, verifying, fusing and linking.
+//
+// Each size is timed with the file in the page cache ("warm") and with its
+// pages dropped first ("cold"), in each of the VM's load modes.
+//
+// Given files instead, it times those, warm and cold, in the default mode.
+// They should start with a HALT too (see benchmarks/container_benchmark.sh).
+
+static const unsigned long SIZES[] = {
+    1UL << 10,  4UL << 10,  16UL << 10, 64UL << 10,
+    160UL << 10, // The largest program the VM accepted when it copied
+    1UL << 20,  4UL << 20,  16UL << 20,
+};
+static const int RUNS = 15;
+
+static void write_program(const char *path, unsigned long bytes) {
+  std::vector<long> words(bytes / sizeof(long));
+  words[0] = HALT;
+  for (unsigned long i = 1; i + 2 < words.size(); i += 3) {
+    words[i] = PUSH;
+    words[i + 1] = (long)i;
+    words[i + 2] = POP;
+  }
+  for (unsigned long i = (words.size() - 1) / 3 * 3 + 1; i < words.size(); ++i)
+    words[i] = NOP;
+  FILE *file = fopen(path, "wb");
+  if (!file || fwrite(words.data(), sizeof(long), words.size(), file) !=
+                   words.size())
+    throw std::runtime_error(std::string("Could not write ") + path);
+  fclose(file);
+}
+
+// Evicts the file from the page cache, so the next load reads the disk.
+static void drop_cache(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error(std::string("Could not open ") + path);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static double time_load(const char *path, LoadMode mode, bool cold) {
+  std::vector<double> times;
+  std::ostringstream discard;
+  std::streambuf *out = std::cout.rdbuf(discard.rdbuf());
+  for (int i = 0; i < RUNS; ++i) {
+    VM vm;
+    vm.engine = ENGINE_THREADED;
+    vm.load_mode = mode;
+    if (cold)
+      drop_cache(path);
+    auto start = std::chrono::steady_clock::now();
+    vm.load(path);
+    vm.run();
+    auto end = std::chrono::steady_clock::now();
+    times.push_back(std::chrono::duration<double, std::micro>(end - start)
+                        .count());
+    discard.str("");
+  }
+  std::cout.rdbuf(out);
+  std::sort(times.begin(), times.end());
+  return times[RUNS / 2];
+}
+
+static void time_files(int count, char *files[]) {
+  std::cout << "Median microseconds from load() to the first instruction, "
+            << RUNS << " runs" << std::endl;
+  std::cout << std::left << std::setw(40) << "file" << std::right
+            << std::setw(12) << "bytes" << std::setw(12) << "warm"
+            << std::setw(12) << "cold" << std::endl;
+  for (int i = 0; i < count; ++i) {
+    struct stat info;
+    if (stat(files[i], &info) != 0)
+      throw std::runtime_error(std::string("Could not open ") + files[i]);
+    double warm = time_load(files[i], LOAD_LAZY, false);
+    double cold = time_load(files[i], LOAD_LAZY, true);
+    std::cout << std::left << std::setw(40) << files[i] << std::right
+              << std::setw(12) << info.st_size << std::setw(12) << std::fixed
+              << std::setprecision(1) << warm << std::setw(12) << cold
+              << std::endl;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    try {
+      time_files(argc - 1, argv + 1);
+    } catch (const std::exception &e) {
+      std::cerr << "Benchmark Failed: " << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  const char *path = "build/load_benchmark.bin";
+  const char *modes[] = {"lazy", "prefault", "advise"};
+  try {
+    std::cout << "Median microseconds from load() to the first instruction, "
+              << RUNS << " runs" << std::endl;
+    std::cout << std::setw(10) << "size";
+    for (const char *cache : {"warm", "cold"})
+      for (const char *mode : modes)
+        std::cout << std::setw(14) << (std::string(cache) + " " + mode);
+    std::cout << std::endl;
+    for (unsigned long size : SIZES) {
+      write_program(path, size);
+      std::cout << std::setw(8) << (size >> 10) << " K";
+      for (bool cold : {false, true})
+        for (int mode = LOAD_LAZY; mode <= LOAD_ADVISE; ++mode) {
+          double us = time_load(path, (LoadMode)mode, cold);
+          std::cout << std::setw(14) << std::fixed << std::setprecision(1)
+                    << us;
+        }
+      std::cout << std::endl;
+    }
+    unlink(path);
+  } catch (const std::exception &e) {
+    std::cerr << "Benchmark Failed: " << e.what() << std::endl;
+    unlink(path);
+    return 1;
+  }
+  return 0;
+}
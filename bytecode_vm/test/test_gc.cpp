@@ -1,6 +1,7 @@
 #include "../src/vm.hpp"
 #include <cassert>
 #include <iostream>
+#include <vector>
 
 #define VAL_OBJ(o) (o)
 
@@ -15,12 +16,10 @@ void test_basic_reachability() {
   vm.gc();
 
   bool found = false;
-  Object *curr = vm.heap_head;
-  while (curr) {
+  vm.heap.each([&](Object *curr) {
     if (curr == a)
       found = true;
-    curr = curr->next;
-  }
+  });
 
   assert(found && "Object a should survive");
   assert(vm.num_objects == 1 && "Heap count mismatch");
@@ -35,7 +34,7 @@ void test_unreachable() {
 
   vm.gc();
 
-  assert(vm.heap_head == nullptr && "Heap should be empty");
+  assert(vm.heap.chunk_count() == 0 && "Heap should be empty");
   assert(vm.num_objects == 0 && "Heap count mismatch");
   std::cout << "test_unreachable passed." << std::endl;
 }
@@ -121,6 +120,429 @@ void test_stress_allocation() {
   std::cout << "test_stress_allocation passed." << std::endl;
 }
 
+// A list of `length` pairs, built tail first.
+Object *build_list(VM &vm, int length) {
+  Object *list = nullptr;
+  for (int i = 0; i < length; ++i)
+    list = vm.new_pair(nullptr, list);
+  return list;
+}
+
+// A complete binary tree of pairs `depth` levels deep.
+Object *build_tree(VM &vm, int depth) {
+  if (depth == 0)
+    return nullptr;
+  Object *head = build_tree(vm, depth - 1);
+  Object *tail = build_tree(vm, depth - 1);
+  return vm.new_pair(head, tail);
+}
+
+void test_deep_list() {
+  std::cout << "Running test_deep_list..." << std::endl;
+  VM vm;
+  int length = 1000000;
+  push(vm, VAL_OBJ(build_list(vm, length)));
+  // The same depth through heads, which a recursive marker cannot follow
+  Object *nested = nullptr;
+  for (int i = 0; i < length; ++i)
+    nested = vm.new_pair(nested, nullptr);
+  push(vm, VAL_OBJ(nested));
+  vm.new_pair(nullptr, nullptr);
+
+  vm.gc();
+
+  assert(vm.num_objects == (size_t)length * 2 && "Both lists should survive");
+  assert(vm.marker.overflows == 0 && "The mark stack should not overflow");
+  std::cout << "test_deep_list passed." << std::endl;
+}
+
+void test_wide_tree() {
+  std::cout << "Running test_wide_tree..." << std::endl;
+  VM vm;
+  int depth = 17;
+  push(vm, VAL_OBJ(build_tree(vm, depth)));
+
+  vm.gc();
+
+  assert(vm.num_objects == (size_t)(1 << depth) - 1 &&
+         "The whole tree should survive");
+  std::cout << "test_wide_tree passed." << std::endl;
+}
+
+void test_mark_stack_overflow() {
+  std::cout << "Running test_mark_stack_overflow..." << std::endl;
+  VM vm;
+  vm.marker.limit = 4;
+  push(vm, VAL_OBJ(build_list(vm, 10000)));
+  push(vm, VAL_OBJ(build_tree(vm, 12)));
+  vm.new_pair(nullptr, nullptr);
+
+  vm.gc();
+
+  assert(vm.num_objects == 10000 + 4095 && "Everything reachable survives");
+  assert(vm.marker.overflows > 0 && "The mark stack should have overflowed");
+  std::cout << "test_mark_stack_overflow passed." << std::endl;
+}
+
+void test_prefetching_mark() {
+  std::cout << "Running test_prefetching_mark..." << std::endl;
+  VM vm;
+  vm.marker.prefetch = true;
+  Object *fn = vm.new_function();
+  push(vm, VAL_OBJ(vm.new_closure(fn, build_list(vm, 5000))));
+  push(vm, VAL_OBJ(build_tree(vm, 10)));
+  build_list(vm, 100);
+
+  vm.gc();
+  assert(vm.num_objects == 2 + 5000 + 1023 && "Reachable objects survive");
+
+  vm.marker.limit = 4;
+  vm.gc();
+  assert(vm.num_objects == 2 + 5000 + 1023 &&
+         "Reachable objects survive an overflowing prefetching mark");
+  std::cout << "test_prefetching_mark passed." << std::endl;
+}
+
+void test_generational_promotion() {
+  std::cout << "Running test_generational_promotion..." << std::endl;
+  VM vm;
+  vm.collector = COLLECTOR_GENERATIONAL;
+  vm.nursery.resize(64);
+  Object *kept = vm.new_pair(nullptr, nullptr);
+  push(vm, VAL_OBJ(kept));
+  push(vm, VAL_OBJ(vm.new_pair(vm.new_pair(nullptr, nullptr), nullptr)));
+  assert(vm.nursery.contains(kept) && "New objects start in the nursery");
+
+  for (int i = 0; i < 200; ++i)
+    vm.new_pair(nullptr, nullptr);
+
+  assert(vm.gc_stats.minor.count() == 3 && "A full nursery should be collected");
+  assert(vm.gc_stats.promoted == 3 && "Only the reachable objects move");
+  assert(vm.num_objects == 3 + vm.nursery.size() && "Garbage was not freed");
+  Object *moved = (Object *)vm.register_stack.get_item(0).value();
+  Object *outer = (Object *)vm.register_stack.get_item(1).value();
+  assert(moved != kept && vm.heap.contains(moved) && vm.heap.contains(outer) &&
+         "Roots should point at the promoted copies");
+  assert(vm.heap.contains(outer->pair.head) &&
+         outer->pair.head->type == OBJ_PAIR && !outer->pair.tail &&
+         "Fields should point at the promoted copies");
+  std::cout << "test_generational_promotion passed." << std::endl;
+}
+
+void test_generational_list() {
+  std::cout << "Running test_generational_list..." << std::endl;
+  VM vm;
+  vm.collector = COLLECTOR_GENERATIONAL;
+  vm.nursery.resize(999); // Odd, so both calls fill it in turn
+  // The list is kept on the stack, except while new_pair allocates its next
+  // pair: then it is only reachable through new_pair's arguments.
+  int length = 100000;
+  push(vm, nullptr);
+  for (int i = 0; i < length; ++i) {
+    vm.new_pair(nullptr, nullptr);
+    Object *list = (Object *)vm.register_stack.pop_item().value();
+    push(vm, VAL_OBJ(vm.new_pair(nullptr, list)));
+  }
+  assert(vm.gc_stats.full.count() > 0 && "The mature heap should have been collected");
+
+  unsigned long full = vm.gc_stats.full.count();
+  vm.gc();
+
+  assert(vm.gc_stats.full.count() == full + 1 &&
+         "gc() should collect the heap once");
+  assert(vm.num_objects == (size_t)length && "The whole list should survive");
+  assert(vm.nursery.size() == 0 && "gc() should empty the nursery");
+  int count = 0;
+  for (Object *cur = (Object *)vm.register_stack.get_item(0).value(); cur;
+       cur = cur->pair.tail) {
+    assert(vm.heap.contains(cur) && "List pairs should be mature");
+    ++count;
+  }
+  assert(count == length && "The list should be intact");
+
+  vm.register_stack.pop();
+  vm.gc();
+  assert(vm.num_objects == 0 && vm.heap.chunk_count() == 0 &&
+         "Promoted garbage should be swept");
+
+  // Promoting a full nursery of live pairs fills the heap to its threshold,
+  // so the minor collection in gc() already collects it.
+  vm.nursery.resize(GC_HEAP_MIN);
+  push(vm, VAL_OBJ(build_list(vm, GC_HEAP_MIN)));
+  full = vm.gc_stats.full.count();
+  vm.gc();
+  assert(vm.gc_stats.full.count() == full + 1 &&
+         "gc() should not collect the heap twice");
+  assert(vm.num_objects == GC_HEAP_MIN && "The whole list should survive");
+  vm.register_stack.pop();
+  vm.gc();
+  std::cout << "test_generational_list passed." << std::endl;
+}
+
+void test_incremental_list() {
+  std::cout << "Running test_incremental_list..." << std::endl;
+  VM vm;
+  vm.collector = COLLECTOR_INCREMENTAL;
+  vm.gc_budget_us = 1; // One slice per step
+  int length = 200000;
+  push(vm, nullptr);
+  for (int i = 0; i < length; ++i) {
+    vm.new_pair(nullptr, nullptr);
+    Object *list = (Object *)vm.register_stack.pop_item().value();
+    push(vm, VAL_OBJ(vm.new_pair(nullptr, list)));
+  }
+  assert(vm.gc_stats.increments.count() > 10 &&
+         vm.gc_stats.full.count() == 0 && "Marking should be incremental");
+  assert(vm.num_objects < (size_t)length * 2 && "Garbage should be swept");
+
+  vm.gc();
+
+  assert(!vm.marking() && "gc() should finish the cycle");
+  assert(vm.num_objects == (size_t)length && "The whole list should survive");
+  int count = 0;
+  for (Object *cur = (Object *)vm.register_stack.get_item(0).value(); cur;
+       cur = cur->pair.tail)
+    ++count;
+  assert(count == length && "The list should be intact");
+  std::cout << "test_incremental_list passed." << std::endl;
+}
+
+void test_incremental_barrier() {
+  std::cout << "Running test_incremental_barrier..." << std::endl;
+  VM vm;
+  vm.collector = COLLECTOR_INCREMENTAL;
+  vm.gc_budget_us = 1;
+  push(vm, VAL_OBJ(build_list(vm, 20000)));
+  Object *holder = vm.new_pair(nullptr, nullptr);
+  push(vm, VAL_OBJ(holder)); // On top, so it is blackened first
+  Object *hidden = build_list(vm, 5000);
+
+  vm.gc_increment(nullptr, nullptr);
+  assert(vm.marking() && vm.heap.is_marked(holder) &&
+         !vm.heap.is_marked(hidden) && "The step should stop mid-cycle");
+  // A black object now points at a white one.
+  vm.write_field(holder->pair.head, hidden);
+  vm.new_pair(nullptr, nullptr); // Allocated black
+  while (vm.marking())
+    vm.gc_increment(nullptr, nullptr);
+
+  assert(vm.num_objects == 20000 + 1 + 5000 + 1 &&
+         "Objects stored during marking should survive");
+  std::cout << "test_incremental_barrier passed." << std::endl;
+}
+
+void test_incremental_pause() {
+  std::cout << "Running test_incremental_pause..." << std::endl;
+  VM vm;
+  vm.collector = COLLECTOR_INCREMENTAL;
+  vm.gc_budget_us = 0; // One slice or one chunk per step
+  int live = 200000;
+  push(vm, nullptr);
+  for (int i = 0; i < live; ++i) {
+    vm.new_pair(nullptr, nullptr);
+    Object *list = (Object *)vm.register_stack.pop_item().value();
+    push(vm, VAL_OBJ(vm.new_pair(nullptr, list)));
+  }
+  while (vm.marking() || vm.heap.sweeping())
+    vm.gc_increment(nullptr, nullptr);
+
+  // A cycle started by hand marks at most two slices a step, the second
+  // after the final root scan.
+  vm.gc_increment(nullptr, nullptr);
+  int steps = 1;
+  while (vm.marking()) {
+    unsigned long chunks = vm.heap.chunk_count();
+    vm.gc_increment(nullptr, nullptr);
+    ++steps;
+    assert(vm.heap.chunk_count() == chunks &&
+           "Marking steps should not sweep");
+  }
+  assert(steps >= live / (2 * GC_MARK_SLICE) && "A step marked too much");
+  assert(vm.num_objects == (size_t)live && "The cycle should count the list");
+  // The step that ends the cycle leaves the sweep to the steps after it,
+  // which sweep a chunk each.
+  unsigned long chunks = vm.heap.chunk_count();
+  assert(chunks > 1 && vm.heap.sweeping() && "The sweep should be deferred");
+  steps = 0;
+  while (vm.heap.sweeping()) {
+    vm.gc_increment(nullptr, nullptr);
+    ++steps;
+  }
+  assert(steps >= (int)chunks && "A step swept more than one chunk");
+  assert(vm.num_objects == (size_t)live && "The whole list should survive");
+  std::cout << "test_incremental_pause passed." << std::endl;
+}
+
+void test_pause_histogram() {
+  std::cout << "Running test_pause_histogram..." << std::endl;
+  PauseHistogram pauses;
+  assert(pauses.percentile(0.5) == 0 && "An empty histogram has no pauses");
+  for (unsigned long us = 1; us <= 100; ++us)
+    pauses.record(us * 1000);
+  assert(pauses.count() == 100 && pauses.max() == 100 &&
+         pauses.total() == 5050 && "Wrong totals");
+  assert(pauses.percentile(0.5) >= 50 && pauses.percentile(0.5) < 50 * 1.125 &&
+         "p50 should be within a bucket of 50 us");
+  assert(pauses.percentile(0.99) >= 99 && pauses.percentile(0.99) <= 100 &&
+         "p99 should be capped by the longest pause");
+  std::cout << "test_pause_histogram passed." << std::endl;
+}
+
+// A random graph of `count` objects, each pointing at earlier ones, with
+// every tenth pushed as a root. Returns the objects in allocation order.
+std::vector<Object *> build_graph(VM &vm, int count, unsigned seed) {
+  std::vector<Object *> objects;
+  for (int i = 0; i < count; ++i) {
+    seed = seed * 1103515245 + 12345;
+    Object *head = i && seed % 3 ? objects[(seed >> 8) % i] : nullptr;
+    Object *tail = i && seed % 5 ? objects[(seed >> 16) % i] : nullptr;
+    if (seed % 7 == 0)
+      objects.push_back(vm.new_closure(vm.new_function(), tail));
+    else
+      objects.push_back(vm.new_pair(head, tail));
+    if (seed % 10 == 0)
+      push(vm, VAL_OBJ(objects.back()));
+  }
+  return objects;
+}
+
+void test_parallel_matches_serial() {
+  std::cout << "Running test_parallel_matches_serial..." << std::endl;
+  VM serial;
+  std::vector<Object *> expected = build_graph(serial, 50000, 7);
+  serial.register_stack.set_size(serial.register_stack.get_size() / 2);
+  serial.gc();
+
+  for (unsigned threads : {2, 4}) {
+    VM vm;
+    vm.parallel.set_threads(threads);
+    std::vector<Object *> objects = build_graph(vm, 50000, 7);
+    vm.register_stack.set_size(vm.register_stack.get_size() / 2);
+    vm.gc();
+    assert(vm.num_objects == serial.num_objects &&
+           "Parallel and serial collections should keep as many objects");
+    for (size_t i = 0; i < objects.size(); ++i)
+      assert(vm.heap.contains(objects[i]) ==
+                 serial.heap.contains(expected[i]) &&
+             "Parallel and serial collections should keep the same objects");
+
+    push(vm, VAL_OBJ(build_list(vm, 200000)));
+    push(vm, VAL_OBJ(build_tree(vm, 15)));
+    size_t live = vm.num_objects;
+    build_tree(vm, 12);
+    vm.gc();
+    assert(vm.num_objects == live && "Reachable objects survive, no others");
+    vm.register_stack.set_size(0);
+    vm.gc();
+    assert(vm.num_objects == 0 && vm.heap.chunk_count() == 0 &&
+           "An unrooted heap should be emptied");
+  }
+  std::cout << "test_parallel_matches_serial passed." << std::endl;
+}
+
+void test_lazy_sweep() {
+  std::cout << "Running test_lazy_sweep..." << std::endl;
+  VM vm;
+  vm.lazy_sweep = true;
+  Object *garbage = build_list(vm, 100000);
+  push(vm, VAL_OBJ(build_list(vm, 100000)));
+  unsigned long chunks = vm.heap.chunk_count();
+
+  vm.gc();
+
+  assert(vm.num_objects == 100000 && "The count is exact before sweeping");
+  assert(vm.heap.sweeping() && vm.heap.chunk_count() == chunks &&
+         "gc() should leave the sweep to allocation");
+  assert(!vm.heap.contains(garbage) && "Unmarked objects are already dead");
+  int seen = 0;
+  vm.heap.each([&](Object *) { ++seen; });
+  assert(seen == 100000 && "each() should skip unswept dead objects");
+
+  Object *reused = vm.new_pair(nullptr, nullptr);
+  assert(vm.heap.lazily_swept == 1 && "Allocation sweeps one chunk");
+  assert(chunk_of(reused) == vm.heap.first_chunk() &&
+         "The first free cell is in the first chunk");
+  build_list(vm, 1000);
+  Object *list = (Object *)vm.register_stack.get_item(0).value();
+  int count = 0;
+  for (Object *cur = list; cur; cur = cur->pair.tail)
+    ++count;
+  assert(count == 100000 && "Allocation must not reuse live cells");
+
+  vm.gc(); // Finishes the sweep before marking
+  assert(vm.num_objects == 100000 &&
+         "Objects allocated during a lazy sweep are collected as usual");
+  vm.heap.finish_sweep();
+  assert(!vm.heap.sweeping() && vm.heap.chunk_count() < chunks &&
+         "finish_sweep() unmaps the chunks left empty");
+
+  // Under the incremental collector, cycles start as allocation demands.
+  VM incremental;
+  incremental.collector = COLLECTOR_INCREMENTAL;
+  incremental.lazy_sweep = true;
+  push(incremental, nullptr);
+  for (int i = 0; i < 200000; ++i) {
+    incremental.new_pair(nullptr, nullptr);
+    Object *list = (Object *)incremental.register_stack.pop_item().value();
+    push(incremental, VAL_OBJ(incremental.new_pair(nullptr, list)));
+  }
+  assert(incremental.heap.lazily_swept > 0 && "Allocation should sweep");
+  incremental.gc();
+  assert(incremental.num_objects == 200000 && "The whole list should survive");
+  std::cout << "test_lazy_sweep passed." << std::endl;
+}
+
+void test_semispace() {
+  std::cout << "Running test_semispace..." << std::endl;
+  VM vm;
+  vm.collector = COLLECTOR_SEMISPACE;
+  vm.from_space.resize(1000);
+  vm.to_space.resize(1000);
+  // Two lists built a pair of each at a time, so their pairs alternate.
+  Object *odd = nullptr, *even = nullptr;
+  for (int i = 0; i < 300; ++i) {
+    odd = vm.new_pair(nullptr, odd);
+    even = vm.new_pair(nullptr, even);
+  }
+  Object *a = vm.new_pair(nullptr, nullptr);
+  a->pair.tail = vm.new_pair(a, nullptr); // A cycle
+  push(vm, VAL_OBJ(odd));
+  push(vm, VAL_OBJ(vm.new_closure(vm.new_function(), a)));
+  push(vm, VAL_OBJ(even));
+
+  vm.gc();
+
+  assert(vm.num_objects == 600 + 4 && "Only reachable objects are copied");
+  Object *list = (Object *)vm.register_stack.get_item(0).value();
+  assert(list != odd && vm.from_space.contains(list) &&
+         "Roots should point at the copies");
+  int count = 0;
+  for (Object *cur = list; cur; cur = cur->pair.tail, ++count)
+    assert(cur == list + count && "A list is copied into consecutive cells");
+  assert(count == 300 && "The list should be intact");
+  Object *closure = (Object *)vm.register_stack.get_item(1).value();
+  Object *copy = closure->closure.env;
+  assert(closure->type == OBJ_CLOSURE &&
+         closure->closure.fn->type == OBJ_FUNCTION &&
+         copy->pair.tail->pair.head == copy && "The cycle should be kept");
+  assert(vm.to_space.capacity() == 2000 &&
+         "A space more than half full grows for the next collection");
+
+  // The survivors do not leave room for the next pair, so allocation
+  // collects again into the larger space.
+  for (int i = 0; i < 1000; ++i) {
+    Object *list = (Object *)vm.register_stack.pop_item().value();
+    push(vm, VAL_OBJ(vm.new_pair(nullptr, list)));
+  }
+  assert(vm.from_space.capacity() >= 2000 && "The spaces should have grown");
+  vm.gc();
+  assert(vm.num_objects == 1600 + 4 && "The grown list should survive");
+  vm.register_stack.set_size(0);
+  vm.gc();
+  assert(vm.num_objects == 0 && "An unrooted space should be emptied");
+  std::cout << "test_semispace passed." << std::endl;
+}
+
 int main() {
   try {
     test_basic_reachability();
@@ -130,6 +552,19 @@ int main() {
     test_deep_graph();
     test_closure_capture();
     test_stress_allocation();
+    test_deep_list();
+    test_wide_tree();
+    test_mark_stack_overflow();
+    test_prefetching_mark();
+    test_generational_promotion();
+    test_generational_list();
+    test_incremental_list();
+    test_incremental_barrier();
+    test_incremental_pause();
+    test_pause_histogram();
+    test_parallel_matches_serial();
+    test_lazy_sweep();
+    test_semispace();
     std::cout << "All GC tests passed!" << std::endl;
   } catch (const std::exception &e) {
     std::cerr << "Test Failed: " << e.what() << std::endl;
@@ -43,11 +43,22 @@ void test_memory_reset() {
   std::cout << "test_memory_reset passed" << std::endl;
 }
 
+void test_memory_resize() {
+  Memory mem(10);
+  assert(mem.size() == 10 && "Memory has the wrong size");
+  mem.store(9, 300);
+  assert(mem.get(9) == 300 && "Memory store/get failed at last address");
+  assert(!mem.is_valid_address(10) && "Address past the end is valid");
+  mem.resize(20);
+  assert(mem.size() == 20 && mem.get(9) == 0 && "Resized memory not zeroed");
+  std::cout << "test_memory_resize passed" << std::endl;
+}
 
 int main() {
   test_memory_init();
   test_memory_store_get();
   test_memory_load();
   test_memory_reset();
+  test_memory_resize();
   return 0;
 }
@@ -56,11 +56,68 @@ void test_stack_underflow() {
   std::cout << "test_stack_underflow passed" << std::endl;
 }
 
+void test_tagged_items() {
+  assert(sizeof(StackItem) == sizeof(long));
+  Stack s;
+  long object = 0x7f0012345670L; // Any user space address
+  s.push(-5);
+  s.push(object, true);
+  assert(s.peek_item().is_obj() && s.peek_item().value() == object);
+  s.dup();
+  assert(s.pop_item().is_obj());
+  assert(s.pop() == object);
+  StackItem item = s.pop_item();
+  assert(!item.is_obj() && item.value() == -5);
+
+  // Values are 63 bits wide and wrap like the arithmetic on them.
+  long max = (1L << 62) - 1;
+  assert(wrap_value(max) == max);
+  assert(wrap_value(max + 1) == -max - 1);
+  s.push(max + 1);
+  assert(s.pop() == -max - 1);
+
+  // Arithmetic on tagged words matches arithmetic on the values, objects
+  // included.
+  long obj = StackItem::tag(object, true), five = StackItem::tag(5);
+  assert(tagged_add(obj, five) == StackItem::tag(object + 5));
+  assert(tagged_sub(five, obj) == StackItem::tag(5 - object));
+  assert(tagged_mul(obj, five) == StackItem::tag(object * 5));
+  assert(tagged_xor(obj, five) == StackItem::tag(object ^ 5));
+  assert(tagged_add(StackItem::tag(max), StackItem::tag(1)) ==
+         StackItem::tag(-max - 1));
+  std::cout << "test_tagged_items passed" << std::endl;
+}
+
+void test_stack_capacity() {
+  Stack s(100);
+  assert(s.capacity() == 100);
+  for (int i = 0; i < 100; ++i) {
+    s.push(i);
+  }
+  assert(s.is_full() == true);
+  s.resize(5);
+  assert(s.is_empty() == true && s.capacity() == 5);
+
+  // The slot past the end is a guard page, which a GuardScope catches.
+  sigjmp_buf overflow;
+  GuardScope guard(overflow, {&s.region()});
+  volatile bool caught = false;
+  if (sigsetjmp(overflow, 0) == 0) {
+    s.base()[5].bits = 0;
+  } else {
+    caught = guard.region() == &s.region();
+  }
+  assert(caught == true);
+  std::cout << "test_stack_capacity passed" << std::endl;
+}
+
 int main() {
   test_push_pop();
   test_is_empty_full();
   test_stack_overflow();
   test_stack_underflow();
+  test_stack_capacity();
+  test_tagged_items();
   std::cout << "All Stack tests passed!" << std::endl;
   return 0;
 }
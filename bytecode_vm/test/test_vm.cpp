@@ -1,10 +1,16 @@
+#include "../src/op_codes.hpp"
 #include "../src/vm.hpp"
 #include <cassert>
+#include <csignal>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <tuple>
 #include <vector>
 
+#include <sys/time.h>
+
 // Helper function to create a bytecode file with long values
 void create_bytecode_file(const std::string &filename,
                           const std::vector<long> &bytecode) {
@@ -52,11 +58,1012 @@ void test_vm_store_load_halt() {
   remove(test_file.c_str()); // Clean up
 }
 
+void test_vm_threaded_loop() {
+  std::cout << "Running test_vm_threaded_loop..." << std::endl;
+  std::string test_file = "test_threaded_loop.bin";
+  // PUSH 5, loop: DUP, JZ end, PUSH 1, SUB, JMP loop, end: HALT
+  create_bytecode_file(test_file,
+                       {0x01, 5, 0x03, 0x21, 10, 0x01, 1, 0x11, 0x20, 2, 0xFF});
+
+  VM vm;
+  vm.engine = ENGINE_THREADED;
+  vm.load(test_file);
+  vm.run();
+
+  assert(vm.register_stack.pop() == 0 && "Threaded loop did not count down to 0");
+  assert(vm.register_stack.is_empty() && "Register stack not empty after test");
+  assert(vm.pc == 11 && "PC should point past HALT");
+  std::cout << "test_vm_threaded_loop passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_threaded_error() {
+  std::cout << "Running test_vm_threaded_error..." << std::endl;
+  std::string test_file = "test_threaded_error.bin";
+  // PUSH 1, PUSH 0, DIV, HALT
+  create_bytecode_file(test_file, {0x01, 1, 0x01, 0, 0x13, 0xFF});
+
+  VM vm;
+  vm.engine = ENGINE_THREADED;
+  vm.load(test_file);
+  bool caught = false;
+  try {
+    vm.run();
+  } catch (const std::runtime_error &e) {
+    caught = std::string(e.what()) == "VM Runtime Error: Division by zero.";
+  }
+  assert(caught && "Threaded engine did not report division by zero");
+  std::cout << "test_vm_threaded_error passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_fusion() {
+  std::cout << "Running test_vm_fusion..." << std::endl;
+  std::string test_file = "test_fusion.bin";
+  //  0: PUSH 3      2: STORE 0
+  //  4: LOAD 0      6: JZ 24
+  //  8: LOAD 1     10: PUSH 5     12: ADD     13: STORE 1
+  // 15: LOAD 0     17: PUSH 1     19: SUB     20: STORE 0     22: JMP 4
+  // 24: LOAD 1     26: HALT
+  create_bytecode_file(test_file, {0x01, 3,    0x30, 0,    0x31, 0,    0x21,
+                                   24,   0x31, 1,    0x01, 5,    0x10, 0x30,
+                                   1,    0x31, 0,    0x01, 1,    0x11, 0x30,
+                                   0,    0x20, 4,    0x31, 1,    0xFF});
+
+  VM vm;
+  vm.engine = ENGINE_THREADED;
+  vm.load(test_file);
+  assert(vm.program.at(vm.program.index_of(4)).exec == OP_LOAD_JZ &&
+         "LOAD; JZ was not fused");
+  assert(vm.program.at(vm.program.index_of(8)).exec ==
+             OP_LOAD_PUSH_ADD_STORE &&
+         "LOAD; PUSH; ADD; STORE was not fused");
+  assert(vm.program.at(vm.program.index_of(17)).exec == OP_PUSH_SUB &&
+         "PUSH; SUB inside a fused sequence was not fused");
+  assert(vm.program.at(vm.program.index_of(10)).op == PUSH &&
+         "Fusion must not change the instructions as written");
+  vm.run();
+  assert(vm.register_stack.pop() == 15 && "Fused loop computed wrong value");
+  assert(vm.register_stack.is_empty() && "Register stack not empty after test");
+
+  VM plain;
+  plain.engine = ENGINE_THREADED;
+  plain.fusion = false;
+  plain.load(test_file);
+  assert(plain.program.at(plain.program.index_of(4)).exec == LOAD &&
+         "Fusion should be off");
+  plain.run();
+  assert(plain.register_stack.pop() == 15 && "Unfused loop computed wrong value");
+  std::cout << "test_vm_fusion passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+// Loads `bytecode` and returns the load error, or "" if it loaded.
+std::string load_error(const std::vector<long> &bytecode) {
+  std::string test_file = "test_load_error.bin";
+  create_bytecode_file(test_file, bytecode);
+  std::string error;
+  VM vm;
+  try {
+    vm.load(test_file);
+  } catch (const std::runtime_error &e) {
+    error = e.what();
+  }
+  remove(test_file.c_str()); // Clean up
+  return error;
+}
+
+void test_vm_load_validation() {
+  std::cout << "Running test_vm_load_validation..." << std::endl;
+
+  assert(load_error({0x01, 1, 0xFF}) == "" && "Valid program was rejected");
+  assert(load_error({0x01, 1, 0x77, 0xFF}) ==
+             "VM Load Error: Unknown opcode 119 at address 2." &&
+         "Unknown opcode not rejected");
+  assert(load_error({0x01, 1, 0x01}) ==
+             "VM Load Error: Missing operand for PUSH at address 2." &&
+         "Truncated operand not rejected");
+  assert(load_error({0x01, 1, 0x20, 1, 0xFF}) ==
+             "VM Load Error: JMP at address 2 targets 1, which is not the "
+             "start of an instruction." &&
+         "Jump into an operand not rejected");
+  assert(load_error({0x40, 99, 0xFF}) ==
+             "VM Load Error: CALL at address 0 targets 99, which is not the "
+             "start of an instruction." &&
+         "Call outside the program not rejected");
+  assert(load_error({0x01, 1, 0x30, MEM_SIZE, 0xFF}) ==
+             "VM Load Error: STORE uses invalid memory index " +
+                 std::to_string(MEM_SIZE) + " at address 2." &&
+         "Out of range STORE not rejected");
+  assert(load_error({0x31, -1, 0xFF}) ==
+             "VM Load Error: LOAD uses invalid memory index -1 at address 0." &&
+         "Negative LOAD index not rejected");
+
+  std::cout << "test_vm_load_validation passed" << std::endl;
+}
+
+void test_vm_register() {
+  std::cout << "Running test_vm_register..." << std::endl;
+  std::string test_file = "test_register.bin";
+  // mem[0] = 3; while (mem[0]) { mem[0] -= 1; mem[1] += 10; } push mem[1]
+  create_bytecode_file(test_file,
+                       {PUSH, 3, STORE, 0, LOAD, 0, JZ, 24, LOAD, 0, PUSH, 1,
+                        SUB, STORE, 0, LOAD, 1, PUSH, 10, ADD, STORE, 1, JMP,
+                        4, LOAD, 1, HALT});
+
+  VM vm;
+  vm.engine = ENGINE_REGISTER;
+  vm.load(test_file);
+  vm.run();
+
+  assert(vm.register_stack.pop() == 30 && "Register tier computed wrong sum");
+  assert(vm.register_stack.is_empty() && "Register stack not empty after test");
+  assert(vm.pc == 27 && "PC should point past HALT");
+  assert(!vm.register_code.empty() && "Program was not translated");
+
+  // A block that would underflow is handed to the stack interpreter, so its
+  // PEEKPRINT still runs before the error is reported.
+  // PUSH 1, PEEKPRINT, ADD, HALT
+  create_bytecode_file(test_file, {PUSH, 1, PEEKPRINT, ADD, HALT});
+  VM underflow;
+  underflow.engine = ENGINE_REGISTER;
+  underflow.load(test_file);
+  bool caught = false;
+  try {
+    underflow.run();
+  } catch (const std::runtime_error &e) {
+    caught = std::string(e.what()) == "Stack Underflow";
+  }
+  assert(caught && "Register tier did not report stack underflow");
+  std::cout << "test_vm_register passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_jit() {
+  std::cout << "Running test_vm_jit..." << std::endl;
+  std::string test_file = "test_jit.bin";
+  // Same loop as test_vm_register, compiled on its first iteration.
+  create_bytecode_file(test_file,
+                       {PUSH, 3, STORE, 0, LOAD, 0, JZ, 24, LOAD, 0, PUSH, 1,
+                        SUB, STORE, 0, LOAD, 1, PUSH, 10, ADD, STORE, 1, JMP,
+                        4, LOAD, 1, HALT});
+
+  VM vm;
+  vm.engine = ENGINE_THREADED;
+  vm.jit_code.threshold = 1;
+  vm.load(test_file);
+  vm.run();
+
+  assert(vm.register_stack.pop() == 30 && "JIT computed wrong sum");
+  assert(vm.register_stack.is_empty() && "Register stack not empty after test");
+  assert(vm.pc == 27 && "PC should point past HALT");
+  assert(vm.jit_code.regions == (Jit::supported() ? 1u : 0u) &&
+         "Loop was not compiled");
+
+  // mem[0] = 3; while (mem[0]) { mem[1] = 10 / (mem[0] - 1); mem[0] -= 1; }
+  // divides by zero on the third iteration. Compiled code hands the DIV back
+  // to the interpreter, so the error and the state it leaves match --no-jit.
+  create_bytecode_file(test_file,
+                       {PUSH, 3, STORE, 0, LOAD, 0, JZ, 27, PUSH, 10, LOAD, 0,
+                        PUSH, 1, SUB, DIV, STORE, 1, LOAD, 0, PUSH, 1, SUB,
+                        STORE, 0, JMP, 4, HALT});
+  std::string errors[2];
+  VM runs[2];
+  for (int jit = 0; jit < 2; ++jit) {
+    runs[jit].engine = ENGINE_THREADED;
+    runs[jit].jit = jit;
+    runs[jit].jit_code.threshold = 1;
+    runs[jit].load(test_file);
+    try {
+      runs[jit].run();
+    } catch (const std::runtime_error &e) {
+      errors[jit] = e.what();
+    }
+  }
+  assert(errors[1] == "VM Runtime Error: Division by zero." &&
+         "JIT did not report division by zero");
+  assert(errors[0] == errors[1] && runs[0].pc == runs[1].pc &&
+         runs[0].register_stack.get_size() ==
+             runs[1].register_stack.get_size() &&
+         runs[0].data_memory.get(1) == runs[1].data_memory.get(1) &&
+         "JIT left a different state behind after an error");
+  std::cout << "test_vm_jit passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_verifier() {
+  std::cout << "Running test_vm_verifier..." << std::endl;
+  std::string test_file = "test_verifier.bin";
+  // 0: PUSH 2   2: CALL 5   4: HALT   5: DUP   6: MUL   7: RET
+  create_bytecode_file(test_file, {PUSH, 2, CALL, 5, HALT, DUP, MUL, RET});
+
+  VM vm;
+  vm.engine = ENGINE_THREADED;
+  vm.load(test_file);
+  assert(vm.verification.verified && "Square function was not verified");
+  assert(vm.verification.max_depth == 2 && vm.verification.max_calls == 1 &&
+         "Wrong stack bounds");
+  assert(vm.verification.depth[vm.program.index_of(6)] == 1 &&
+         "Depths inside a function are relative to its entry");
+  vm.run();
+  assert(vm.unchecked && "Verified program did not run unchecked");
+  assert(vm.register_stack.pop() == 4 && "Unchecked run computed wrong value");
+
+  // Unverifiable programs still get their errors from the checked engine.
+  struct {
+    std::vector<long> bytecode;
+    std::string reason;
+    std::string error;
+  } rejected[] = {
+      // 0: CALL 2   2: CALL 2
+      {{CALL, 2, CALL, 2}, "recursive CALL to address 2", "Stack Overflow"},
+      // 0: PUSH 1   2: JMP 0
+      {{PUSH, 1, JMP, 0},
+       "inconsistent stack depth at address 0 (0 and 1)",
+       "Stack Overflow"},
+      // 0: PUSH 1   2: ADD   3: HALT
+      {{PUSH, 1, ADD, HALT}, "stack underflow at address 2", "Stack Underflow"},
+      // 0: RET
+      {{RET}, "RET outside a function at address 0", "Stack Underflow"},
+  };
+  for (const auto &program : rejected) {
+    create_bytecode_file(test_file, program.bytecode);
+    VM checked;
+    checked.engine = ENGINE_THREADED;
+    checked.load(test_file);
+    assert(!checked.verification.verified &&
+           checked.verification.reason == program.reason &&
+           "Program should have been rejected");
+    std::string error;
+    try {
+      checked.run();
+    } catch (const std::runtime_error &e) {
+      error = e.what();
+    }
+    assert(!checked.unchecked && error == program.error &&
+           "Rejected program did not fail in the checked engine");
+  }
+  std::cout << "test_vm_verifier passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_tagged_values() {
+  std::cout << "Running test_vm_tagged_values..." << std::endl;
+  std::string test_file = "test_tagged_values.bin";
+  // mem[0] = (1 << 62) - 1; mem[0] += 1; push mem[0]; push CONS(0, 0);
+  // mem[1] = (1 << 62) - 1; mem[1] = 1 + mem[1];
+  // mem[2] = 1 << 62; mem[2] -= 1
+  create_bytecode_file(test_file,
+                       {PUSH, 1, PUSH, 62, SHL, PUSH, 1, SUB, STORE, 0, LOAD, 0,
+                        PUSH, 1, ADD, STORE, 0, LOAD, 0, PUSH, 0, PUSH, 0,
+                        CONS, PUSH, 1, PUSH, 62, SHL, PUSH, 1, SUB, STORE, 1,
+                        PUSH, 1, LOAD, 1, ADD, STORE, 1, PUSH, 1, PUSH, 62, SHL,
+                        STORE, 2, LOAD, 2, PUSH, 1, SUB, STORE, 2, HALT});
+
+  // Values are 63 bits wide on every engine, fused or not.
+  struct Config {
+    EngineKind engine;
+    bool fusion;
+  };
+  const Config configs[] = {{ENGINE_SWITCH, true},
+                            {ENGINE_THREADED, true},
+                            {ENGINE_THREADED, false},
+                            {ENGINE_REGISTER, true}};
+  for (const Config &config : configs) {
+    VM vm;
+    vm.engine = config.engine;
+    vm.fusion = config.fusion;
+    vm.jit = false;
+    vm.load(test_file);
+    vm.run();
+
+    assert(vm.register_stack.get_size() == 2 && "Wrong stack depth");
+    const StackItem &pair = vm.register_stack.get_item(1);
+    const StackItem &sum = vm.register_stack.get_item(0);
+    assert(pair.is_obj() && pair.value() != 0 && "CONS did not push an object");
+    assert(!sum.is_obj() && sum.value() == -(1L << 62) && "Sum did not wrap");
+    // Fused updates of memory leave what the unfused LOAD ...; STORE would.
+    assert(vm.data_memory.get(0) == -(1L << 62) &&
+           vm.data_memory.get(1) == -(1L << 62) &&
+           vm.data_memory.get(2) == (1L << 62) - 1 &&
+           "Memory did not wrap");
+
+    // The GC finds the pair through its tag.
+    vm.gc();
+    assert(vm.num_objects == 1 && "Pair on the stack was collected");
+    vm.register_stack.pop();
+    vm.gc();
+    assert(vm.num_objects == 0 && "Unreachable pair was not collected");
+  }
+  std::cout << "test_vm_tagged_values passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_stack_limits() {
+  std::cout << "Running test_vm_stack_limits..." << std::endl;
+  std::string test_file = "test_stack_limits.bin";
+  // 0: PUSH 50000   2: CALL 5   4: HALT
+  // 5: DUP   6: JZ 13   8: PUSH 1   10: SUB   11: CALL 5   13: RET
+  create_bytecode_file(test_file, {PUSH, 50000, CALL, 5, HALT, DUP, JZ, 13,
+                                   PUSH, 1, SUB, CALL, 5, RET});
+
+  const EngineKind engines[] = {ENGINE_SWITCH, ENGINE_THREADED,
+                                ENGINE_REGISTER};
+  for (EngineKind engine : engines) {
+    // Recursion deeper than the old fixed 10,240 frames.
+    VM vm;
+    vm.engine = engine;
+    vm.load(test_file);
+    vm.run();
+    assert(vm.register_stack.pop() == 0 && vm.call_stack.is_empty() &&
+           "Deep recursion did not return");
+
+    // A smaller limit turns the same recursion into an overflow, caught by
+    // the guard page in the fast engines.
+    VM limited;
+    limited.engine = engine;
+    limited.call_stack.resize(1000);
+    limited.load(test_file);
+    std::string error;
+    try {
+      limited.run();
+    } catch (const std::runtime_error &e) {
+      error = e.what();
+    }
+    assert(error == "Stack Overflow" &&
+           limited.call_stack.get_size() == 1000 &&
+           "Call stack limit not enforced");
+  }
+
+  // Operand stack overflow, and a verifier that knows the limits.
+  // 0: PUSH 1   2: PUSH 2   4: PUSH 3   6: HALT
+  create_bytecode_file(test_file, {PUSH, 1, PUSH, 2, PUSH, 3, HALT});
+  VM small;
+  small.engine = ENGINE_THREADED;
+  small.register_stack.resize(2);
+  small.load(test_file);
+  assert(!small.verification.verified &&
+         small.verification.reason == "needs 3 stack slots" &&
+         "Verifier ignored the stack size");
+  std::string error;
+  try {
+    small.run();
+  } catch (const std::runtime_error &e) {
+    error = e.what();
+  }
+  assert(error == "Stack Overflow" && small.register_stack.get_size() == 2 &&
+         "Operand stack limit not enforced");
+  std::cout << "test_vm_stack_limits passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_load_modes() {
+  std::cout << "Running test_vm_load_modes..." << std::endl;
+  std::string test_file = "test_load_modes.bin";
+  // 40,000 x (PUSH i, POP), then PUSH 7, HALT: larger than the old 20,480
+  // word limit, and more than a page.
+  std::vector<long> bytecode;
+  for (long i = 0; i < 40000; ++i) {
+    bytecode.insert(bytecode.end(), {PUSH, i, POP});
+  }
+  bytecode.insert(bytecode.end(), {PUSH, 7, HALT});
+  create_bytecode_file(test_file, bytecode);
+
+  const LoadMode modes[] = {LOAD_LAZY, LOAD_PREFAULT, LOAD_ADVISE};
+  for (LoadMode mode : modes) {
+    VM vm;
+    vm.load_mode = mode;
+    vm.engine = ENGINE_THREADED;
+    vm.load(test_file);
+    assert(vm.program_memory.size() == bytecode.size() &&
+           "Program memory not sized to the file");
+    for (unsigned long i = 0; i < bytecode.size(); ++i) {
+      assert(vm.program_memory.get(i) == bytecode[i] &&
+             "Program memory does not match the file");
+    }
+    vm.run();
+    assert(vm.register_stack.pop() == 7 && vm.register_stack.is_empty() &&
+           "Mapped program ran incorrectly");
+  }
+  std::cout << "test_vm_load_modes passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+// Little-endian and varint encoders for building .bvm files by hand
+void put_le(std::string &out, unsigned long value, int bytes) {
+  for (int i = 0; i < bytes; ++i)
+    out += (char)(value >> (8 * i));
+}
+
+void put_varint(std::string &out, unsigned long value) {
+  for (; value >= 0x80; value >>= 7)
+    out += (char)(value | 0x80);
+  out += (char)value;
+}
+
+// A .bvm with the given (kind, count, contents) sections.
+std::string make_container(
+    const std::vector<std::tuple<unsigned, unsigned long, std::string>>
+        &sections,
+    unsigned long version = BVM_VERSION) {
+  std::string table, contents;
+  unsigned long offset = BVM_HEADER_SIZE + BVM_SECTION_SIZE * sections.size();
+  for (const auto &section : sections) {
+    const std::string &bytes = std::get<2>(section);
+    put_le(table, std::get<0>(section), 4);
+    put_le(table, std::get<1>(section), 4);
+    put_le(table, offset + contents.size(), 8);
+    put_le(table, bytes.size(), 4);
+    put_le(table, crc32c((const unsigned char *)bytes.data(), bytes.size()), 4);
+    contents += bytes;
+  }
+  std::string file("BVM", 4);
+  put_le(file, version, 2);
+  put_le(file, 0, 2);
+  put_le(file, sections.size(), 4);
+  put_le(file, crc32c((const unsigned char *)table.data(), table.size()), 4);
+  return file + table + contents;
+}
+
+// Loads `bytes` as a file and returns the load error, or "" if it loaded.
+std::string load_container(VM &vm, const std::string &bytes) {
+  std::string test_file = "test_container.bvm";
+  std::ofstream(test_file, std::ios::binary) << bytes;
+  std::string error;
+  try {
+    vm.load(test_file);
+  } catch (const std::runtime_error &e) {
+    error = e.what();
+  }
+  remove(test_file.c_str()); // Clean up
+  return error;
+}
+
+void test_vm_container() {
+  std::cout << "Running test_vm_container..." << std::endl;
+  // 0: PUSH -300   2: CALL 5   4: HALT   5: LOAD 3   7: ADD   8: RET
+  std::string code;
+  code += (char)PUSH;
+  put_varint(code, 599); // zigzag(-300)
+  code += (char)CALL;
+  put_varint(code, 10); // zigzag(5)
+  code += (char)HALT;
+  code += (char)LOAD;
+  put_varint(code, 6); // zigzag(3)
+  code += (char)ADD;
+  code += (char)RET;
+  // data[2..3] = {7, 1000}
+  std::string data;
+  put_varint(data, 2);
+  put_varint(data, 2);
+  put_varint(data, 14);
+  put_varint(data, 2000);
+  std::string symbols;
+  symbols += (char)SYMBOL_CODE;
+  put_varint(symbols, 5);
+  put_varint(symbols, 4);
+  symbols += "func";
+  symbols += (char)SYMBOL_DATA;
+  put_varint(symbols, 3);
+  put_varint(symbols, 5);
+  symbols += "scale";
+  // Lines 2, 3, 4 and 7 at addresses 0, 2, 4 and 5
+  std::string lines;
+  for (unsigned long delta : {0, 4, 2, 2, 2, 2, 1, 6})
+    put_varint(lines, delta);
+  std::string good = make_container({{SECTION_CODE, 9, code},
+                                     {SECTION_DATA, 1, data},
+                                     {SECTION_SYMBOLS, 2, symbols},
+                                     {SECTION_LINES, 4, lines},
+                                     {99, 0, "skipped"}});
+
+  const EngineKind engines[] = {ENGINE_SWITCH, ENGINE_THREADED,
+                                ENGINE_REGISTER};
+  for (EngineKind engine : engines) {
+    VM vm;
+    vm.engine = engine;
+    assert(load_container(vm, good) == "" && "Valid container was rejected");
+    assert(vm.program_memory.size() == 9 && vm.program_memory.get(1) == -300 &&
+           vm.program_memory.get(3) == 5 && "Code not unpacked to an image");
+    assert(vm.data_memory.get(2) == 7 && vm.data_memory.get(3) == 1000 &&
+           "Initialized data not loaded");
+    assert(vm.debug_info.labels().at("func") == 5 &&
+           vm.debug_info.labels().count("scale") == 0 &&
+           vm.debug_info.data_labels().at("scale") == 3 &&
+           vm.debug_info.line_of(0) == 2 && vm.debug_info.line_of(6) == 7 &&
+           "Debug info not loaded");
+    vm.run();
+    assert(vm.register_stack.pop() == 700 && vm.register_stack.is_empty() &&
+           "Container program ran incorrectly");
+
+    // A second load into the same VM starts from zeroed data memory.
+    vm.data_memory.store(5, 42);
+    assert(load_container(vm, make_container({{SECTION_CODE, 9, code}})) ==
+               "" &&
+           "Reload was rejected");
+    assert(vm.data_memory.get(2) == 0 && vm.data_memory.get(3) == 0 &&
+           vm.data_memory.get(5) == 0 && "Data memory kept the old program's");
+  }
+
+  // The code is checked on load, the symbols only when they are used.
+  VM vm;
+  std::string bad = good;
+  bad[BVM_HEADER_SIZE + 5 * BVM_SECTION_SIZE] ^= 1;
+  assert(load_container(vm, bad) ==
+             "VM Load Error: Corrupt code section in .bvm file." &&
+         "Damaged code not rejected");
+  bad = good;
+  bad[bad.size() - 7 - lines.size() - 1] ^= 1;
+  assert(load_container(vm, bad) == "" && "Damaged symbols checked on load");
+  std::string error;
+  try {
+    vm.debug_info.labels();
+  } catch (const std::runtime_error &e) {
+    error = e.what();
+  }
+  assert(error == "VM Load Error: Corrupt symbol section in .bvm file." &&
+         "Damaged symbols not rejected");
+  assert(load_container(vm, make_container({{SECTION_CODE, 9, code}}, 2)) ==
+             "VM Load Error: Unsupported .bvm version 2." &&
+         "Future version not rejected");
+  assert(load_container(vm, make_container({{SECTION_CODE, 10, code}})) ==
+             "VM Load Error: Corrupt code section in .bvm file." &&
+         "Wrong code size not rejected");
+  assert(load_container(vm, make_container({{SECTION_DATA, 1, data}})) ==
+             "VM Load Error: .bvm file has no code." &&
+         "Container without code not rejected");
+  std::cout << "test_vm_container passed" << std::endl;
+}
+
+void test_vm_profile() {
+  std::cout << "Running test_vm_profile..." << std::endl;
+  std::string test_file = "test_profile.bin";
+  //  0: PUSH 0    2: CALL 7    4: CALL 7    6: HALT
+  //  7: PUSH 3    9: CALL 13  11: POP      12: RET
+  // 13: DUP      14: JZ 21    16: PUSH 1   18: SUB   19: CALL 13   21: RET
+  create_bytecode_file(test_file,
+                       {PUSH, 0, CALL, 7, CALL, 7, HALT, PUSH, 3, CALL, 13,
+                        POP, RET, DUP, JZ, 21, PUSH, 1, SUB, CALL, 13, RET});
+
+  VM vm;
+  vm.engine = ENGINE_REGISTER; // Profiles always come from the threaded one
+  vm.profile = true;
+  vm.load(test_file);
+  vm.run();
+  assert(vm.register_stack.pop() == 0 && vm.register_stack.is_empty() &&
+         "Profiled program ran incorrectly");
+  assert(vm.profiler.instructions() == 54 && "Wrong instruction count");
+
+  // DUP; JZ is fused on load, but each is counted at its own address.
+  std::ostringstream csv;
+  vm.profiler.write_csv(vm.program, csv);
+  assert(csv.str().find("\n13,8,") != std::string::npos &&
+         csv.str().find("\n14,8,") != std::string::npos &&
+         csv.str().find("\n6,1,") != std::string::npos &&
+         "Wrong per-address counts");
+  std::ofstream("test_profile.csv") << csv.str();
+  assert(load_fusion_profile("test_profile.csv").at(14) == 8 &&
+         "Profile is not a fusion profile");
+  remove("test_profile.csv");
+
+  // g recurses three levels deep in each of the two calls of f.
+  std::ostringstream folded;
+  vm.profiler.write_folded(vm.program, vm.debug_info, folded);
+  assert(folded.str() == "(main) 4\n"
+                         "(main);pc_7 8\n"
+                         "(main);pc_7;pc_13 12\n"
+                         "(main);pc_7;pc_13;pc_13 12\n"
+                         "(main);pc_7;pc_13;pc_13;pc_13 12\n"
+                         "(main);pc_7;pc_13;pc_13;pc_13;pc_13 6\n" &&
+         "Wrong folded stacks");
+
+  std::ostringstream json;
+  vm.profiler.write_json(vm.program, vm.debug_info, json);
+  assert(json.str().find("{\"function\": \"pc_13\", \"pc\": 13, "
+                         "\"calls\": 8, \"inclusive\": 42, "
+                         "\"exclusive\": 42}") != std::string::npos &&
+         json.str().find("{\"function\": \"pc_7\", \"pc\": 7, "
+                         "\"calls\": 2, \"inclusive\": 50, "
+                         "\"exclusive\": 8}") != std::string::npos &&
+         "Wrong per-function counts");
+  std::cout << "test_vm_profile passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+static VM *sampled_vm = nullptr;
+
+static void request_sample(int) { sampled_vm->sample_requested = true; }
+
+void test_vm_sample() {
+  std::cout << "Running test_vm_sample..." << std::endl;
+  std::string test_file = "test_sample.bin";
+  // The program of test_vm_profile.
+  create_bytecode_file(test_file,
+                       {PUSH, 0, CALL, 7, CALL, 7, HALT, PUSH, 3, CALL, 13,
+                        POP, RET, DUP, JZ, 21, PUSH, 1, SUB, CALL, 13, RET});
+
+  VM vm;
+  vm.load(test_file);
+  // g two levels deep below f, then the top level, then a stack deeper than
+  // the sampler keeps.
+  Stack calls(Sampler::MAX_DEPTH + 1);
+  calls.push(4);
+  calls.push(11);
+  calls.push(21);
+  vm.sampler.take(16, calls);
+  vm.sampler.take(19, calls);
+  vm.sampler.take(6, Stack(1));
+  calls.resize(Sampler::MAX_DEPTH + 1);
+  for (unsigned long i = 0; i <= Sampler::MAX_DEPTH; ++i)
+    calls.push(21);
+  vm.sampler.take(14, calls);
+  assert(vm.sampler.samples() == 4 && "Wrong sample count");
+
+  std::ostringstream collapsed;
+  vm.sampler.write_collapsed(vm.program, vm.debug_info, collapsed);
+  std::string deep = "...";
+  for (unsigned long i = 0; i < Sampler::MAX_DEPTH; ++i)
+    deep += ";pc_13";
+  assert(collapsed.str() == "(main) 1\n"
+                             "(main);pc_7;pc_13;pc_13 2\n" +
+                                 deep + " 1\n" &&
+         "Wrong collapsed stacks");
+
+  std::ostringstream report;
+  vm.sampler.report(vm.program, vm.debug_info, report);
+  assert(report.str().find("Samples: 4") != std::string::npos &&
+         "Wrong sample report");
+  vm.sampler.reset();
+  assert(vm.sampler.samples() == 0 && "Samples not cleared");
+  remove(test_file.c_str());
+
+  // Every engine stops for SIGPROF and carries on where it was.
+  test_file = "test_sample_loop.bin";
+  // PUSH 3000000, loop: DUP, JZ end, PUSH 1, SUB, JMP loop, end: HALT
+  create_bytecode_file(test_file, {PUSH, 3000000, DUP, JZ, 10, PUSH, 1, SUB,
+                                   JMP, 2, HALT});
+  sampled_vm = &vm;
+  signal(SIGPROF, request_sample);
+  struct itimerval timer = {};
+  timer.it_interval.tv_usec = 100;
+  timer.it_value = timer.it_interval;
+  for (EngineKind engine :
+       {ENGINE_THREADED, ENGINE_REGISTER, ENGINE_SWITCH}) {
+    vm.engine = engine;
+    vm.load(test_file);
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    vm.run();
+    struct itimerval off = {};
+    setitimer(ITIMER_PROF, &off, nullptr);
+    assert(vm.register_stack.pop() == 0 && vm.register_stack.is_empty() &&
+           "Sampled program ran incorrectly");
+    assert(vm.sampler.samples() > 0 && "No samples taken");
+  }
+  signal(SIGPROF, SIG_DFL);
+  std::cout << "test_vm_sample passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_trace() {
+  std::cout << "Running test_vm_trace..." << std::endl;
+  std::string test_file = "test_trace.bin";
+  std::string trace_file = "test_trace.trace";
+  // PUSH 5, loop: DUP, JZ end, PUSH 1, SUB, JMP loop, end: HALT
+  create_bytecode_file(test_file,
+                       {PUSH, 5, DUP, JZ, 10, PUSH, 1, SUB, JMP, 2, HALT});
+
+  for (EngineKind engine :
+       {ENGINE_THREADED, ENGINE_REGISTER, ENGINE_SWITCH}) {
+    VM vm;
+    vm.engine = engine;
+    vm.load(test_file);
+    vm.tracer.open(trace_file, 8);
+    vm.run();
+    vm.tracer.close();
+
+    // 1 + 5 * 5 + 3 instructions, of which the ring keeps the last 8.
+    Trace trace = read_trace(trace_file);
+    assert(trace.count == 29 && trace.records.size() == 8 &&
+           "Wrong trace length");
+    const TraceRecord &jmp = trace.records[4];
+    assert(jmp.pc == 8 && jmp.op == JMP && jmp.operand == 2 &&
+           jmp.depth == 1 && StackItem{jmp.top}.value() == 0 &&
+           "Wrong JMP record");
+    const TraceRecord &jz = trace.records[6];
+    assert(jz.pc == 3 && jz.op == JZ && jz.operand == 10 && jz.depth == 2 &&
+           "Wrong JZ record");
+    assert(trace.records[7].pc == 10 && trace.records[7].op == HALT &&
+           "Trace does not end at HALT");
+  }
+
+  // A ring that never fills is cut down to its records.
+  VM vm;
+  vm.load(test_file);
+  vm.tracer.open(trace_file, 1000);
+  vm.run();
+  vm.tracer.close();
+  Trace trace = read_trace(trace_file);
+  assert(trace.count == 29 && trace.records.size() == 29 &&
+         trace.records[0].op == PUSH && trace.records[0].operand == 5 &&
+         trace.records[0].depth == 0 && "Wrong unwrapped trace");
+  std::ifstream file(trace_file, std::ios::binary | std::ios::ate);
+  assert((unsigned long)file.tellg() ==
+             sizeof(TraceHeader) + 29 * sizeof(TraceRecord) &&
+         "Trace file not truncated");
+  file.close();
+
+  std::ofstream(trace_file) << "not a trace";
+  bool caught = false;
+  try {
+    read_trace(trace_file);
+  } catch (const std::runtime_error &e) {
+    caught = std::string(e.what()).find("not a trace") != std::string::npos;
+  }
+  assert(caught && "Bad trace accepted");
+  std::cout << "test_vm_trace passed" << std::endl;
+
+  remove(trace_file.c_str());
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_breakpoints() {
+  std::cout << "Running test_vm_breakpoints..." << std::endl;
+  std::string test_file = "test_breakpoints.bin";
+  // The loop of test_vm_fusion: mem[0] counts down from 3 while mem[1] adds
+  // up 5s. 4 is the head of LOAD; JZ, 10 is inside LOAD; PUSH; ADD; STORE
+  // and 19 inside both LOAD; PUSH; SUB; STORE and PUSH; SUB.
+  create_bytecode_file(test_file, {0x01, 3,    0x30, 0,    0x31, 0,    0x21,
+                                   24,   0x31, 1,    0x01, 5,    0x10, 0x30,
+                                   1,    0x31, 0,    0x01, 1,    0x11, 0x30,
+                                   0,    0x20, 4,    0x31, 1,    0xFF});
+
+  for (EngineKind engine :
+       {ENGINE_THREADED, ENGINE_REGISTER, ENGINE_SWITCH}) {
+    VM vm;
+    vm.engine = engine;
+    vm.jit_code.threshold = 1;
+    vm.load(test_file);
+    Breakpoint when_last, when_big;
+    when_last.subject = Breakpoint::MEMORY;
+    when_last.index = 0;
+    when_last.value = 1;
+    when_big.subject = Breakpoint::TOP;
+    when_big.relation = Breakpoint::GT;
+    when_big.value = 1;
+    vm.set_breakpoint(10);
+    vm.set_breakpoint(4, when_last);
+    vm.set_breakpoint(19, when_big);
+    assert(vm.program.is_break(vm.program.index_of(10)) &&
+           vm.program.at(vm.program.index_of(8)).exec == LOAD &&
+           vm.program.at(vm.program.index_of(15)).exec == LOAD &&
+           vm.program.at(vm.program.index_of(17)).exec == PUSH &&
+           "Sequences through a break were not unfused");
+
+    // Every stop reads one command from the debugger.
+    std::istringstream commands("c\nc\nc\nc\n");
+    std::ostringstream output;
+    std::streambuf *in = std::cin.rdbuf(commands.rdbuf());
+    std::streambuf *out = std::cout.rdbuf(output.rdbuf());
+    vm.run();
+    std::cin.rdbuf(in);
+    std::cout.rdbuf(out);
+    assert(vm.breakpoints[10].hits == 3 && vm.breakpoints[4].hits == 1 &&
+           vm.breakpoints[19].hits == 0 && "Wrong breakpoint hits");
+    assert(output.str().find("Stopped at PC: 4 (breakpoint, hit 1)") !=
+               std::string::npos &&
+           "Conditional breakpoint did not stop");
+    assert(vm.register_stack.pop() == 15 && "Wrong result past breakpoints");
+
+    vm.clear_breakpoint(10);
+    vm.clear_breakpoint(4);
+    vm.clear_breakpoint(19);
+    assert(vm.program.at(vm.program.index_of(4)).exec == OP_LOAD_JZ &&
+           vm.program.at(vm.program.index_of(8)).exec ==
+               OP_LOAD_PUSH_ADD_STORE &&
+           vm.program.at(vm.program.index_of(15)).exec ==
+               OP_LOAD_PUSH_SUB_STORE &&
+           vm.program.at(vm.program.index_of(17)).exec == OP_PUSH_SUB &&
+           "Clearing the breaks did not restore fusion");
+  }
+
+  // Breakpoints are kept across loads, but only at instruction addresses.
+  VM vm;
+  vm.load(test_file);
+  vm.set_breakpoint(2);
+  vm.load(test_file);
+  assert(vm.program.is_break(vm.program.index_of(2)) &&
+         "Breakpoint lost on reload");
+  bool caught = false;
+  try {
+    vm.set_breakpoint(3); // The operand of STORE
+  } catch (const std::runtime_error &) {
+    caught = true;
+  }
+  assert(caught && "Breakpoint set inside an instruction");
+  std::cout << "test_vm_breakpoints passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_watchpoints() {
+  std::cout << "Running test_vm_watchpoints..." << std::endl;
+  std::string test_file = "test_watchpoints.bin";
+  // The loop of test_vm_fusion. data[0] is stored at 2 and at 20, inside
+  // LOAD; PUSH; SUB; STORE, and data[1] is loaded at 8, inside
+  // LOAD; PUSH; ADD; STORE, and at 24.
+  create_bytecode_file(test_file, {0x01, 3,    0x30, 0,    0x31, 0,    0x21,
+                                   24,   0x31, 1,    0x01, 5,    0x10, 0x30,
+                                   1,    0x31, 0,    0x01, 1,    0x11, 0x30,
+                                   0,    0x20, 4,    0x31, 1,    0xFF});
+
+  for (EngineKind engine :
+       {ENGINE_THREADED, ENGINE_REGISTER, ENGINE_SWITCH}) {
+    VM vm;
+    vm.engine = engine;
+    vm.jit_code.threshold = 1;
+    vm.load(test_file);
+    vm.set_watchpoint(0, false);
+    vm.set_watchpoint(1, true);
+    assert(vm.program.is_break(vm.program.index_of(20)) &&
+           vm.program.is_break(vm.program.index_of(8)) &&
+           !vm.program.is_break(vm.program.index_of(13)) &&
+           "Wrong instructions patched");
+
+    // data[0] changes 4 times and data[1] is read 4 times.
+    std::istringstream commands("c\nc\nc\nc\nc\nc\nc\nc\n");
+    std::ostringstream output;
+    std::streambuf *in = std::cin.rdbuf(commands.rdbuf());
+    std::streambuf *out = std::cout.rdbuf(output.rdbuf());
+    vm.run();
+    std::cin.rdbuf(in);
+    std::cout.rdbuf(out);
+    assert(vm.watchpoints[0].hits == 4 && vm.watchpoints[1].hits == 4 &&
+           "Wrong watchpoint hits");
+    assert(output.str().find("Watchpoint data[0]: 3 -> 2 at PC 20") !=
+               std::string::npos &&
+           output.str().find("Read watchpoint data[1] = 15 at PC 24") !=
+               std::string::npos &&
+           "Wrong watchpoint report");
+    assert(vm.register_stack.pop() == 15 && "Wrong result past watchpoints");
+
+    vm.clear_watchpoint(0);
+    vm.clear_watchpoint(1);
+    assert(vm.program.at(vm.program.index_of(8)).exec ==
+               OP_LOAD_PUSH_ADD_STORE &&
+           vm.program.at(vm.program.index_of(15)).exec ==
+               OP_LOAD_PUSH_SUB_STORE &&
+           !vm.program.is_break(vm.program.index_of(2)) &&
+           "Clearing the watchpoints did not restore the program");
+  }
+
+  VM vm;
+  vm.load(test_file);
+  bool caught = false;
+  try {
+    vm.set_watchpoint(vm.data_memory.size(), false);
+  } catch (const std::runtime_error &) {
+    caught = true;
+  }
+  assert(caught && "Watchpoint set outside data memory");
+  std::cout << "test_vm_watchpoints passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_generational() {
+  std::cout << "Running test_vm_generational..." << std::endl;
+  std::string test_file = "test_generational.bin";
+  // mem[0] = 1000; push 0; loop: push CONS(top, 0); push CONS(0, 0); POP;
+  // mem[0] -= 1; JNZ loop. Leaves a chain of 1000 pairs through their heads
+  // and makes as much garbage.
+  create_bytecode_file(test_file,
+                       {PUSH, 1000, STORE, 0, PUSH, 0, PUSH, 0, CONS, PUSH, 0,
+                        PUSH, 0, CONS, POP, LOAD, 0, PUSH, 1, SUB, STORE, 0,
+                        LOAD, 0, JNZ, 6, HALT});
+
+  for (EngineKind engine :
+       {ENGINE_THREADED, ENGINE_REGISTER, ENGINE_SWITCH}) {
+    VM vm;
+    vm.engine = engine;
+    vm.jit_code.threshold = 1;
+    vm.collector = COLLECTOR_GENERATIONAL;
+    vm.nursery.resize(101);
+    vm.load(test_file);
+    vm.run();
+
+    assert(vm.gc_stats.minor.count() == 2000 / 101 && "Wrong number of minor GCs");
+    assert(vm.register_stack.get_size() == 1 && "Wrong stack depth");
+    unsigned long length = 0;
+    for (Object *pair = (Object *)vm.register_stack.get_item(0).value(); pair;
+         pair = pair->pair.head) {
+      assert(pair->type == OBJ_PAIR && !pair->pair.tail && "Pair corrupted");
+      ++length;
+    }
+    assert(length == 1000 && "Chain lost pairs");
+    vm.gc();
+    assert(vm.num_objects == 1000 && "Wrong objects after gc()");
+    vm.register_stack.pop();
+    vm.gc();
+  }
+  std::cout << "test_vm_generational passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
+
+void test_vm_semispace() {
+  std::cout << "Running test_vm_semispace..." << std::endl;
+  std::string test_file = "test_semispace.bin";
+  // The loop of test_vm_generational: a chain of 1000 pairs and as much
+  // garbage.
+  create_bytecode_file(test_file,
+                       {PUSH, 1000, STORE, 0, PUSH, 0, PUSH, 0, CONS, PUSH, 0,
+                        PUSH, 0, CONS, POP, LOAD, 0, PUSH, 1, SUB, STORE, 0,
+                        LOAD, 0, JNZ, 6, HALT});
+
+  for (EngineKind engine :
+       {ENGINE_THREADED, ENGINE_REGISTER, ENGINE_SWITCH}) {
+    VM vm;
+    vm.engine = engine;
+    vm.jit_code.threshold = 1;
+    vm.collector = COLLECTOR_SEMISPACE;
+    vm.from_space.resize(101);
+    vm.to_space.resize(101);
+    vm.load(test_file);
+    vm.run();
+
+    assert(vm.gc_stats.full.count() > 0 && "The spaces should have been collected");
+    assert(vm.register_stack.get_size() == 1 && "Wrong stack depth");
+    unsigned long length = 0;
+    for (Object *pair = (Object *)vm.register_stack.get_item(0).value(); pair;
+         pair = pair->pair.head) {
+      assert(vm.from_space.contains(pair) && pair->type == OBJ_PAIR &&
+             !pair->pair.tail && "Pair corrupted");
+      ++length;
+    }
+    assert(length == 1000 && "Chain lost pairs");
+    vm.gc();
+    assert(vm.num_objects == 1000 && "Wrong objects after gc()");
+    vm.register_stack.pop();
+    vm.gc();
+  }
+  std::cout << "test_vm_semispace passed" << std::endl;
+
+  remove(test_file.c_str()); // Clean up
+}
 
 int main() {
   try {
     test_vm_push_add_halt();
     test_vm_store_load_halt();
+    test_vm_threaded_loop();
+    test_vm_threaded_error();
+    test_vm_load_validation();
+    test_vm_fusion();
+    test_vm_register();
+    test_vm_jit();
+    test_vm_verifier();
+    test_vm_tagged_values();
+    test_vm_stack_limits();
+    test_vm_load_modes();
+    test_vm_container();
+    test_vm_profile();
+    test_vm_sample();
+    test_vm_trace();
+    test_vm_breakpoints();
+    test_vm_watchpoints();
+    test_vm_generational();
+    test_vm_semispace();
   } catch (const std::runtime_error &e) {
     std::cerr << "Test Error: " << e.what() << std::endl;
     return 1;